@@ -0,0 +1,115 @@
+/*
+ * bench_civiltime.cpp
+ *
+ * Micro-benchmark for NTPServer::getCurrentTime(). Compares the constant-time
+ * days-from-civil conversion against the original implementation, which
+ * stepped tm_sec once per elapsed second and normalized with mktime(), at
+ * increasing times since sync. Also checks that both agree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <NTPServer.h>
+
+#define MIN_CALLS    20
+#define MIN_NS       200000000.0
+
+class BenchServer : public NTPServer
+{
+public:
+  int civilTimeAt(t_ntpSysClock sysClock, struct tm *outTime, t_ntpSysClock *outMilliseconds)
+  {
+    return _civilTimeAt(sysClock, outTime, outMilliseconds);
+  }
+};
+
+/* Original implementation */
+static int legacyCurrentTime(struct tm refTime, t_ntpSysClock refMicros, t_ntpSysClock sysClock,
+                             struct tm *outTime, t_ntpSysClock *outMilliseconds)
+{
+  t_ntpSysClock deltaMicros = sysClock - refMicros;
+
+  *outTime = refTime;
+
+  while (deltaMicros > 1000000)
+  {
+    deltaMicros -= 1000000;
+    outTime->tm_sec++;
+
+    if (outTime->tm_sec > 250)
+      mktime(outTime);
+  }
+
+  mktime(outTime);
+  *outMilliseconds = deltaMicros / 1000;
+
+  return L_NTP_R_SUCCESS;
+}
+
+static double nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main()
+{
+  static const struct { const char *label; uint64_t micros; } ages[] =
+  {
+    { "1 s",    1000500ULL },
+    { "1 h",    3600000500ULL },
+    { "1 day",  86400000500ULL },
+  };
+
+  BenchServer server;
+  struct tm   tmRef = {}, a, b;
+  t_ntpSysClock refMicros = 1000000, msA, msB;
+  volatile int sink = 0;
+  unsigned int i, n;
+
+  // The original implementation depends on the process time zone
+  setenv("TZ", "UTC", 1);
+  tzset();
+
+  tmRef.tm_year = 2022 - 1900;
+  tmRef.tm_mon  = 11;
+  tmRef.tm_mday = 31;
+  tmRef.tm_hour = 23;
+  tmRef.tm_min  = 59;
+  tmRef.tm_sec  = 30;
+  server.setReferenceTime(tmRef, refMicros);
+
+  printf("%-8s  %16s  %16s  %s\n", "age", "legacy ns/call", "O(1) ns/call", "result");
+
+  for (n = 0; n < sizeof(ages) / sizeof(ages[0]); n++)
+  {
+    t_ntpSysClock now = refMicros + ages[n].micros;
+    double t0, tLegacy, tCivil;
+    unsigned int calls;
+    char text[32];
+
+    // Legacy cost grows with the age, so run it until enough time has passed
+    t0 = nowNs();
+    for (calls = 0; calls < MIN_CALLS || nowNs() - t0 < MIN_NS; calls++)
+      sink = sink + legacyCurrentTime(tmRef, refMicros, now, &a, &msA);
+    tLegacy = (nowNs() - t0) / calls;
+
+    t0 = nowNs();
+    for (i = 0; i < 1000000; i++)
+      sink = sink + server.civilTimeAt(now + (i & 0x3FF), &b, &msB);
+    tCivil = (nowNs() - t0) / 1000000;
+
+    server.civilTimeAt(now, &b, &msB);
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &b);
+
+    printf("%-8s  %16.1f  %16.1f  %s.%03u %s\n", ages[n].label, tLegacy, tCivil, text, (unsigned)msB,
+           (a.tm_year == b.tm_year && a.tm_yday == b.tm_yday && a.tm_hour == b.tm_hour &&
+            a.tm_min == b.tm_min && a.tm_sec == b.tm_sec && msA == msB) ? "(match)" : "(MISMATCH)");
+  }
+
+  return (sink == 1 ? 1 : 0);
+}
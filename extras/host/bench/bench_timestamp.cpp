@@ -0,0 +1,126 @@
+/*
+ * bench_timestamp.cpp
+ *
+ * Micro-benchmark for the NTP timestamp engine. Compares the per-call cost and
+ * conversion error of NTPServer::_timestampAt() against the original
+ * repeated-subtraction/shift implementation, at increasing times since sync.
+ * Errors are measured against an exact 128-bit reference conversion.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <NTPServer.h>
+
+#define CALLS     2000000
+#define SAMPLES   200000
+
+class BenchServer : public NTPServer
+{
+public:
+  t_ntpTimestamp timestampAt(t_ntpSysClock sysClock) { return _timestampAt(sysClock); }
+  time_t referenceSeconds() { return _referenceTimeAsSeconds; }
+};
+
+/* Original implementation (timeval loop + approximate fraction) */
+static t_ntpTimestamp legacyTimestamp(time_t refSeconds, t_ntpSysClock refMicros, t_ntpSysClock sysClock)
+{
+  uint64_t delta = sysClock - refMicros;
+  uint32_t sec   = refSeconds;
+  uint32_t usec, w;
+
+  while (delta >= 100000000) { delta -= 100000000; sec += 100; }
+  while (delta >= 10000000)  { delta -= 10000000;  sec += 10;  }
+  while (delta >= 1000000)   { delta -= 1000000;   sec++;      }
+
+  usec = delta;
+  w = (usec * 1825) >> 5;
+  w = ((usec << 12) + (usec << 8) - w);
+
+  return ((t_ntpTimestamp)(uint32_t)(L_NTP_EPOCH + sec) << 32) | w;
+}
+
+/* Exact reference, rounded to the nearest 2^-32 s */
+static t_ntpTimestamp exactTimestamp(time_t refSeconds, t_ntpSysClock refMicros, t_ntpSysClock sysClock)
+{
+  unsigned __int128 delta = sysClock - refMicros;
+
+  return ((t_ntpTimestamp)(uint32_t)(L_NTP_EPOCH + refSeconds) << 32) +
+         (t_ntpTimestamp)(((delta << 32) + 500000) / 1000000);
+}
+
+static double nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double errorNs(t_ntpTimestamp a, t_ntpTimestamp b)
+{
+  int64_t d = (int64_t)(a - b);
+  return (d < 0 ? -d : d) * 1e9 / 4294967296.0;
+}
+
+int main()
+{
+  static const struct { const char *label; uint64_t micros; } ages[] =
+  {
+    { "1 ms",   1000ULL },
+    { "1 s",    1000000ULL },
+    { "1 min",  60000000ULL },
+    { "1 h",    3600000000ULL },
+    { "1 day",  86400000000ULL },
+    { "30 days", 2592000000000ULL },
+  };
+
+  BenchServer server;
+  struct tm   tmRef = {};
+  t_ntpSysClock refMicros = 1000000;
+  volatile t_ntpTimestamp sink = 0;
+  unsigned int i, a;
+
+  setenv("TZ", "UTC", 1);
+  tzset();
+
+  tmRef.tm_year = 2022 - 1900;
+  tmRef.tm_mday = 1;
+  server.setReferenceTime(tmRef, refMicros);
+
+  printf("%-8s  %14s  %14s  %16s  %16s\n", "age", "legacy ns/call", "engine ns/call", "legacy max err ns", "engine max err ns");
+
+  for (a = 0; a < sizeof(ages) / sizeof(ages[0]); a++)
+  {
+    t_ntpSysClock base = refMicros + ages[a].micros;
+    double t0, tLegacy, tEngine;
+    double maxLegacy = 0, maxEngine = 0, e;
+
+    t0 = nowNs();
+    for (i = 0; i < CALLS; i++)
+      sink = sink + legacyTimestamp(server.referenceSeconds(), refMicros, base + (i & 0xFFFFF));
+    tLegacy = (nowNs() - t0) / CALLS;
+
+    t0 = nowNs();
+    for (i = 0; i < CALLS; i++)
+      sink = sink + server.timestampAt(base + (i & 0xFFFFF));
+    tEngine = (nowNs() - t0) / CALLS;
+
+    srand(a + 1);
+    for (i = 0; i < SAMPLES; i++)
+    {
+      t_ntpSysClock c = base + (rand() % 1000000);
+      t_ntpTimestamp exact = exactTimestamp(server.referenceSeconds(), refMicros, c);
+
+      e = errorNs(legacyTimestamp(server.referenceSeconds(), refMicros, c), exact);
+      if (e > maxLegacy) maxLegacy = e;
+
+      e = errorNs(server.timestampAt(c), exact);
+      if (e > maxEngine) maxEngine = e;
+    }
+
+    printf("%-8s  %14.2f  %14.2f  %16.2f  %16.2f\n", ages[a].label, tLegacy, tEngine, maxLegacy, maxEngine);
+  }
+
+  return (sink == 1 ? 1 : 0);
+}
@@ -0,0 +1,327 @@
+/*
+ * bench_update.cpp
+ *
+ * Drives NTPServer::update() through an in-memory UDP transport, so that only
+ * the request path itself is measured (no sockets, no syscalls). For each kind
+ * of request it reports:
+ *
+ *   ns/req      Wall time per request
+ *   instr/req   Instructions retired per request (user space, perf_event_open;
+ *               n/a where the kernel does not allow it)
+ *   bytes/req   Bytes copied in and out of the server through the UDP interface
+ *               (a signed reply shows up as the full trailer, a crypto-NAK as 4 bytes)
+ *
+ * The interleaved case echoes the receive timestamp of the last reply as the
+ * origin timestamp, as an interleaved client does, so every reply is served
+ * from the client table.
+ *
+ * The NTS cases send a fresh-looking request with a cookie from the server's
+ * own master key, so they cost a cookie open, an authenticator check and a
+ * sealed reply with one (or, with placeholders, eight) new cookies.
+ *
+ * Usage: bench_update [requests]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <NTPServer.h>
+
+#define DEFAULT_REQUESTS   2000000
+#define BATCH              32
+
+/* Hands out the same datagram over and over, and swallows the replies */
+class MockUDP : public UDP
+{
+public:
+  const uint8_t *request;
+  size_t         requestLength;
+  unsigned long  remaining;
+  bool           interleaved;        // Origin timestamp = receive timestamp of the last reply
+  uint8_t        lastReceived[8];
+
+  uint64_t       bytesIn, bytesOut, replies;
+
+  MockUDP() { request = NULL; requestLength = 0; remaining = 0; interleaved = false; bytesIn = bytesOut = replies = 0; }
+
+  uint8_t begin(uint16_t /* port */) { return 1; }
+  void stop() { }
+
+  int beginPacket(IPAddress /* ip */, uint16_t /* port */) { return 1; }
+  int beginPacket(const char * /* host */, uint16_t /* port */) { return 1; }
+  int endPacket() { replies++; return 1; }
+  size_t write(uint8_t /* b */) { bytesOut++; return 1; }
+  size_t write(const uint8_t *buffer, size_t size)
+  {
+    if (size >= 48)
+      memcpy(lastReceived, &buffer[32], sizeof(lastReceived));
+
+    bytesOut += size;
+    return size;
+  }
+
+  int parsePacket()
+  {
+    if (remaining == 0)
+      return 0;
+
+    remaining--;
+    return requestLength;
+  }
+
+  int available() { return requestLength; }
+  int read() { return -1; }
+  int read(char *buffer, size_t len) { return read((unsigned char *)buffer, len); }
+
+  int read(unsigned char *buffer, size_t len)
+  {
+    size_t n = (len < requestLength ? len : requestLength);
+
+    memcpy(buffer, request, n);
+    bytesIn += n;
+
+    if (interleaved && n >= 32)
+      memcpy(&buffer[24], lastReceived, sizeof(lastReceived));
+
+    return n;
+  }
+
+  int peek() { return -1; }
+  void flush() { }
+
+  IPAddress remoteIP() { return IPAddress(192, 0, 2, 1); }
+  uint16_t remotePort() { return 123; }
+};
+
+static size_t buildNtsRequest(uint8_t *packet, const uint8_t *client, const uint8_t masterKey[L_NTP_NTS_MASTER_KEY],
+                              uint32_t period, int placeholders)
+{
+  // UID, cookie, placeholders, authenticator over all of it with nothing encrypted
+  NTPNtsCookies cookies;
+  NTPAesSiv     c2s;
+  uint8_t       keys[2 * L_NTP_NTS_KEY], nonce[L_NTP_NTS_NONCE];
+  size_t offset = 48;
+  int i;
+
+  for (i = 0; i < (int)sizeof(keys); i++)
+    keys[i] = (uint8_t)(i * 7 + 1);
+
+  cookies.setMasterKey(masterKey, 1);
+  cookies.nonce(nonce);
+  memcpy(packet, client, 48);
+
+  packet[offset++] = L_NTP_NTS_EF_UNIQUE_ID >> 8;
+  packet[offset++] = L_NTP_NTS_EF_UNIQUE_ID & 0xFF;
+  packet[offset++] = 0;
+  packet[offset++] = 4 + 32;
+  memset(&packet[offset], 0xA5, 32);
+  offset += 32;
+
+  for (i = 0; i <= placeholders; i++)
+  {
+    int type = (i == 0 ? L_NTP_NTS_EF_COOKIE : L_NTP_NTS_EF_PLACEHOLDER);
+
+    packet[offset++] = type >> 8;
+    packet[offset++] = type & 0xFF;
+    packet[offset++] = 0;
+    packet[offset++] = 4 + L_NTP_NTS_COOKIE;
+
+    if (i == 0)
+      cookies.seal(period, keys, &packet[offset]);
+    else
+      memset(&packet[offset], 0, L_NTP_NTS_COOKIE);
+
+    offset += L_NTP_NTS_COOKIE;
+  }
+
+  packet[offset + 0] = L_NTP_NTS_EF_AUTHENTICATOR >> 8;
+  packet[offset + 1] = L_NTP_NTS_EF_AUTHENTICATOR & 0xFF;
+  packet[offset + 2] = 0;
+  packet[offset + 3] = 8 + L_NTP_NTS_NONCE + L_NTP_AES_BLOCK;
+  packet[offset + 4] = 0;
+  packet[offset + 5] = L_NTP_NTS_NONCE;
+  packet[offset + 6] = 0;
+  packet[offset + 7] = L_NTP_AES_BLOCK;
+  memcpy(&packet[offset + 8], nonce, L_NTP_NTS_NONCE);
+
+  c2s.setKey(keys);
+  c2s.seal(packet, offset, nonce, L_NTP_NTS_NONCE, NULL, 0, &packet[offset + 8 + L_NTP_NTS_NONCE]);
+
+  return offset + 8 + L_NTP_NTS_NONCE + L_NTP_AES_BLOCK;
+}
+
+static double nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int openInstructionCounter()
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type           = PERF_TYPE_HARDWARE;
+  attr.size           = sizeof(attr);
+  attr.config         = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled       = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static void run(NTPServer &server, MockUDP &udp, int counter, const char *label,
+                const uint8_t *request, size_t length, unsigned long requests)
+{
+  double t0, ns;
+  long long instructions = -1;
+
+  udp.request       = request;
+  udp.requestLength = length;
+  udp.bytesIn = udp.bytesOut = udp.replies = 0;
+
+  // Warm up caches and branch predictors
+  udp.remaining = 10000;
+  while (udp.remaining > 0)
+    server.update(BATCH);
+
+  udp.bytesIn = udp.bytesOut = udp.replies = 0;
+  udp.remaining = requests;
+
+#ifdef __linux__
+  if (counter >= 0)
+  {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+
+  t0 = nowNs();
+
+  while (udp.remaining > 0)
+    server.update(BATCH);
+
+  ns = nowNs() - t0;
+
+#ifdef __linux__
+  if (counter >= 0)
+  {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+
+    if (read(counter, &instructions, sizeof(instructions)) != sizeof(instructions))
+      instructions = -1;
+  }
+#endif
+
+  printf("%-24s  %9.1f  ", label, ns / requests);
+
+  if (instructions >= 0)
+    printf("%10.0f  ", (double)instructions / requests);
+  else
+    printf("%10s  ", "n/a");
+
+  printf("%9.1f  %8.2f\n", (double)(udp.bytesIn + udp.bytesOut) / requests, (double)udp.replies / requests);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long requests = (argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_REQUESTS);
+
+  NTPServer server("GPS", L_NTP_STRAT_PRIMARY);
+  MockUDP   udp;
+  struct tm tmRef = {};
+  int counter;
+
+  uint8_t client[48]     = { (4 << 3) | L_NTP_MODE_CLIENT };
+  uint8_t shortClient[8] = { (4 << 3) | L_NTP_MODE_CLIENT };
+  uint8_t badMode[48]    = { (4 << 3) | 7 };
+  uint8_t badVersion[48] = { (1 << 3) | L_NTP_MODE_CLIENT };
+  uint8_t readvar[64]    = { (2 << 3) | L_NTP_MODE_CONTROL, L_NTP_CTL_READVAR };
+  const char *names      = "stratum,rootdisp,offset";
+  uint8_t sha1Client[72] = {}, cmacClient[68] = {};
+  const uint8_t sha1Key[] = "secretkey0123456789";
+  const uint8_t cmacKey[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+  NTPSha1 sha1;
+  NTPCmac cmac;
+  uint8_t ntsMasterKey[L_NTP_NTS_MASTER_KEY], ntsClient[L_NTP_MAX_RX_BUFF], ntsRefill[L_NTP_MAX_RX_BUFF];
+  size_t  cbNtsClient, cbNtsRefill;
+  uint32_t period;
+
+  // Control request: sequence 1, association 0, offset 0, count
+  readvar[3]  = 1;
+  readvar[11] = strlen(names);
+  memcpy(&readvar[12], names, strlen(names));
+
+  client[40] = 0xE6;   // Client transmit timestamp, echoed back as origin
+
+  // Signed requests: key ID 1 (SHA-1, 20 byte digest) and 2 (AES-CMAC, 16 bytes)
+  server.addKey(1, L_NTP_KEY_SHA1, sha1Key, sizeof(sha1Key) - 1);
+  server.addKey(2, L_NTP_KEY_AES128CMAC, cmacKey, sizeof(cmacKey));
+
+  memcpy(sha1Client, client, sizeof(client));
+  sha1Client[51] = 1;
+  sha1.init();
+  sha1.update(sha1Key, sizeof(sha1Key) - 1);
+  sha1.update(client, sizeof(client));
+  sha1.final(&sha1Client[52]);
+
+  memcpy(cmacClient, client, sizeof(client));
+  cmacClient[51] = 2;
+  cmac.setKey(cmacKey);
+  cmac.compute(client, sizeof(client), &cmacClient[52]);
+
+  tmRef.tm_year = 2022 - 1900;
+  tmRef.tm_mday = 1;
+  server.setReferenceTime(tmRef);
+
+  // NTS requests with cookies for the reference day (2022-01-01)
+  for (size_t i = 0; i < sizeof(ntsMasterKey); i++)
+    ntsMasterKey[i] = (uint8_t)(0x40 + i);
+
+  server.enableNts(ntsMasterKey, sizeof(ntsMasterKey));
+  period      = NTPNtsCookies::periodAt(1640995200UL + L_NTP_EPOCH);
+  cbNtsClient = buildNtsRequest(ntsClient, client, ntsMasterKey, period, 0);
+  cbNtsRefill = buildNtsRequest(ntsRefill, client, ntsMasterKey, period, L_NTP_NTS_MAX_COOKIES - 1);
+  server.begin(udp);
+
+  counter = openInstructionCounter();
+
+  printf("%u requests per case, batches of %d\n\n", (unsigned)requests, BATCH);
+  printf("%-24s  %9s  %10s  %9s  %8s\n", "request", "ns/req", "instr/req", "bytes/req", "replies");
+
+  run(server, udp, counter, "client (mode 3)", client, sizeof(client), requests);
+  run(server, udp, counter, "client + SHA1 MAC", sha1Client, sizeof(sha1Client), requests);
+  run(server, udp, counter, "client + AES-CMAC", cmacClient, sizeof(cmacClient), requests);
+  server.enableInterleaved(16);
+  udp.interleaved = true;
+  run(server, udp, counter, "client, interleaved", client, sizeof(client), requests);
+  udp.interleaved = false;
+  server.disableInterleaved();
+
+  run(server, udp, counter, "client + NTS", ntsClient, cbNtsClient, requests);
+  run(server, udp, counter, "client + NTS, 8 cookies", ntsRefill, cbNtsRefill, requests);
+  run(server, udp, counter, "control READVAR x3", readvar, 12 + strlen(names), requests);
+  run(server, udp, counter, "malformed: short", shortClient, sizeof(shortClient), requests);
+  run(server, udp, counter, "malformed: mode 7", badMode, sizeof(badMode), requests);
+  run(server, udp, counter, "malformed: version 1", badVersion, sizeof(badVersion), requests);
+
+  if (counter >= 0)
+    close(counter);
+
+  return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * kat_crypto.cpp
+ *
+ * Known-answer tests for the primitives in NTPCrypto.h, which the server uses
+ * for MACs and NTS without any library behind them:
+ *
+ *   SHA-1     FIPS 180 examples ("abc", the 448-bit message, a million 'a')
+ *   AES-128   FIPS-197 Appendix B and C.1
+ *   AES-CMAC  RFC 4493 examples 1 to 4
+ *   AES-SIV   RFC 5297 A.1, plus opening it again and rejecting it once
+ *             the tag, ciphertext or associated data has been tampered with
+ *
+ * With OpenSSL 3 the AES-SIV path that NTS takes (associated data and a
+ * nonce) is also compared against OpenSSL's AES-128-SIV, for every plaintext
+ * length up to a few blocks.
+ *
+ * Prints one line per test and exits with 1 if any of them failed.
+ *
+ * Usage: kat_crypto
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <NTPCrypto.h>
+
+#if defined(L_NTP_HAVE_OPENSSL)
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+#endif
+
+static int failures = 0;
+
+static size_t fromHex(const char *hex, uint8_t *out)
+{
+  size_t cb = 0;
+  unsigned int byte;
+
+  for (; hex[0] != 0; hex++)
+  {
+    if (hex[0] == ' ')
+      continue;
+
+    sscanf(hex, "%2x", &byte);
+    out[cb++] = (uint8_t)byte;
+    hex++;
+  }
+
+  return cb;
+}
+
+static void check(const char *name, const uint8_t *got, const char *expectedHex)
+{
+  uint8_t expected[128];
+  size_t  cb = fromHex(expectedHex, expected), i;
+  bool    ok = (memcmp(got, expected, cb) == 0);
+
+  printf("%-36s %s\n", name, ok ? "ok" : "FAIL");
+
+  if (!ok)
+  {
+    printf("  expected %s\n  got      ", expectedHex);
+
+    for (i = 0; i < cb; i++)
+      printf("%02x", got[i]);
+
+    printf("\n");
+    failures++;
+  }
+}
+
+static void expect(const char *name, bool ok)
+{
+  printf("%-36s %s\n", name, ok ? "ok" : "FAIL");
+
+  if (!ok)
+    failures++;
+}
+
+static void testSha1()
+{
+  NTPSha1 sha;
+  uint8_t digest[L_NTP_SHA1_DIGEST];
+  char    a[1001];
+  int     i;
+
+  sha.init();
+  sha.update("abc", 3);
+  sha.final(digest);
+  check("SHA-1 \"abc\"", digest, "a9993e36 4706816a ba3e2571 7850c26c 9cd0d89d");
+
+  sha.init();
+  sha.update("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56);
+  sha.final(digest);
+  check("SHA-1 448-bit message", digest, "84983e44 1c3bd26e baae4aa1 f95129e5 e54670f1");
+
+  // In uneven pieces, so that blocks are put together across update() calls
+  memset(a, 'a', sizeof(a));
+  sha.init();
+
+  for (i = 0; i < 1000; i++)
+    sha.update(a, (i & 1) ? 999 : 1001);
+
+  sha.final(digest);
+  check("SHA-1 million 'a'", digest, "34aa973c d4c4daa4 f61eeb2b dbad2731 6534016f");
+}
+
+static void testAes()
+{
+  NTPAes128 aes;
+  uint8_t key[L_NTP_AES128_KEY], in[L_NTP_AES_BLOCK], out[L_NTP_AES_BLOCK];
+
+  fromHex("2b7e1516 28aed2a6 abf71588 09cf4f3c", key);
+  fromHex("3243f6a8 885a308d 313198a2 e0370734", in);
+  aes.setKey(key);
+  aes.encrypt(in, out);
+  check("AES-128 FIPS-197 B", out, "3925841d 02dc09fb dc118597 196a0b32");
+
+  fromHex("00010203 04050607 08090a0b 0c0d0e0f", key);
+  fromHex("00112233 44556677 8899aabb ccddeeff", in);
+  aes.setKey(key);
+  aes.encrypt(in, out);
+  check("AES-128 FIPS-197 C.1", out, "69c4e0d8 6a7b0430 d8cdb780 70b4c55a");
+}
+
+static void testCmac()
+{
+  NTPCmac cmac;
+  uint8_t key[L_NTP_AES128_KEY], message[64], mac[L_NTP_AES_BLOCK];
+
+  fromHex("2b7e1516 28aed2a6 abf71588 09cf4f3c", key);
+  fromHex("6bc1bee2 2e409f96 e93d7e11 7393172a ae2d8a57 1e03ac9c 9eb76fac 45af8e51"
+          "30c81c46 a35ce411 e5fbc119 1a0a52ef f69f2445 df4f9b17 ad2b417b e66c3710", message);
+  cmac.setKey(key);
+
+  cmac.compute(message, 0, mac);
+  check("AES-CMAC RFC 4493 example 1", mac, "bb1d6929 e9593728 7fa37d12 9b756746");
+
+  cmac.compute(message, 16, mac);
+  check("AES-CMAC RFC 4493 example 2", mac, "070a16b4 6b4d4144 f79bdd9d d04a287c");
+
+  cmac.compute(message, 40, mac);
+  check("AES-CMAC RFC 4493 example 3", mac, "dfa66747 de9ae630 30ca3261 1497c827");
+
+  cmac.compute(message, 64, mac);
+  check("AES-CMAC RFC 4493 example 4", mac, "51f0bebf 7e3b9d92 fc497417 79363cfe");
+}
+
+static void testSiv()
+{
+  NTPAesSiv siv;
+  uint8_t key[L_NTP_AES_SIV_KEY], ad[24], plain[14], sealed[L_NTP_AES_BLOCK + 14], opened[14];
+
+  fromHex("fffefdfc fbfaf9f8 f7f6f5f4 f3f2f1f0 f0f1f2f3 f4f5f6f7 f8f9fafb fcfdfeff", key);
+  fromHex("10111213 14151617 18191a1b 1c1d1e1f 20212223 24252627", ad);
+  fromHex("11223344 55667788 99aabbcc ddee", plain);
+  siv.setKey(key);
+
+  siv.seal(ad, sizeof(ad), NULL, 0, plain, sizeof(plain), sealed);
+  check("AES-SIV RFC 5297 A.1", sealed, "85632d07 c6e8f37f 950acd32 0a2ecc93 40c02b96 90c4dc04 daef7f6a fe5c");
+
+  memset(opened, 0, sizeof(opened));
+  expect("AES-SIV RFC 5297 A.1 open", siv.open(ad, sizeof(ad), NULL, 0, sealed, sizeof(sealed), opened) &&
+                                      memcmp(opened, plain, sizeof(plain)) == 0);
+
+  sealed[3] ^= 0x01;
+  expect("AES-SIV rejects a bad tag", !siv.open(ad, sizeof(ad), NULL, 0, sealed, sizeof(sealed), opened));
+  sealed[3] ^= 0x01;
+
+  sealed[L_NTP_AES_BLOCK + 5] ^= 0x80;
+  expect("AES-SIV rejects a bad ciphertext", !siv.open(ad, sizeof(ad), NULL, 0, sealed, sizeof(sealed), opened));
+  sealed[L_NTP_AES_BLOCK + 5] ^= 0x80;
+
+  ad[0] ^= 0x01;
+  expect("AES-SIV rejects bad associated data", !siv.open(ad, sizeof(ad), NULL, 0, sealed, sizeof(sealed), opened));
+  ad[0] ^= 0x01;
+
+  expect("AES-SIV rejects an added nonce", !siv.open(ad, sizeof(ad), ad, 16, sealed, sizeof(sealed), opened));
+}
+
+static void testMacEqual()
+{
+  uint8_t a[4] = { 1, 2, 3, 4 }, b[4] = { 1, 2, 3, 5 };
+
+  expect("ntpMacEqual", ntpMacEqual(a, a, sizeof(a)) && !ntpMacEqual(a, b, sizeof(a)) && ntpMacEqual(a, b, 3));
+}
+
+#if defined(L_NTP_HAVE_OPENSSL) && OPENSSL_VERSION_MAJOR >= 3
+
+static bool opensslSeal(const uint8_t *key, const uint8_t *ad, int cbAd, const uint8_t *nonce, int cbNonce,
+                        const uint8_t *plain, int cbPlain, uint8_t *out)
+{
+  // AES-128-SIV takes the components as updates without output, the nonce last
+  EVP_CIPHER      *cipher = EVP_CIPHER_fetch(NULL, "AES-128-SIV", NULL);
+  EVP_CIPHER_CTX  *ctx    = EVP_CIPHER_CTX_new();
+  int  cb;
+  bool ok;
+
+  ok = (cipher != NULL && ctx != NULL &&
+        EVP_EncryptInit_ex2(ctx, cipher, key, NULL, NULL) == 1 &&
+        EVP_EncryptUpdate(ctx, NULL, &cb, ad, cbAd) == 1 &&
+        EVP_EncryptUpdate(ctx, NULL, &cb, nonce, cbNonce) == 1 &&
+        EVP_EncryptUpdate(ctx, &out[L_NTP_AES_BLOCK], &cb, plain, cbPlain) == 1 &&
+        EVP_EncryptFinal_ex(ctx, &out[L_NTP_AES_BLOCK + cb], &cb) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, L_NTP_AES_BLOCK, out) == 1);
+
+  EVP_CIPHER_CTX_free(ctx);
+  EVP_CIPHER_free(cipher);
+
+  return ok;
+}
+
+static void testSivAgainstOpenssl()
+{
+  NTPAesSiv siv;
+  uint8_t key[L_NTP_AES_SIV_KEY], ad[68], nonce[16], plain[80];
+  uint8_t ours[L_NTP_AES_BLOCK + sizeof(plain)], theirs[L_NTP_AES_BLOCK + sizeof(plain)];
+  int  cbPlain, i;
+  bool same = true, available = true;
+
+  for (i = 0; i < (int)sizeof(key); i++)
+    key[i] = (uint8_t)(i * 7 + 1);
+
+  for (i = 0; i < (int)sizeof(ad); i++)
+    ad[i] = (uint8_t)(i * 13 + 5);
+
+  for (i = 0; i < (int)sizeof(nonce); i++)
+    nonce[i] = (uint8_t)(i * 31 + 3);
+
+  for (i = 0; i < (int)sizeof(plain); i++)
+    plain[i] = (uint8_t)(i * 17 + 11);
+
+  siv.setKey(key);
+
+  for (cbPlain = 1; cbPlain <= (int)sizeof(plain) && available; cbPlain++)
+  {
+    siv.seal(ad, sizeof(ad), nonce, sizeof(nonce), plain, cbPlain, ours);
+    available = opensslSeal(key, ad, sizeof(ad), nonce, sizeof(nonce), plain, cbPlain, theirs);
+
+    if (available && memcmp(ours, theirs, L_NTP_AES_BLOCK + cbPlain) != 0)
+    {
+      printf("  differs at %d bytes of plaintext\n", cbPlain);
+      same = false;
+    }
+  }
+
+  if (available)
+    expect("AES-SIV with nonce = OpenSSL", same);
+  else
+    printf("%-36s skipped (no AES-128-SIV in OpenSSL)\n", "AES-SIV with nonce = OpenSSL");
+}
+
+#endif
+
+int main()
+{
+  testSha1();
+  testAes();
+  testCmac();
+  testSiv();
+
+#if defined(L_NTP_HAVE_OPENSSL) && OPENSSL_VERSION_MAJOR >= 3
+  testSivAgainstOpenssl();
+#endif
+  testMacEqual();
+
+  printf("%s\n", failures == 0 ? "All passed" : "FAILED");
+
+  return (failures == 0 ? 0 : 1);
+}
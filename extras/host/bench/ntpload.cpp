@@ -0,0 +1,268 @@
+/*
+ * ntpload.cpp
+ *
+ * Loopback NTP load generator, in the spirit of ntpperf. Each thread owns a
+ * socket and sends mode 3 requests at its share of the requested rate,
+ * collecting the replies in between. Reports the response and drop rates and
+ * the distribution of the offset and delay measured by the replies.
+ *
+ * Usage: ntpload [-h host] [-p port] [-r requests/s] [-t threads] [-d seconds]
+ *
+ * Needs a server that is synchronized to this host's clock (such as
+ * ntpserverd) for the offsets to mean anything.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <NTPServer.h>
+
+#define RECV_BATCH   64
+#define DRAIN_MS     200    /* How long to wait for stragglers at the end */
+#define RCVBUF_BYTES (4 << 20)
+
+static struct
+{
+  const char *host;
+  int         port;
+  double      rate;
+  int         threads;
+  double      seconds;
+} opts = { "127.0.0.1", 123, 10000, 1, 5 };
+
+typedef struct
+{
+  uint64_t            sent;
+  uint64_t            received;
+  uint64_t            invalid;
+  std::vector<double> offsets;   // us
+  std::vector<double> delays;    // us
+} S_LOAD_RESULT;
+
+static uint64_t realtimeNtp()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return ((uint64_t)(ts.tv_sec + L_NTP_EPOCH) << 32) + (((uint64_t)ts.tv_nsec << 32) / 1000000000);
+}
+
+static uint64_t getTimestamp(const uint8_t *p)
+{
+  uint64_t v = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+
+  return v;
+}
+
+static void putTimestamp(uint8_t *p, uint64_t v)
+{
+  int i;
+
+  for (i = 7; i >= 0; i--, v >>= 8)
+    p[i] = v & 0xFF;
+}
+
+static double ntpToMicros(int64_t v)
+{
+  return v * 1e6 / 4294967296.0;
+}
+
+static double monotonicSeconds()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void receiveReplies(int fd, S_LOAD_RESULT *result)
+{
+  uint8_t          buffers[RECV_BATCH][128];
+  struct mmsghdr   msgs[RECV_BATCH];
+  struct iovec     iov[RECV_BATCH];
+  int n, i;
+
+  for (i = 0; i < RECV_BATCH; i++)
+  {
+    iov[i].iov_base = buffers[i];
+    iov[i].iov_len  = sizeof(buffers[i]);
+    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+    msgs[i].msg_hdr.msg_iov    = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while ((n = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL)) > 0)
+  {
+    uint64_t t4 = realtimeNtp();
+
+    for (i = 0; i < n; i++)
+    {
+      const uint8_t *p = buffers[i];
+      uint64_t t1, t2, t3;
+
+      if (msgs[i].msg_len < 48 || (p[0] & 7) != L_NTP_MODE_SERVER || p[1] == 0)
+      {
+        result->invalid++;
+        continue;
+      }
+
+      t1 = getTimestamp(&p[24]);   // Our transmit time, echoed back as origin
+      t2 = getTimestamp(&p[32]);
+      t3 = getTimestamp(&p[40]);
+
+      result->received++;
+      result->offsets.push_back(ntpToMicros(((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2));
+      result->delays.push_back(ntpToMicros((int64_t)(t4 - t1) - (int64_t)(t3 - t2)));
+    }
+  }
+}
+
+static void runThread(struct sockaddr_in server, S_LOAD_RESULT *result)
+{
+  double interval = opts.threads / opts.rate;
+  double start, next, now, end;
+  uint8_t request[48];
+  int rcvbuf = RCVBUF_BYTES;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  if (fd < 0 || connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0)
+  {
+    perror("socket");
+    return;
+  }
+
+  // Replies arrive in bursts while we are busy sending, do not count those as drops
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  result->offsets.reserve(opts.rate / opts.threads * opts.seconds * 1.1);
+  result->delays.reserve(opts.rate / opts.threads * opts.seconds * 1.1);
+
+  memset(request, 0, sizeof(request));
+  request[0] = (4 << 3) | L_NTP_MODE_CLIENT;
+
+  start = monotonicSeconds();
+  end   = start + opts.seconds;
+  next  = start;
+
+  while ((now = monotonicSeconds()) < end)
+  {
+    // Send whatever is due (catching up after a stall), then collect replies
+    while (next <= now)
+    {
+      putTimestamp(&request[40], realtimeNtp());
+
+      if (send(fd, request, sizeof(request), MSG_DONTWAIT) == sizeof(request))
+        result->sent++;
+
+      next += interval;
+    }
+
+    receiveReplies(fd, result);
+  }
+
+  end = monotonicSeconds() + DRAIN_MS / 1000.0;
+
+  while (monotonicSeconds() < end)
+    receiveReplies(fd, result);
+
+  close(fd);
+}
+
+static void printDistribution(const char *label, std::vector<double> &v)
+{
+  if (v.empty())
+    return;
+
+  std::sort(v.begin(), v.end());
+
+  printf("%-8s  min %9.1f  p50 %9.1f  p90 %9.1f  p99 %9.1f  max %9.1f  us\n", label,
+         v.front(), v[v.size() / 2], v[v.size() * 9 / 10], v[v.size() * 99 / 100], v.back());
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<S_LOAD_RESULT> results;
+  std::vector<std::thread>   threads;
+  S_LOAD_RESULT total;
+  struct sockaddr_in server;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "h:p:r:t:d:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'h': opts.host = optarg; break;
+      case 'p': opts.port = atoi(optarg); break;
+      case 'r': opts.rate = atof(optarg); break;
+      case 't': opts.threads = atoi(optarg); break;
+      case 'd': opts.seconds = atof(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-h host] [-p port] [-r requests/s] [-t threads] [-d seconds]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (opts.threads < 1 || opts.rate <= 0 || opts.seconds <= 0)
+    return 1;
+
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port   = htons(opts.port);
+
+  if (inet_pton(AF_INET, opts.host, &server.sin_addr) != 1)
+  {
+    fprintf(stderr, "Bad address: %s\n", opts.host);
+    return 1;
+  }
+
+  results.resize(opts.threads);
+
+  for (i = 0; i < opts.threads; i++)
+  {
+    results[i].sent = results[i].received = results[i].invalid = 0;
+    threads.push_back(std::thread(runThread, server, &results[i]));
+  }
+
+  total.sent = total.received = total.invalid = 0;
+
+  for (i = 0; i < opts.threads; i++)
+  {
+    threads[i].join();
+
+    total.sent     += results[i].sent;
+    total.received += results[i].received;
+    total.invalid  += results[i].invalid;
+    total.offsets.insert(total.offsets.end(), results[i].offsets.begin(), results[i].offsets.end());
+    total.delays.insert(total.delays.end(), results[i].delays.begin(), results[i].delays.end());
+  }
+
+  printf("%d threads, %.0f requests/s for %.1f s\n", opts.threads, opts.rate, opts.seconds);
+  printf("sent      %llu (%.0f/s)\n", (unsigned long long)total.sent, total.sent / opts.seconds);
+  printf("received  %llu (%.0f/s), %llu invalid\n", (unsigned long long)total.received, total.received / opts.seconds,
+         (unsigned long long)total.invalid);
+  printf("dropped   %.3f %%\n", total.sent ? 100.0 * (total.sent - total.received) / total.sent : 0.0);
+
+  printDistribution("offset", total.offsets);
+  printDistribution("delay", total.delays);
+
+  return 0;
+}
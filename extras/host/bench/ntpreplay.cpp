@@ -0,0 +1,493 @@
+/*
+ * ntpreplay.cpp
+ *
+ * Plays the requests of a pcap capture back through NTPServer::update(), over
+ * an in-memory UDP transport, to reproduce a burst seen in production and
+ * profile it offline. The capture can come from ntpserverd -c (or any server
+ * with enableCapture()), or from tcpdump: raw IP, Ethernet and Linux cooked
+ * captures are read, and the UDP datagrams sent to the server port are kept.
+ *
+ * By default datagrams are handed to the server at the pacing they arrived
+ * with (scaled by -s), and the latency reported runs from the moment a
+ * datagram is due to its reply, so it includes the time spent queued behind
+ * the ones before it. With -f they are handed out as fast as the server takes
+ * them, which gives the throughput; the latency is then the service time alone.
+ *
+ * Usage: ntpreplay [-f] [-s speed] [-n loops] [-b batch] [-p port] [-t intervalMs] [-x] capture.pcap
+ *
+ * -n plays the capture several times in a row, -b sets the datagrams drained
+ * per update(), -t and -x enable throttling and interleaved mode as in
+ * ntpserverd. The server runs on the system clock, as ntpserverd does.
+ * Requests with a MAC or an NTS cookie are answered as the server would
+ * answer them without the keys of the capturing server, i.e. rejected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <NTPServer.h>
+
+#define THROTTLE_TABLE_ENTRIES   4096
+#define THROTTLE_BURST           8
+#define INTERLEAVE_TABLE_ENTRIES 4096
+
+#define PCAP_MAGIC_US      0xA1B2C3D4
+#define PCAP_MAGIC_NS      0xA1B23C4D
+#define LINKTYPE_ETHERNET  1
+#define LINKTYPE_RAW       101
+#define LINKTYPE_SLL       113
+#define LINKTYPE_SLL2      276
+
+static struct
+{
+  bool        fast;
+  double      speed;
+  int         loops;
+  int         batch;
+  int         port;
+  int         throttleMillis;
+  bool        interleaved;
+} opts = { false, 1.0, 1, 32, 123, 0, false };
+
+typedef struct
+{
+  uint64_t  at;        // ns since the first datagram of the capture
+  IPAddress ip;
+  uint16_t  port;
+  int       size;      // On the wire
+  int       length;    // In the capture
+  size_t    offset;    // Of the payload in the capture file
+} S_REPLAY_DATAGRAM;
+
+static uint64_t nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Hands out the datagrams of the capture that are due, and times the replies */
+class ReplayUDP : public UDP
+{
+public:
+  const S_REPLAY_DATAGRAM *datagrams;
+  const uint8_t           *file;
+  size_t                   next;         // Next datagram to hand out
+  size_t                   due;          // Datagrams before this one may be handed out
+  const S_REPLAY_DATAGRAM *current;
+  uint64_t                 currentDue;   // When current was due (or handed out, with -f)
+  uint64_t                 loopStart;    // Time the first datagram of this loop was due
+  size_t                   readPos;
+
+  uint64_t                 replies;
+  std::vector<uint32_t>    latencies;    // ns, per reply
+
+  ReplayUDP() { datagrams = NULL; file = NULL; next = due = 0; current = NULL; currentDue = loopStart = 0; readPos = 0; replies = 0; }
+
+  uint64_t dueAt(const S_REPLAY_DATAGRAM *d) { return loopStart + (uint64_t)(d->at / opts.speed); }
+
+  uint8_t begin(uint16_t /* port */) { return 1; }
+  void stop() { }
+
+  int beginPacket(IPAddress /* ip */, uint16_t /* port */) { return 1; }
+  int beginPacket(const char * /* host */, uint16_t /* port */) { return 1; }
+  size_t write(uint8_t /* b */) { return 1; }
+  size_t write(const uint8_t * /* buffer */, size_t size) { return size; }
+
+  int endPacket()
+  {
+    uint64_t latency = nowNs() - currentDue;
+
+    latencies.push_back(latency < 0xFFFFFFFF ? (uint32_t)latency : 0xFFFFFFFF);
+    replies++;
+    return 1;
+  }
+
+  int parsePacket()
+  {
+    if (next >= due)
+    {
+      current = NULL;
+      return 0;
+    }
+
+    current    = &datagrams[next++];
+    currentDue = (opts.fast ? nowNs() : dueAt(current));
+    readPos    = 0;
+
+    return current->size;
+  }
+
+  int available() { return (current != NULL ? current->length - (int)readPos : 0); }
+  int read() { return -1; }
+  int read(char *buffer, size_t len) { return read((unsigned char *)buffer, len); }
+
+  int read(unsigned char *buffer, size_t len)
+  {
+    size_t n = available();
+
+    if (n > len)
+      n = len;
+
+    memcpy(buffer, &file[current->offset + readPos], n);
+    readPos += n;
+
+    return n;
+  }
+
+  int peek() { return -1; }
+  void flush() { }
+
+  IPAddress remoteIP() { return (current != NULL ? current->ip : IPAddress()); }
+  uint16_t remotePort() { return (current != NULL ? current->port : 0); }
+};
+
+static uint32_t get16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+
+static uint32_t get32(const uint8_t *p, bool swapped)
+{
+  uint32_t v;
+
+  memcpy(&v, p, 4);
+
+  return (swapped ? __builtin_bswap32(v) : v);
+}
+
+static const uint8_t *parseDatagram(const uint8_t *p, int cb, int linkType, S_REPLAY_DATAGRAM *d)
+{
+  // Finds the IP header behind the link layer header, then the UDP datagram,
+  // and returns its payload. Only datagrams to the server port count;
+  // fragments are left out.
+
+  int proto = 0, ipLen, udpLen;
+
+  switch (linkType)
+  {
+    case LINKTYPE_ETHERNET:
+      if (cb < 14)
+        return NULL;
+
+      proto = get16(&p[12]);
+      p += 14; cb -= 14;
+
+      if (proto == 0x8100 && cb >= 4)    // VLAN tag
+      {
+        proto = get16(&p[2]);
+        p += 4; cb -= 4;
+      }
+      break;
+
+    case LINKTYPE_SLL:
+      if (cb < 16)
+        return NULL;
+
+      proto = get16(&p[14]);
+      p += 16; cb -= 16;
+      break;
+
+    case LINKTYPE_SLL2:
+      if (cb < 20)
+        return NULL;
+
+      proto = get16(&p[0]);
+      p += 20; cb -= 20;
+      break;
+
+    case LINKTYPE_RAW:
+      if (cb < 1)
+        return NULL;
+
+      proto = ((p[0] >> 4) == 6 ? 0x86DD : 0x0800);
+      break;
+
+    default:
+      return NULL;
+  }
+
+  if (proto == 0x0800 && cb >= 20 && (p[0] >> 4) == 4)
+  {
+    ipLen = (p[0] & 0x0F) * 4;
+
+    if (p[9] != 17 || (get16(&p[6]) & 0x3FFF) != 0 || cb < ipLen + 8)
+      return NULL;
+
+    d->ip = IPAddress(p[12], p[13], p[14], p[15]);
+  }
+  else if (proto == 0x86DD && cb >= 48 && (p[0] >> 4) == 6)
+  {
+    ipLen = 40;
+
+    if (p[6] != 17)
+      return NULL;
+
+    d->ip.setV6(&p[8]);
+  }
+  else
+  {
+    return NULL;
+  }
+
+  p += ipLen; cb -= ipLen;
+
+  if ((int)get16(&p[2]) != opts.port)
+    return NULL;
+
+  udpLen    = get16(&p[4]);
+  d->port   = get16(&p[0]);
+  d->size   = (udpLen >= 8 ? udpLen - 8 : 0);
+  d->length = std::min(d->size, cb - 8);
+
+  return &p[8];
+}
+
+static int loadCapture(const char *path, std::vector<uint8_t> &file, std::vector<S_REPLAY_DATAGRAM> &datagrams)
+{
+  FILE    *f = fopen(path, "rb");
+  size_t   pos;
+  uint32_t magic, linkType, incl;
+  uint64_t ns, first = 0;
+  bool     swapped, nanos;
+  S_REPLAY_DATAGRAM d;
+  const uint8_t *payload;
+  uint8_t  buf[65536];
+  size_t   n;
+
+  if (f == NULL)
+  {
+    perror(path);
+    return -1;
+  }
+
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    file.insert(file.end(), buf, buf + n);
+
+  fclose(f);
+
+  if (file.size() < 24)
+  {
+    fprintf(stderr, "%s: not a pcap file\n", path);
+    return -1;
+  }
+
+  memcpy(&magic, &file[0], 4);
+  swapped = (magic == __builtin_bswap32(PCAP_MAGIC_US) || magic == __builtin_bswap32(PCAP_MAGIC_NS));
+  magic   = get32(&file[0], swapped);
+  nanos   = (magic == PCAP_MAGIC_NS);
+
+  if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS)
+  {
+    fprintf(stderr, "%s: not a pcap file (pcapng is not supported, convert with editcap -F pcap)\n", path);
+    return -1;
+  }
+
+  linkType = get32(&file[20], swapped) & 0xFFFF;
+
+  for (pos = 24; pos + 16 <= file.size(); pos += 16 + incl)
+  {
+    incl = get32(&file[pos + 8], swapped);
+
+    if (pos + 16 + incl > file.size())
+      break;
+
+    ns = (uint64_t)get32(&file[pos], swapped) * 1000000000ULL + (uint64_t)get32(&file[pos + 4], swapped) * (nanos ? 1 : 1000);
+
+    if ((payload = parseDatagram(&file[pos + 16], incl, linkType, &d)) == NULL)
+      continue;
+
+    if (datagrams.empty())
+      first = ns;
+
+    d.at     = (ns > first ? ns - first : 0);
+    d.offset = payload - file.data();
+    datagrams.push_back(d);
+  }
+
+  // Captures of a pool come one worker after the other
+  std::stable_sort(datagrams.begin(), datagrams.end(),
+                   [](const S_REPLAY_DATAGRAM &a, const S_REPLAY_DATAGRAM &b) { return a.at < b.at; });
+
+  if (!datagrams.empty())
+  {
+    first = datagrams[0].at;
+
+    for (S_REPLAY_DATAGRAM &r : datagrams)
+      r.at -= first;
+  }
+
+  return (int)datagrams.size();
+}
+
+static void syncFromSystemClock(NTPServer &server)
+{
+  struct timeval tv;
+  struct tm      tmRef;
+  t_ntpSysClock  now;
+
+  gettimeofday(&tv, NULL);
+  now = micros64();
+
+  gmtime_r(&tv.tv_sec, &tmRef);
+  server.setReferenceTime(tmRef, now - tv.tv_usec);
+}
+
+static void waitUntil(uint64_t t)
+{
+  // Sleeps for all but the last bit, which is spun away for accuracy
+  uint64_t now = nowNs();
+  struct timespec ts;
+
+  if (t > now + 200000)
+  {
+    ts.tv_sec  = (t - now - 100000) / 1000000000ULL;
+    ts.tv_nsec = (t - now - 100000) % 1000000000ULL;
+    nanosleep(&ts, NULL);
+  }
+
+  while (nowNs() < t)
+    ;
+}
+
+static void report(NTPServer &server, ReplayUDP &udp, uint64_t datagrams, double seconds)
+{
+  static const char *const reasons[] =
+  {
+    "unsupported version", "missing data", "too much data", "bad request",
+    "not implemented", "bad variable name", "not permitted", "throttled",
+    "bad MAC"
+  };
+
+  std::vector<uint32_t> &l = udp.latencies;
+  int i;
+
+  printf("Replayed %llu datagrams in %.3f s: %.0f datagrams/s, %llu replies\n",
+         (unsigned long long)datagrams, seconds, datagrams / seconds, (unsigned long long)udp.replies);
+
+  for (i = 0; i < (int)(sizeof(reasons) / sizeof(reasons[0])); i++)
+  {
+    uint64_t n = server.getRequestCount(L_NTP_UNSUPPORTED_VERSION + i);
+
+    if (n != 0)
+      printf("  rejected (%s): %llu\n", reasons[i], (unsigned long long)n);
+  }
+
+  if (l.empty())
+    return;
+
+  std::sort(l.begin(), l.end());
+
+  printf("%s (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+         (opts.fast ? "Service time" : "Latency, arrival to reply"),
+         l[l.size() / 2] / 1e3, l[l.size() * 9 / 10] / 1e3, l[l.size() * 99 / 100] / 1e3,
+         l[l.size() * 999 / 1000] / 1e3, l.back() / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<uint8_t>           file;
+  std::vector<S_REPLAY_DATAGRAM> datagrams;
+  NTPServer server("LOCL", L_NTP_STRAT_SECONDARY);
+  ReplayUDP udp;
+  uint64_t  start, played = 0, duration, lastSync;
+  size_t    bound;
+  int       opt, loop, n;
+
+  while ((opt = getopt(argc, argv, "fs:n:b:p:t:x")) != -1)
+  {
+    switch (opt)
+    {
+      case 'f': opts.fast = true; break;
+      case 's': opts.speed = atof(optarg); break;
+      case 'n': opts.loops = atoi(optarg); break;
+      case 'b': opts.batch = atoi(optarg); break;
+      case 'p': opts.port = atoi(optarg); break;
+      case 't': opts.throttleMillis = atoi(optarg); break;
+      case 'x': opts.interleaved = true; break;
+      default:
+        optind = argc;
+        break;
+    }
+  }
+
+  if (optind != argc - 1 || opts.speed <= 0 || opts.loops <= 0 || opts.batch <= 0)
+  {
+    fprintf(stderr, "Usage: %s [-f] [-s speed] [-n loops] [-b batch] [-p port] [-t intervalMs] [-x] capture.pcap\n", argv[0]);
+    return 1;
+  }
+
+  if (loadCapture(argv[optind], file, datagrams) <= 0)
+  {
+    fprintf(stderr, "%s: no datagrams to port %d\n", argv[optind], opts.port);
+    return 1;
+  }
+
+  duration = datagrams.back().at;
+
+  printf("%zu datagrams over %.3f s, played %s x%d\n", datagrams.size(), duration / 1e9,
+         (opts.fast ? "as fast as possible" : "at the captured pacing"), opts.loops);
+
+  // Reference times are handed over as UTC
+  setenv("TZ", "UTC", 1);
+  tzset();
+
+  if (opts.throttleMillis > 0)
+    server.enableThrottling(THROTTLE_TABLE_ENTRIES, opts.throttleMillis, THROTTLE_BURST, true);
+
+  if (opts.interleaved)
+    server.enableInterleaved(INTERLEAVE_TABLE_ENTRIES);
+
+  syncFromSystemClock(server);
+  server.begin(udp);
+
+  udp.datagrams = datagrams.data();
+  udp.file      = file.data();
+  udp.latencies.reserve(datagrams.size() * opts.loops);
+
+  start    = nowNs();
+  lastSync = start;
+
+  for (loop = 0; loop < opts.loops; loop++)
+  {
+    // The next loop starts one average gap after the last datagram
+    udp.loopStart = (loop == 0 ? start : udp.loopStart + (uint64_t)((duration + duration / datagrams.size()) / opts.speed));
+    udp.next      = 0;
+    udp.due       = 0;
+
+    while (udp.next < datagrams.size())
+    {
+      if (opts.fast)
+      {
+        bound = datagrams.size();
+      }
+      else
+      {
+        waitUntil(udp.dueAt(&datagrams[udp.next]));
+
+        // Everything due by now, as it would have queued up in the socket
+        for (bound = udp.next + 1; bound < datagrams.size() && udp.dueAt(&datagrams[bound]) <= nowNs(); bound++)
+          ;
+      }
+
+      udp.due = bound;
+
+      while (udp.next < udp.due && (n = server.update(opts.batch)) > 0)
+        played += n;
+
+      if (nowNs() - lastSync >= 16000000000ULL)
+      {
+        syncFromSystemClock(server);
+        lastSync = nowNs();
+      }
+    }
+  }
+
+  report(server, udp, played, (nowNs() - start) / 1e9);
+
+  return 0;
+}
@@ -0,0 +1,384 @@
+/*
+ * ntsclient.cpp
+ *
+ * Minimal NTS client (RFC 8915) for testing ntpserverd -n. Runs NTS key
+ * establishment over TLS 1.3, then sends NTS-protected requests, checking the
+ * authenticator of every reply and keeping the cookies it hands back.
+ *
+ * Usage: ntsclient [-h host] [-k kePort] [-c caFile] [-s serverName] [-n requests] [-b]
+ *
+ * Without -c the server certificate is not verified. -b sends a corrupt
+ * cookie, which should be answered with an NTS NAK (kiss code NTSN).
+ */
+
+#ifdef L_NTP_HAVE_OPENSSL
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#include <NTPServer.h>
+
+static struct
+{
+  const char *host;
+  int         kePort;
+  const char *caFile;
+  const char *serverName;
+  int         requests;
+  bool        badCookie;
+} opts = { "127.0.0.1", L_NTP_NTS_KE_PORT_NUM, NULL, NULL, 4, false };
+
+static struct
+{
+  uint8_t c2s[L_NTP_NTS_KEY], s2c[L_NTP_NTS_KEY];
+  uint8_t cookies[L_NTP_NTS_MAX_COOKIES][L_NTP_NTS_COOKIE];
+  int     cookieCount;
+  int     ntpPort;
+} session;
+
+static int connectTo(const char *host, int port, int type)
+{
+  struct addrinfo hints, *res, *ai;
+  char service[8];
+  int fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = type;
+  snprintf(service, sizeof(service), "%d", port);
+
+  if (getaddrinfo(host, service, &hints, &res) != 0)
+    return -1;
+
+  for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next)
+  {
+    fd = socket(ai->ai_family, ai->ai_socktype, 0);
+
+    if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  freeaddrinfo(res);
+  return fd;
+}
+
+static void putField(uint8_t *p, int type, int length)
+{
+  p[0] = type >> 8;
+  p[1] = type;
+  p[2] = length >> 8;
+  p[3] = length;
+}
+
+static bool keyEstablishment()
+{
+  static const unsigned char alpn[] = { 7, 'n', 't', 's', 'k', 'e', '/', '1' };
+  static const uint8_t request[] =
+  {
+    0x80, L_NTP_NTS_KE_NEXT_PROTOCOL, 0, 2, 0, L_NTP_NTS_PROTO_NTPV4,
+    0x00, L_NTP_NTS_KE_AEAD, 0, 2, 0, L_NTP_NTS_AEAD_SIV_CMAC_256,
+    0x80, L_NTP_NTS_KE_END, 0, 0
+  };
+
+  uint8_t  context[5] = { 0, L_NTP_NTS_PROTO_NTPV4, 0, L_NTP_NTS_AEAD_SIV_CMAC_256, 0 };
+  uint8_t  record[4 + 1024];
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  SSL     *ssl;
+  int fd, type, length, n, got;
+  bool end = false, ok = false;
+
+  SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+  SSL_CTX_set_alpn_protos(ctx, alpn, sizeof(alpn));
+
+  if (opts.caFile != NULL)
+  {
+    SSL_CTX_load_verify_locations(ctx, opts.caFile, NULL);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  }
+
+  fd = connectTo(opts.host, opts.kePort, SOCK_STREAM);
+
+  if (fd < 0)
+  {
+    perror("connect");
+    return false;
+  }
+
+  ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, fd);
+  SSL_set_tlsext_host_name(ssl, opts.serverName);
+
+  if (opts.caFile != NULL)
+    SSL_set1_host(ssl, opts.serverName);
+
+  if (SSL_connect(ssl) != 1 || SSL_write(ssl, request, sizeof(request)) != sizeof(request))
+  {
+    ERR_print_errors_fp(stderr);
+    return false;
+  }
+
+  session.ntpPort = L_NTP_PORT;
+
+  while (!end)
+  {
+    for (got = 0; got < 4; got += n)
+      if ((n = SSL_read(ssl, &record[got], 4 - got)) <= 0)
+        goto done;
+
+    type   = ((record[0] << 8) | record[1]) & 0x7FFF;
+    length = (record[2] << 8) | record[3];
+
+    if (length > 1024)
+      goto done;
+
+    for (got = 0; got < length; got += n)
+      if ((n = SSL_read(ssl, &record[4 + got], length - got)) <= 0)
+        goto done;
+
+    switch (type)
+    {
+      case L_NTP_NTS_KE_END:
+        end = true;
+        break;
+
+      case L_NTP_NTS_KE_ERROR:
+        printf("NTS-KE error %d\n", (record[4] << 8) | record[5]);
+        goto done;
+
+      case L_NTP_NTS_KE_AEAD:
+        ok = (length == 2 && record[5] == L_NTP_NTS_AEAD_SIV_CMAC_256);
+        break;
+
+      case L_NTP_NTS_KE_NEW_COOKIE:
+        if (length == L_NTP_NTS_COOKIE && session.cookieCount < L_NTP_NTS_MAX_COOKIES)
+          memcpy(session.cookies[session.cookieCount++], &record[4], length);
+        break;
+
+      case L_NTP_NTS_KE_PORT:
+        session.ntpPort = (record[4] << 8) | record[5];
+        break;
+    }
+  }
+
+  if (ok)
+  {
+    SSL_export_keying_material(ssl, session.c2s, L_NTP_NTS_KEY, L_NTP_NTS_KE_EXPORTER, sizeof(L_NTP_NTS_KE_EXPORTER) - 1, context, 5, 1);
+    context[4] = 1;
+    SSL_export_keying_material(ssl, session.s2c, L_NTP_NTS_KEY, L_NTP_NTS_KE_EXPORTER, sizeof(L_NTP_NTS_KE_EXPORTER) - 1, context, 5, 1);
+  }
+
+  printf("NTS-KE: %s, %d cookies, NTP port %d\n", SSL_get_version(ssl), session.cookieCount, session.ntpPort);
+
+done:
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  SSL_CTX_free(ctx);
+  close(fd);
+
+  return ok && session.cookieCount > 0;
+}
+
+static uint64_t realtimeNtp()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)(ts.tv_sec + L_NTP_EPOCH) << 32) + (((uint64_t)ts.tv_nsec << 32) / 1000000000);
+}
+
+static uint64_t getTimestamp(const uint8_t *p)
+{
+  uint64_t v = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+
+  return v;
+}
+
+static void exchange(int fd, NTPAesSiv &c2s, NTPAesSiv &s2c)
+{
+  uint8_t packet[1024], reply[1024], plain[1024], uid[32], nonce[16];
+  uint64_t t1, t4;
+  int offset = 48, cbRequest, placeholders, authOffset, n, type, length, cookies = 0, i;
+  bool uidOk = false, authOk = false;
+
+  memset(packet, 0, 48);
+  packet[0] = (4 << 3) | L_NTP_MODE_CLIENT;
+
+  RAND_bytes(uid, sizeof(uid));
+  RAND_bytes(nonce, sizeof(nonce));
+
+  putField(&packet[offset], L_NTP_NTS_EF_UNIQUE_ID, 4 + sizeof(uid));
+  memcpy(&packet[offset + 4], uid, sizeof(uid));
+  offset += 4 + sizeof(uid);
+
+  // Use up the oldest cookie, and ask for enough to fill the jar back up
+  putField(&packet[offset], L_NTP_NTS_EF_COOKIE, 4 + L_NTP_NTS_COOKIE);
+  memcpy(&packet[offset + 4], session.cookies[0], L_NTP_NTS_COOKIE);
+
+  if (opts.badCookie)
+    packet[offset + 30] ^= 1;
+
+  offset += 4 + L_NTP_NTS_COOKIE;
+
+  session.cookieCount--;
+  memmove(session.cookies[0], session.cookies[1], session.cookieCount * L_NTP_NTS_COOKIE);
+
+  for (placeholders = L_NTP_NTS_MAX_COOKIES - 1 - session.cookieCount; placeholders > 0; placeholders--)
+  {
+    putField(&packet[offset], L_NTP_NTS_EF_PLACEHOLDER, 4 + L_NTP_NTS_COOKIE);
+    memset(&packet[offset + 4], 0, L_NTP_NTS_COOKIE);
+    offset += 4 + L_NTP_NTS_COOKIE;
+  }
+
+  // The transmit timestamp is covered by the authenticator, so goes in first
+  t1 = realtimeNtp();
+
+  for (i = 0; i < 8; i++)
+    packet[40 + i] = (uint8_t)(t1 >> (56 - 8 * i));
+
+  // Authenticator with no encrypted fields
+  putField(&packet[offset], L_NTP_NTS_EF_AUTHENTICATOR, 4 + 4 + sizeof(nonce) + 16);
+  putField(&packet[offset + 4], sizeof(nonce), 16);
+  memcpy(&packet[offset + 8], nonce, sizeof(nonce));
+  c2s.seal(packet, offset, nonce, sizeof(nonce), NULL, 0, &packet[offset + 8 + sizeof(nonce)]);
+  offset += 8 + sizeof(nonce) + 16;
+  cbRequest = offset;
+
+  send(fd, packet, cbRequest, 0);
+  n  = recv(fd, reply, sizeof(reply), 0);
+  t4 = realtimeNtp();
+
+  if (n < 48)
+  {
+    printf("no reply\n");
+    return;
+  }
+
+  if (reply[1] == 0)
+  {
+    printf("kiss-o'-death %.4s, %d bytes\n", (const char *)&reply[12], n);
+    return;
+  }
+
+  for (offset = 48, authOffset = 0; offset + 4 <= n && authOffset == 0; offset += length)
+  {
+    type   = (reply[offset] << 8) | reply[offset + 1];
+    length = (reply[offset + 2] << 8) | reply[offset + 3];
+
+    if (length < 4 || offset + length > n)
+      break;
+
+    if (type == L_NTP_NTS_EF_UNIQUE_ID)
+      uidOk = (length == 4 + (int)sizeof(uid) && memcmp(&reply[offset + 4], uid, sizeof(uid)) == 0);
+    else if (type == L_NTP_NTS_EF_AUTHENTICATOR)
+      authOffset = offset;
+  }
+
+  if (authOffset != 0)
+  {
+    int cbNonce  = (reply[authOffset + 4] << 8) | reply[authOffset + 5];
+    int cbCipher = (reply[authOffset + 6] << 8) | reply[authOffset + 7];
+
+    authOk = s2c.open(reply, authOffset, &reply[authOffset + 8], cbNonce,
+                      &reply[authOffset + 8 + ((cbNonce + 3) & ~3)], cbCipher, plain);
+
+    for (offset = 0; authOk && offset + 4 <= cbCipher - 16; offset += length)
+    {
+      type   = (plain[offset] << 8) | plain[offset + 1];
+      length = (plain[offset + 2] << 8) | plain[offset + 3];
+
+      if (length < 4)
+        break;
+
+      if (type == L_NTP_NTS_EF_COOKIE && length == 4 + L_NTP_NTS_COOKIE && session.cookieCount < L_NTP_NTS_MAX_COOKIES)
+      {
+        memcpy(session.cookies[session.cookieCount++], &plain[offset + 4], L_NTP_NTS_COOKIE);
+        cookies++;
+      }
+    }
+  }
+
+  {
+    uint64_t t2 = getTimestamp(&reply[32]), t3 = getTimestamp(&reply[40]);
+    double offsetUs = (((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2) * 1e6 / 4294967296.0;
+    double delayUs  = ((int64_t)(t4 - t1) - (int64_t)(t3 - t2)) * 1e6 / 4294967296.0;
+
+    printf("stratum %d  offset %9.1f us  delay %7.1f us  %d bytes out, %d back  uid %s  auth %s  +%d cookies\n",
+           reply[1], offsetUs, delayUs, cbRequest, n, uidOk ? "ok" : "BAD", authOk ? "ok" : "BAD", cookies);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  NTPAesSiv c2s, s2c;
+  int opt, fd, i;
+
+  while ((opt = getopt(argc, argv, "h:k:c:s:n:b")) != -1)
+  {
+    switch (opt)
+    {
+      case 'h': opts.host = optarg; break;
+      case 'k': opts.kePort = atoi(optarg); break;
+      case 'c': opts.caFile = optarg; break;
+      case 's': opts.serverName = optarg; break;
+      case 'n': opts.requests = atoi(optarg); break;
+      case 'b': opts.badCookie = true; break;
+      default:
+        fprintf(stderr, "Usage: %s [-h host] [-k kePort] [-c caFile] [-s serverName] [-n requests] [-b]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (opts.serverName == NULL)
+    opts.serverName = opts.host;
+
+  if (!keyEstablishment())
+    return 1;
+
+  c2s.setKey(session.c2s);
+  s2c.setKey(session.s2c);
+
+  fd = connectTo(opts.host, session.ntpPort, SOCK_DGRAM);
+
+  if (fd < 0)
+  {
+    perror("socket");
+    return 1;
+  }
+
+  struct timeval timeout = { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  for (i = 0; i < opts.requests && session.cookieCount > 0; i++)
+    exchange(fd, c2s, s2c);
+
+  close(fd);
+  return 0;
+}
+
+#else
+
+#include <stdio.h>
+
+int main()
+{
+  fprintf(stderr, "ntsclient needs OpenSSL\n");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,537 @@
+/*
+ * ntpserverd.cpp
+ *
+ * Runs the NTPServer core as a host daemon. The reference time is taken from
+ * the system clock, which stands in for the GPS receiver used on the ESP8266
+ * builds. Intended for load testing and profiling the packet path.
+ *
+ * Usage: ntpserverd [-p port] [-l address]... [-r refid] [-s stratum] [-b batch] [-w workers]
+ *                   [-t intervalMs] [-B address] [-k keyfile [-a]] [-n cert,key] [-x] [-c file]
+ *                   [-u address[,port]]...
+ *
+ * -l listens on the given local address (0.0.0.0 by default), and may be
+ * repeated, e.g. "-l 0.0.0.0 -l ::" for IPv4 and IPv6, or one per interface.
+ *
+ * With -w 0 (one per CPU) or -w N > 1, requests are served by a pool of
+ * SO_REUSEPORT worker threads. -t limits every client to one request per
+ * intervalMs on average (bursts of 8), answering with RATE Kiss-o'-Death.
+ * -B also sends broadcast (mode 5) packets to the given broadcast or multicast
+ * address, every max poll interval (single worker only). -k loads SHA1 and
+ * AES128CMAC keys from an ntpd keys file ("keyid type key" per line), and -a
+ * then leaves requests without a valid MAC unanswered. -n serves NTS: an NTS-KE
+ * listener on port 4460 hands out cookies under a random master key, using the
+ * given PEM certificate chain and private key (needs OpenSSL). -x answers
+ * clients that ask for it in interleaved mode, with kernel transmit timestamps.
+ * -c keeps the last datagrams received (per worker) and writes them to the
+ * given pcap file on SIGUSR1 and on exit, for bench/ntpreplay to play back.
+ * -u takes the time from the given NTP server (up to L_NTP_MAX_UPSTREAMS,
+ * single worker only) instead of from the system clock.
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <PosixNTPServer.h>
+#include <PosixNTPServerPool.h>
+#include <PosixNTSKEServer.h>
+
+#define THROTTLE_TABLE_ENTRIES   4096
+#define THROTTLE_BURST           8
+#define INTERLEAVE_TABLE_ENTRIES 4096
+#define CAPTURE_PACKETS          16384
+
+static struct
+{
+  int         port;
+  const char *listen[L_NTP_MAX_LISTENERS];
+  int         listenCount;
+  const char *refId;
+  int         stratum;
+  int         batch;
+  int         workers;
+  int         throttleMillis;
+  const char *broadcast;
+  const char *keyFile;
+  bool        authRequired;
+  char       *nts;
+  bool        interleaved;
+  const char *capture;
+  char       *upstream[L_NTP_MAX_UPSTREAMS];
+  int         upstreamCount;
+} opts = { 123, { NULL }, 0, "LOCL", L_NTP_STRAT_SECONDARY, L_POSIX_UDP_MAX_BATCH, 1, 0, NULL, NULL, false, NULL, false, NULL, { NULL }, 0 };
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t saveCapture = 0;
+static char systemName[sizeof(struct utsname)];
+
+#ifdef L_NTP_HAVE_OPENSSL
+static PosixNTSKEServer keServer;
+#endif
+
+static void onSignal(int sig)
+{
+  if (sig == SIGUSR1)
+    saveCapture = 1;
+  else
+    running = 0;
+}
+
+/* Hands what writeCapture() writes to a file */
+class FilePrint : public Print
+{
+public:
+  FILE *f;
+
+  FilePrint(FILE *file) { f = file; }
+
+  size_t write(uint8_t b) { return fwrite(&b, 1, 1, f); }
+  size_t write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, f); }
+};
+
+static void writeCaptureFile(NTPServer &server)
+{
+  // Into a temporary file first, so the last complete capture is never lost
+  char  path[1024];
+  FILE *f;
+  int   n;
+
+  saveCapture = 0;
+  snprintf(path, sizeof(path), "%s.tmp", opts.capture);
+
+  if ((f = fopen(path, "wb")) == NULL)
+  {
+    perror(path);
+    return;
+  }
+
+  FilePrint out(f);
+  n = server.writeCapture(out);
+
+  if (fclose(f) != 0 || rename(path, opts.capture) != 0)
+  {
+    perror(opts.capture);
+    return;
+  }
+
+  printf("Wrote %d datagrams to %s\n", n, opts.capture);
+}
+
+static void syncFromSystemClock(NTPServer &server)
+{
+  // Snapshot the system clock together with the monotonic counter, then
+  // back the counter up to the start of the current second.
+
+  struct timeval tv;
+  struct tm      tmRef;
+  t_ntpSysClock  now;
+
+  gettimeofday(&tv, NULL);
+  now = micros64();
+
+  gmtime_r(&tv.tv_sec, &tmRef);
+  server.setReferenceTime(tmRef, now - tv.tv_usec);
+}
+
+static int loadKeys(NTPServer &server, const char *path)
+{
+  // Reads an ntpd keys file. As in ntpd, a key of more than 20 characters is
+  // taken as hex, anything shorter as ASCII.
+
+  FILE *f = fopen(path, "r");
+  char  line[256], type[32], text[128];
+  uint8_t key[64];
+  unsigned long keyId;
+  int   keyType, cbKey, count = 0, i;
+
+  if (f == NULL)
+  {
+    perror(path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    char *comment = strchr(line, '#');
+
+    if (comment != NULL)
+      *comment = 0;
+
+    if (sscanf(line, "%lu %31s %127s", &keyId, type, text) != 3)
+      continue;
+
+    if (strcasecmp(type, "SHA1") == 0 || strcasecmp(type, "SHA-1") == 0)
+      keyType = L_NTP_KEY_SHA1;
+    else if (strcasecmp(type, "AES128CMAC") == 0)
+      keyType = L_NTP_KEY_AES128CMAC;
+    else
+    {
+      fprintf(stderr, "%s: key %lu: type %s not supported\n", path, keyId, type);
+      continue;
+    }
+
+    cbKey = strlen(text);
+
+    if (cbKey > 20)
+    {
+      for (i = 0; i * 2 + 1 < cbKey && i < (int)sizeof(key) && isxdigit((unsigned char)text[i * 2]) && isxdigit((unsigned char)text[i * 2 + 1]); i++)
+        sscanf(&text[i * 2], "%2hhx", &key[i]);
+
+      if (i * 2 != cbKey)
+      {
+        fprintf(stderr, "%s: key %lu: bad hex key\n", path, keyId);
+        continue;
+      }
+
+      cbKey = i;
+    }
+    else
+    {
+      memcpy(key, text, cbKey);
+    }
+
+    if (server.addKey(keyId, keyType, key, cbKey) == L_NTP_R_SUCCESS)
+      count++;
+    else
+      fprintf(stderr, "%s: key %lu: not added\n", path, keyId);
+  }
+
+  fclose(f);
+
+  return count;
+}
+
+static void configure(NTPServer &server)
+{
+  // Applies the command line options (must happen before the server is started)
+
+  struct utsname uts;
+
+  // Lets "ntpq -c rv" tell the hosts of a fleet apart
+  if (uname(&uts) == 0)
+  {
+    snprintf(systemName, sizeof(systemName), "\"%s/%s\"", uts.sysname, uts.release);
+    server.addVariable("system", systemName);
+  }
+
+  // The clock is read in microseconds, not the whole seconds of the default
+  // (which another server taking our time adds to its error)
+  server.setServerPrecision(0.000001);
+
+  if (opts.keyFile != NULL)
+  {
+    printf("Loaded %d keys\n", loadKeys(server, opts.keyFile));
+    server.setAuthenticationRequired(opts.authRequired);
+  }
+
+  if (opts.throttleMillis > 0)
+    server.enableThrottling(THROTTLE_TABLE_ENTRIES, opts.throttleMillis, THROTTLE_BURST, true);
+
+  if (opts.interleaved)
+    server.enableInterleaved(INTERLEAVE_TABLE_ENTRIES);
+
+  if (opts.capture != NULL && server.enableCapture(CAPTURE_PACKETS) != L_NTP_R_SUCCESS)
+    fprintf(stderr, "Packet capture not available\n");
+
+  if (opts.upstreamCount == 0)
+    syncFromSystemClock(server);
+}
+
+template <class T>
+static int addListenAddresses(T &server)
+{
+  IPAddress address;
+  int i;
+
+  for (i = 0; i < opts.listenCount; i++)
+  {
+    if (!address.fromString(opts.listen[i]) || server.addListenAddress(address) != L_NTP_R_SUCCESS)
+    {
+      fprintf(stderr, "Bad listen address: %s\n", opts.listen[i]);
+      return L_NTP_R_ERROR;
+    }
+  }
+
+  return L_NTP_R_SUCCESS;
+}
+
+static int addUpstreamServers(NTPServer &server)
+{
+  IPAddress address;
+  char *port;
+  int i;
+
+  for (i = 0; i < opts.upstreamCount; i++)
+  {
+    port = strchr(opts.upstream[i], ',');
+
+    if (port != NULL)
+      *port++ = 0;
+
+    if (!address.fromString(opts.upstream[i]) || server.addUpstreamServer(address, port != NULL ? atoi(port) : L_NTP_PORT) < 0)
+    {
+      fprintf(stderr, "Bad upstream server: %s\n", opts.upstream[i]);
+      return L_NTP_R_ERROR;
+    }
+  }
+
+  return L_NTP_R_SUCCESS;
+}
+
+static int startNts(NTPServer &server)
+{
+  // A fresh master key per run: cookies do not outlive the daemon
+#ifdef L_NTP_HAVE_OPENSSL
+  uint8_t masterKey[L_NTP_NTS_MASTER_KEY];
+  char   *keyFile = strchr(opts.nts, ',');
+  FILE   *f = fopen("/dev/urandom", "r");
+
+  if (keyFile == NULL || f == NULL || fread(masterKey, 1, sizeof(masterKey), f) != sizeof(masterKey))
+  {
+    fprintf(stderr, "NTS: need -n cert,key and /dev/urandom\n");
+
+    if (f != NULL)
+      fclose(f);
+
+    return L_NTP_R_ERROR;
+  }
+
+  fclose(f);
+  *keyFile++ = 0;
+
+  keServer.setNtpPort(opts.port);
+
+  if (server.enableNts(masterKey, sizeof(masterKey)) != L_NTP_R_SUCCESS ||
+      keServer.begin(L_NTP_NTS_KE_PORT_NUM, opts.nts, keyFile, masterKey, sizeof(masterKey)) != L_NTP_R_SUCCESS)
+  {
+    fprintf(stderr, "NTS: could not start NTS-KE on port %d\n", L_NTP_NTS_KE_PORT_NUM);
+    return L_NTP_R_ERROR;
+  }
+
+  memset(masterKey, 0, sizeof(masterKey));
+  printf("NTS-KE on port %d\n", L_NTP_NTS_KE_PORT_NUM);
+
+  return L_NTP_R_SUCCESS;
+#else
+  fprintf(stderr, "NTS: built without OpenSSL\n");
+  return L_NTP_R_ERROR;
+#endif
+}
+
+static void stopNts()
+{
+#ifdef L_NTP_HAVE_OPENSSL
+  if (opts.nts != NULL)
+  {
+    keServer.end();
+    printf("NTS-KE sessions: %lu, failed: %lu\n", keServer.getSessions(), keServer.getFailures());
+  }
+#endif
+}
+
+static void report(NTPServer &server)
+{
+  static const char *const reasons[] =
+  {
+    "unsupported version", "missing data", "too much data", "bad request",
+    "not implemented", "bad variable name", "not permitted", "throttled",
+    "bad MAC"
+  };
+
+  uint32_t histogram[L_NTP_HIST_BUCKETS];
+  int i;
+
+  printf("Served %llu requests\n", (unsigned long long)server.getRequestCount(L_NTP_STAT_SERVED));
+
+  if (opts.interleaved)
+    printf("  interleaved: %lu\n", server.getInterleavedReplies());
+
+  for (i = 0; i < (int)(sizeof(reasons) / sizeof(reasons[0])); i++)
+  {
+    uint64_t n = server.getRequestCount(L_NTP_UNSUPPORTED_VERSION + i);
+
+    if (n != 0)
+      printf("  rejected (%s): %llu\n", reasons[i], (unsigned long long)n);
+  }
+
+  server.getProcessingHistogram(histogram);
+  printf("Processing time (ns):\n");
+
+  for (i = 0; i < L_NTP_HIST_BUCKETS; i++)
+  {
+    if (histogram[i] != 0)
+      printf("  %10llu - %10llu: %lu\n", 1ULL << i, (2ULL << i) - 1, (unsigned long)histogram[i]);
+  }
+}
+
+static int runSingle()
+{
+  PosixNTPServer server(opts.refId, opts.stratum);
+
+  configure(server);
+
+  if (addListenAddresses(server) != L_NTP_R_SUCCESS || addUpstreamServers(server) != L_NTP_R_SUCCESS)
+    return 1;
+
+  if (opts.broadcast != NULL)
+  {
+    uint32_t address;
+
+    if (inet_pton(AF_INET, opts.broadcast, &address) != 1)
+    {
+      fprintf(stderr, "Bad address: %s\n", opts.broadcast);
+      return 1;
+    }
+
+    server.enableBroadcast(IPAddress(address));
+  }
+
+  if (opts.nts != NULL && startNts(server) != L_NTP_R_SUCCESS)
+    return 1;
+
+  if (server.begin(opts.port) != L_NTP_R_SUCCESS)
+  {
+    perror("begin");
+    return 1;
+  }
+
+  unsigned long lastSync = millis();
+
+  while (running)
+  {
+    server.poll(1000, opts.batch);
+
+    if (opts.upstreamCount == 0 && millis() - lastSync >= 16000)
+    {
+      syncFromSystemClock(server);
+      lastSync = millis();
+    }
+
+    if (saveCapture)
+      writeCaptureFile(server);
+  }
+
+  report(server);
+
+  if (opts.capture != NULL)
+    writeCaptureFile(server);
+
+  if (opts.broadcast != NULL)
+    printf("Sent %lu broadcasts\n", server.getBroadcastsSent());
+
+  for (int i = 0; i < opts.upstreamCount; i++)
+    printf("Upstream %s: reach %03o\n", opts.upstream[i], server.getUpstreamReach(i));
+
+  stopNts();
+  server.end();
+
+  return 0;
+}
+
+static int runPool()
+{
+  PosixNTPServerPool pool(opts.refId, opts.stratum);
+
+  configure(pool);
+  pool.setBatchSize(opts.batch);
+
+  if (addListenAddresses(pool) != L_NTP_R_SUCCESS)
+    return 1;
+
+  if (opts.nts != NULL && startNts(pool) != L_NTP_R_SUCCESS)
+    return 1;
+
+  if (pool.begin(opts.port, opts.workers) != L_NTP_R_SUCCESS)
+  {
+    perror("begin");
+    return 1;
+  }
+
+  printf("Started %d workers on port %d\n", pool.getWorkerCount(), opts.port);
+
+  while (running)
+  {
+    sleep(16);   // Cut short by signals
+    syncFromSystemClock(pool);
+
+    if (saveCapture)
+      writeCaptureFile(pool);
+  }
+
+  report(pool);
+
+  // While the workers (and their captures) are still around
+  if (opts.capture != NULL)
+    writeCaptureFile(pool);
+  stopNts();
+  pool.end();
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:l:r:s:b:w:t:B:k:an:xc:u:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'p': opts.port = atoi(optarg); break;
+      case 'l':
+        if (opts.listenCount < L_NTP_MAX_LISTENERS)
+          opts.listen[opts.listenCount++] = optarg;
+        break;
+      case 'r': opts.refId = optarg; break;
+      case 's': opts.stratum = atoi(optarg); break;
+      case 'b': opts.batch = atoi(optarg); break;
+      case 'w': opts.workers = atoi(optarg); break;
+      case 't': opts.throttleMillis = atoi(optarg); break;
+      case 'B': opts.broadcast = optarg; break;
+      case 'k': opts.keyFile = optarg; break;
+      case 'a': opts.authRequired = true; break;
+      case 'n': opts.nts = optarg; break;
+      case 'x': opts.interleaved = true; break;
+      case 'c': opts.capture = optarg; break;
+      case 'u':
+        if (opts.upstreamCount < L_NTP_MAX_UPSTREAMS)
+          opts.upstream[opts.upstreamCount++] = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-p port] [-l address]... [-r refid] [-s stratum] [-b batch] [-w workers] [-t intervalMs] [-B address] [-k keyfile [-a]] [-n cert,key] [-x] [-c file] [-u address[,port]]...\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (opts.broadcast != NULL && opts.workers != 1)
+  {
+    fprintf(stderr, "Broadcast mode needs a single worker\n");
+    return 1;
+  }
+
+  if (opts.upstreamCount > 0 && opts.workers != 1)
+  {
+    fprintf(stderr, "Upstream servers need a single worker\n");
+    return 1;
+  }
+
+  // Reference times are handed over as UTC
+  setenv("TZ", "UTC", 1);
+  tzset();
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGUSR1, onSignal);
+
+  if (opts.workers == 1)
+    return runSingle();
+
+  return runPool();
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+/*
+  NTPCrypto.h
+
+  Self-contained primitives for NTP symmetric-key authentication and NTS:
+  SHA-1, the AES-128 block cipher, AES-CMAC (RFC 4493) and AES-SIV (RFC 5297).
+  No dependencies beyond the C library, so they build the same on the ESP8266
+  and on the host.
+
+  The classes have no constructors and hold all of their state by value, so
+  a keyed state can be prepared once and copied (or used const) per packet.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define L_NTP_SHA1_DIGEST     20   /* Bytes of a SHA-1 digest */
+#define L_NTP_SHA1_BLOCK      64   /* Bytes per SHA-1 compression */
+#define L_NTP_AES_BLOCK       16   /* Bytes per AES block, and of a CMAC */
+#define L_NTP_AES128_KEY      16   /* Bytes of an AES-128 key */
+#define L_NTP_AES_SIV_KEY     32   /* Bytes of an AEAD_AES_SIV_CMAC_256 key (MAC key, then CTR key) */
+
+class NTPSha1
+{
+public:
+  void init();
+  void update(const void *data, size_t cbData);
+  void final(uint8_t digest[L_NTP_SHA1_DIGEST]);
+
+protected:
+  uint32_t _state[5];
+  uint64_t _length;                        // Bytes hashed so far
+  uint8_t  _buffer[L_NTP_SHA1_BLOCK];      // Partial block, _length % 64 bytes
+
+  void _compress(const uint8_t *block);
+};
+
+class NTPAes128
+{
+public:
+  void setKey(const uint8_t key[L_NTP_AES128_KEY]);
+  void encrypt(const uint8_t in[L_NTP_AES_BLOCK], uint8_t out[L_NTP_AES_BLOCK]) const;
+
+protected:
+  uint8_t _roundKeys[11 * L_NTP_AES_BLOCK];  // Expanded key schedule
+};
+
+class NTPCmac
+{
+public:
+  void setKey(const uint8_t key[L_NTP_AES128_KEY]);
+  void compute(const void *data, size_t cbData, uint8_t mac[L_NTP_AES_BLOCK], const uint8_t *xorEnd = NULL) const;
+
+protected:
+  NTPAes128 _aes;
+  uint8_t   _k1[L_NTP_AES_BLOCK];            // Subkey for a complete last block
+  uint8_t   _k2[L_NTP_AES_BLOCK];            // Subkey for a padded last block
+};
+
+class NTPAesSiv
+{
+public:
+  void setKey(const uint8_t key[L_NTP_AES_SIV_KEY]);
+
+  // Components may be left out by passing NULL (an empty one is not the same).
+  // seal() writes the 16 byte SIV followed by the ciphertext; open() checks
+  // it and writes cbIn - 16 bytes of plaintext.
+  void seal(const void *ad, size_t cbAd, const uint8_t *nonce, size_t cbNonce,
+            const void *plain, size_t cbPlain, uint8_t *out) const;
+  bool open(const void *ad, size_t cbAd, const uint8_t *nonce, size_t cbNonce,
+            const uint8_t *in, size_t cbIn, uint8_t *plain) const;
+
+protected:
+  NTPCmac   _mac;
+  NTPAes128 _ctr;
+  uint8_t   _d0[L_NTP_AES_BLOCK];            // MAC of the zero block, where S2V starts
+
+  void _s2v(const void *ad, size_t cbAd, const uint8_t *nonce, size_t cbNonce,
+            const void *plain, size_t cbPlain, uint8_t v[L_NTP_AES_BLOCK]) const;
+  void _crypt(const uint8_t v[L_NTP_AES_BLOCK], const uint8_t *in, size_t cb, uint8_t *out) const;
+};
+
+/* Compares two MACs in time independent of where they differ */
+bool ntpMacEqual(const uint8_t *a, const uint8_t *b, size_t cb);
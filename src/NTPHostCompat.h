@@ -0,0 +1,138 @@
+#pragma once
+
+/*
+  NTPHostCompat.h
+
+  Minimal stand-ins for the pieces of the Arduino core that NTPServer relies
+  on (Print, UDP, IPAddress, micros64, millis, delay). This header is only used when the
+  library is compiled outside of the Arduino environment, i.e. when the server
+  core is built as a host daemon on Linux.
+
+  The UDP class mirrors the Arduino signatures so that the server core does
+  not need to know which environment it is running in.
+*/
+
+#ifndef ARDUINO
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+class IPAddress
+{
+protected:
+  uint8_t _v6;                 // Non-zero if this holds an IPv6 address
+  uint8_t _address[16];        // Address bytes in network order
+
+public:
+  IPAddress()                                       { _v6 = 0; memset(_address, 0, sizeof(_address)); }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : IPAddress()
+  {
+    _address[0] = a; _address[1] = b; _address[2] = c; _address[3] = d;
+  }
+  IPAddress(uint32_t address) : IPAddress()         { memcpy(_address, &address, 4); }
+
+  bool isV4() const                                 { return _v6 == 0; }
+  bool isV6() const                                 { return _v6 != 0; }
+
+  const uint8_t *raw_address() const               { return _address; }
+  uint8_t *raw_address()                            { return _address; }
+  int rawLength() const                             { return _v6 ? 16 : 4; }
+
+  operator uint32_t() const                         { uint32_t v; memcpy(&v, _address, 4); return v; }
+  uint8_t operator[](int index) const               { return _address[index]; }
+  uint8_t &operator[](int index)                    { return _address[index]; }
+
+  bool operator==(const IPAddress &other) const
+  {
+    return _v6 == other._v6 && memcmp(_address, other._address, rawLength()) == 0;
+  }
+  bool operator!=(const IPAddress &other) const     { return !(*this == other); }
+
+  void setV6(const uint8_t *address)                { _v6 = 1; memcpy(_address, address, 16); }
+
+  bool fromString(const char *address)
+  {
+    uint8_t buf[16];
+
+    if (inet_pton(AF_INET, address, buf) == 1)
+    {
+      *this = IPAddress(buf[0], buf[1], buf[2], buf[3]);
+      return true;
+    }
+
+    if (inet_pton(AF_INET6, address, buf) == 1)
+    {
+      setV6(buf);
+      return true;
+    }
+
+    return false;
+  }
+
+  const char *toString(char *buf, size_t cbBuf) const
+  {
+    return inet_ntop(_v6 ? AF_INET6 : AF_INET, _address, buf, cbBuf);
+  }
+};
+
+class Print
+{
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+};
+
+class UDP : public Print
+{
+public:
+  virtual ~UDP() {}
+
+  virtual uint8_t begin(uint16_t port) = 0;
+  virtual void stop() = 0;
+
+  virtual int beginPacket(IPAddress ip, uint16_t port) = 0;
+  virtual int beginPacket(const char *host, uint16_t port) = 0;
+  virtual int endPacket() = 0;
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+
+  virtual int parsePacket() = 0;
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int read(unsigned char *buffer, size_t len) = 0;
+  virtual int read(char *buffer, size_t len) = 0;
+  virtual int peek() = 0;
+  virtual void flush() = 0;
+
+  virtual IPAddress remoteIP() = 0;
+  virtual uint16_t remotePort() = 0;
+};
+
+inline uint64_t micros64()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+inline unsigned long millis()
+{
+  return (unsigned long)(micros64() / 1000);
+}
+
+inline void delay(unsigned long ms)
+{
+  struct timespec ts;
+
+  ts.tv_sec  = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000;
+  nanosleep(&ts, NULL);
+}
+
+#endif
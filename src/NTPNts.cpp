@@ -0,0 +1,121 @@
+/*
+  NTPNts.cpp
+
+  Server cookies for Network Time Security (RFC 8915). Cookie keys are derived
+  from the master key with AES-CMAC as the PRF, once per rotation period, and
+  kept expanded; sealing or opening a cookie is then a few AES blocks.
+*/
+
+#include <string.h>
+#include <time.h>
+
+#include "NTPNts.h"
+
+#define L_NTP_NTS_UNIX_EPOCH   2208988800UL   /* NTP seconds at 1970-01-01 */
+
+uint32_t NTPNtsCookies::currentPeriod()
+{
+  // Whoever seals cookies and whoever opens them must agree on the period, so
+  // both go by the system's realtime clock rather than by the time served,
+  // which is not set before the first sync and may step. On the ESP8266 that
+  // is the clock configTime() sets.
+  return periodAt((uint32_t)(time(NULL) + L_NTP_NTS_UNIX_EPOCH));
+}
+
+static void deriveKey(const uint8_t masterKey[L_NTP_NTS_MASTER_KEY], char label, uint32_t period,
+                      uint8_t *out, int cbOut)
+{
+  // out = CMAC(M1, label | period | 1) | CMAC(M2, label | period | 2) ..., M1 and M2 the master key halves
+  NTPCmac prf;
+  uint8_t input[6];
+  int i;
+
+  input[0] = (uint8_t)label;
+  input[1] = (uint8_t)(period >> 24);
+  input[2] = (uint8_t)(period >> 16);
+  input[3] = (uint8_t)(period >> 8);
+  input[4] = (uint8_t)period;
+
+  for (i = 0; i * L_NTP_AES_BLOCK < cbOut; i++)
+  {
+    prf.setKey(&masterKey[(i & 1) * L_NTP_AES128_KEY]);
+    input[5] = (uint8_t)(i + 1);
+    prf.compute(input, sizeof(input), &out[i * L_NTP_AES_BLOCK]);
+  }
+}
+
+void NTPNtsCookies::setMasterKey(const uint8_t masterKey[L_NTP_NTS_MASTER_KEY], uint64_t seed)
+{
+  uint8_t key[L_NTP_AES128_KEY];
+  int i;
+
+  memcpy(_masterKey, masterKey, sizeof(_masterKey));
+
+  deriveKey(_masterKey, 'N', 0, key, sizeof(key));
+  _nonceKey.setKey(key);
+
+  memset(_nonceCounter, 0, sizeof(_nonceCounter));
+
+  for (i = 0; i < 8; i++)
+    _nonceCounter[i] = (uint8_t)(seed >> (56 - 8 * i));
+
+  _derived[0] = _derived[1] = false;
+}
+
+void NTPNtsCookies::nonce(uint8_t out[L_NTP_NTS_NONCE])
+{
+  // AES of seed | count: unique as long as the seeds are, and unpredictable
+  int i;
+
+  for (i = L_NTP_AES_BLOCK - 1; i >= 8 && ++_nonceCounter[i] == 0; i--)
+    ;
+
+  _nonceKey.encrypt(_nonceCounter, out);
+}
+
+const NTPAesSiv *NTPNtsCookies::_keyFor(uint32_t period)
+{
+  uint8_t key[L_NTP_AES_SIV_KEY];
+  int slot = period & 1;
+
+  if (!_derived[slot] || _period[slot] != period)
+  {
+    deriveKey(_masterKey, 'C', period, key, sizeof(key));
+    _cookieKey[slot].setKey(key);
+    _period[slot]  = period;
+    _derived[slot] = true;
+  }
+
+  return &_cookieKey[slot];
+}
+
+void NTPNtsCookies::seal(uint32_t period, const uint8_t keys[2 * L_NTP_NTS_KEY], uint8_t cookie[L_NTP_NTS_COOKIE])
+{
+  cookie[0] = (uint8_t)(period >> 24);
+  cookie[1] = (uint8_t)(period >> 16);
+  cookie[2] = (uint8_t)(period >> 8);
+  cookie[3] = (uint8_t)period;
+
+  nonce(&cookie[4]);
+
+  // The key id goes in as associated data, the nonce as the nonce
+  _keyFor(period)->seal(cookie, 4, &cookie[4], L_NTP_NTS_NONCE, keys, 2 * L_NTP_NTS_KEY, &cookie[4 + L_NTP_NTS_NONCE]);
+}
+
+bool NTPNtsCookies::open(uint32_t period, const uint8_t *cookie, int cbCookie, uint8_t keys[2 * L_NTP_NTS_KEY])
+{
+  uint32_t cookiePeriod;
+
+  if (cbCookie != L_NTP_NTS_COOKIE)
+    return false;
+
+  cookiePeriod = ((uint32_t)cookie[0] << 24) | ((uint32_t)cookie[1] << 16) | ((uint32_t)cookie[2] << 8) | cookie[3];
+
+  // This period's cookies and the last one's, with a period of slack for a
+  // cookie server whose clock is ahead of ours
+  if (cookiePeriod - period + 1 > 2)
+    return false;
+
+  return _keyFor(cookiePeriod)->open(cookie, 4, &cookie[4], L_NTP_NTS_NONCE,
+                                     &cookie[4 + L_NTP_NTS_NONCE], L_NTP_AES_BLOCK + 2 * L_NTP_NTS_KEY, keys);
+}
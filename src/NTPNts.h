@@ -0,0 +1,86 @@
+#pragma once
+
+/*
+  NTPNts.h
+
+  Network Time Security (RFC 8915) definitions shared by the NTP request path
+  and the NTS-KE server, and the server cookie format.
+
+  A cookie carries the client's C2S and S2C keys, sealed with AES-SIV under a
+  cookie key derived from the master key for the current rotation period:
+
+    key id (4, = period number)  nonce (16)  SIV (16)  C2S key (32)  S2C key (32)
+
+  so the NTP server needs no per-client state. Anything holding the same
+  master key (other workers, or an NTS-KE server in another process) can open
+  the cookies of any other.
+*/
+
+#include <stdint.h>
+
+#include "NTPCrypto.h"
+
+/* NTS Extension Fields */
+#define L_NTP_NTS_EF_UNIQUE_ID       0x0104
+#define L_NTP_NTS_EF_COOKIE          0x0204
+#define L_NTP_NTS_EF_PLACEHOLDER     0x0304
+#define L_NTP_NTS_EF_AUTHENTICATOR   0x0404
+
+/* NTS-KE Records */
+#define L_NTP_NTS_KE_END                  0
+#define L_NTP_NTS_KE_NEXT_PROTOCOL        1
+#define L_NTP_NTS_KE_ERROR                2
+#define L_NTP_NTS_KE_WARNING              3
+#define L_NTP_NTS_KE_AEAD                 4
+#define L_NTP_NTS_KE_NEW_COOKIE           5
+#define L_NTP_NTS_KE_SERVER               6
+#define L_NTP_NTS_KE_PORT                 7
+#define L_NTP_NTS_KE_CRITICAL        0x8000
+
+#define L_NTP_NTS_KE_ERR_UNRECOGNIZED     0   /* Unrecognized critical record */
+#define L_NTP_NTS_KE_ERR_BAD_REQUEST      1
+
+#define L_NTP_NTS_KE_PORT_NUM          4460
+#define L_NTP_NTS_KE_ALPN         "ntske/1"
+#define L_NTP_NTS_KE_EXPORTER     "EXPORTER-network-time-security"
+#define L_NTP_NTS_PROTO_NTPV4             0
+#define L_NTP_NTS_AEAD_SIV_CMAC_256      15   /* The only algorithm offered */
+
+/* Sizes */
+#define L_NTP_NTS_KEY                    32   /* C2S or S2C key */
+#define L_NTP_NTS_MASTER_KEY             32
+#define L_NTP_NTS_NONCE                  16
+#define L_NTP_NTS_COOKIE   (4 + L_NTP_NTS_NONCE + L_NTP_AES_BLOCK + 2 * L_NTP_NTS_KEY)
+#define L_NTP_NTS_MIN_UID                32
+#define L_NTP_NTS_MAX_UID                64   /* Longest unique identifier echoed back */
+#define L_NTP_NTS_MAX_COOKIES             8   /* Most cookies handed out per reply or NTS-KE session */
+#define L_NTP_NTS_KEY_PERIOD          86400   /* Cookie key rotation, s (cookies of the last period still open) */
+#define L_NTP_NTS_KOD_NAK            "NTSN"
+
+class NTPNtsCookies
+{
+public:
+  // seed must differ between holders of the same master key (and across
+  // restarts), it keeps their nonces apart
+  void setMasterKey(const uint8_t masterKey[L_NTP_NTS_MASTER_KEY], uint64_t seed);
+
+  // keys = C2S key followed by S2C key
+  void seal(uint32_t period, const uint8_t keys[2 * L_NTP_NTS_KEY], uint8_t cookie[L_NTP_NTS_COOKIE]);
+  bool open(uint32_t period, const uint8_t *cookie, int cbCookie, uint8_t keys[2 * L_NTP_NTS_KEY]);
+
+  void nonce(uint8_t out[L_NTP_NTS_NONCE]);      // Unique per call
+
+  static uint32_t periodAt(uint32_t ntpSeconds) { return ntpSeconds / L_NTP_NTS_KEY_PERIOD; }
+  static uint32_t currentPeriod();                // By the system's realtime clock, see NTPNts.cpp
+
+protected:
+  uint8_t   _masterKey[L_NTP_NTS_MASTER_KEY];
+  NTPAes128 _nonceKey;
+  uint8_t   _nonceCounter[L_NTP_AES_BLOCK];    // Seed, then a 64 bit count
+
+  uint32_t  _period[2];                        // Slot = period & 1, so the current and the last are both held
+  bool      _derived[2];
+  NTPAesSiv _cookieKey[2];
+
+  const NTPAesSiv *_keyFor(uint32_t period);
+};
@@ -1,516 +1,3522 @@
+#ifdef ARDUINO
 #include <Arduino.h>
 #include <udp.h>
+#endif
 
 #include <math.h>
+#include <new>
+#include <stddef.h>
+#include <string.h>
 #include <time.h>
 
 #include "NTPServer.h"
 
+static inline uint64_t statNanos()
+{
+  // Clock for the statistics. Resolution is whatever the platform offers.
+#ifdef ARDUINO
+  return micros64() * 1000;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 NTPServer::NTPServer()
 {
-  onReadVariableCallback      = NULL;
-  
-  _packetBufferPtr            = 0;
+  _packetLength               = 0;
   _clockIsSynchronized        = 0;
   _clockSynchronizedSinceBoot = 0;
   _lastTimeSyncMillis         = 0;
   _requestsSucceeded          = 0;
   _requestsFailed             = 0;
+  _requestsThrottled          = 0;
+  _interrupted                = false;
+  _broadcastIntervalSeconds   = 0;
+  _broadcastPoll              = 0;
+  _nextBroadcastMicros        = 0;
+  _broadcastsSent             = 0;
   _stratum                    = L_NTP_STRAT_UNSPECIFIED;
-
-  _maxTimeBetweenUpdates      = 5 * 60 * 1000 * 1000; // 5 minutes of drift
+  _maxPollInterval            = 0;
+  _precision                  = 0;
+  _rootDelay                  = 0;
+  _rootDispersion             = 0;
+  _referenceTimeMicros        = 0;
+  _referenceTimeAsSeconds     = 0;
+  _referenceTimestamp         = 0;
+  _frequency                  = 0;
+  _dispersionRate             = 0;
+  _dispersionAtSync           = 0;
+  _frequencyKnown             = false;
+  _wander                     = L_NTP_TOLERANCE;
+  _jitter                     = 0;
+  _maxTimeError               = L_NTP_MAX_ERROR;
+  _freqAnchorMicros           = 0;
+  _freqAnchorTimestamp        = 0;
+  _maxTimeBetweenUpdates      = 0;
+  _lastOffset                 = 0;
+  _publishSeq                 = 0;
+  _writeLock                  = false;
+  _ppsSeq                     = 0;
+  _ppsMicros                  = 0;
+  _ppsPublished               = 0;
+
+  memset(_referenceId, 0, sizeof(_referenceId));
+  memset(_published, 0, sizeof(_published));
+
+#if L_NTP_CONTROL
+  onReadVariableCallback      = NULL;
+  _variableCount              = 0;
+  _controlOffset              = 0;
+  _controlCount               = 0;
+  _controlAuth                = L_NTP_NOT_PERMITTED;
+#endif
+
+#if L_NTP_THROTTLING
+  _clientTable                = NULL;
+  _clientTableBuckets         = 0;
+  _throttleIntervalMillis     = 0;
+  _throttleBurst              = 0;
+  _throttleKissOfDeath        = false;
+#endif
+
+#if L_NTP_CAPTURE
+  _captureRing                = NULL;
+  _captureSlots               = 0;
+  _captureSnapLength          = 0;
+  _captureSlotSize            = 0;
+  _captureCount               = 0;
+#endif
+
+#if L_NTP_AUTH
+  _keyCount                   = 0;
+  _authRequired               = false;
+#endif
+
+#if L_NTP_NTS
+  _ntsEnabled                 = false;
+  _ntsGeneration              = 0;
+  _ntsCookiesGeneration       = 0;
+#endif
+
+#if L_NTP_SOURCES
+  _sourceCount                = 0;
+  _selectedSource             = -1;
+  _upstreamCount              = 0;
+#endif
+
+#if L_NTP_INTERLEAVE
+  _interleaveTable            = NULL;
+  _interleaveBuckets          = 0;
+  _interleavedReplies         = 0;
+#endif
+
+#if L_NTP_STATISTICS
+  _lastUpdateNanos            = 0;
+
+  memset(_requestCounts, 0, sizeof(_requestCounts));
+  memset(_processingHistogram, 0, sizeof(_processingHistogram));
+  memset(_updateHistogram, 0, sizeof(_updateHistogram));
+#endif
   
-  setMaxPollInterval(64);
-  setServerPrecision(1);
+  // Defaults of the setters below, worked out by the compiler
+  constexpr char defaultPoll      = _log2(64);
+  constexpr char defaultPrecision = _log2(1);
+
+  _maxPollInterval            = defaultPoll;
+  _precision                  = defaultPrecision;
   setRootDelay(0);
   setRootDispersion(0);
   setReferenceId("LOCL");
 
   _udp = NULL;
+  _listenerCount = 0;
+  _listener      = 0;
+  _nextListener  = 0;
+  _clock = this;
 }
 
 NTPServer::NTPServer(const char *referenceId, const char stratum) : NTPServer()
 {
   setReferenceId(referenceId);
-  _stratum = stratum;
+  setStratum(stratum);
+}
+
+NTPServer::~NTPServer()
+{
+  disableThrottling();
+  disableInterleaved();
+  disableCapture();
 }
 
-int NTPServer::begin(UDP &udp)
+int NTPServer::begin(L_NTP_TRANSPORT &udp)
 {
   // I am welcome to suggestions as to how to prevent needing an external UDP
   // object. To that end: what kind of UDP class are we employing? EthernetUdp or WifiUdp? OtherUdp?
   // This way, no matter what is employed, as long as it is derived from the UDP object we can use it.
 
-  _udp = &udp;
+  _udp           = &udp;
+  _listeners[0]  = &udp;
+  _listenerCount = 1;
+  _listener      = 0;
+  _nextListener  = 0;
+
+  return L_NTP_R_SUCCESS;
 }
 
-void NTPServer::end()
+int NTPServer::addListener(L_NTP_TRANSPORT &udp)
 {
-  if (_udp)
-  {
-    _udp->stop();
-    _udp = NULL;
-  }
+  // All listeners share the clock, the client tables and the statistics. A
+  // request is answered through the listener it came in on.
+
+  if (_listenerCount == 0 || _listenerCount >= L_NTP_MAX_LISTENERS)
+    return L_NTP_R_ERROR;
+
+  _listeners[_listenerCount++] = &udp;
+
+  return L_NTP_R_SUCCESS;
 }
 
-void NTPServer::update()
+void NTPServer::end()
 {
-  static struct timeval   tvReceived;
+  int i;
 
-  // de-sync as needed
-  if (micros64() - _referenceTimeMicros > _maxTimeBetweenUpdates)
-    _clockIsSynchronized = 0;
-   
-  if (_recv(sizeof(S_NTP_HEADER)))
-  {
-    /* We have something incoming, figure out what to receive after a quick sanity check on version number */
-    _timestamp(&tvReceived);
+  for (i = 0; i < _listenerCount; i++)
+    _listeners[i]->L_NTP_TRANSPORT_CALL(stop)();
 
-    if (_u_packetBuffer.header.vn >= L_NTP_MIN_VER || _u_packetBuffer.header.vn <= L_NTP_MAX_VER)
-    {
-      if (_u_packetBuffer.header.mode == L_NTP_MODE_CLIENT)            /* Basic NTP Request */
-      {
-        if (_recv(sizeof(S_NTP_PACKET) - sizeof(S_NTP_HEADER)))
-        {
-          _handleRequest(tvReceived);
-        }  
-        else
-        {
-          // We did not get enough data within a reasonable timeframe
-          _close(L_NTP_MISSING_DATA);
-        }
-      }
-      else if (_u_packetBuffer.header.mode == L_NTP_MODE_CONTROL)      /* Control Mode Request */
-      {        
-        // Zero out the control packet addendum to prevent overwrite
-        memset(&_u_packetBuffer.byteBuffer[sizeof(S_NTP_HEADER)], 0, L_NTP_MAX_RX_BUFF - sizeof(S_NTP_CONTROL_PACKET));
-        
-        if (_recv(sizeof(S_NTP_CONTROL_PACKET) - sizeof(S_NTP_HEADER)))
-        {
-          // Translate words for handler routine
-          _ntohs(&_u_packetBuffer.controlPacket.sequence);
-          _ntohs(&_u_packetBuffer.controlPacket.status);
-          _ntohs(&_u_packetBuffer.controlPacket.association_id);
-          _ntohs(&_u_packetBuffer.controlPacket.offset);
-          _ntohs(&_u_packetBuffer.controlPacket.count);
-          
-          if (_u_packetBuffer.controlPacket.count >= 0 &&
-              _u_packetBuffer.controlPacket.count <= L_NTP_MAX_RX_BUFF - sizeof(S_NTP_CONTROL_PACKET) &&
-              _u_packetBuffer.controlPacket.response == 0 &&
-              _u_packetBuffer.controlPacket.error == 0 &&
-              _u_packetBuffer.controlPacket.more == 0)
-          {
-            if (_recv(_u_packetBuffer.controlPacket.count))
-            {
-              _handleControlRequest();
-            }
-            else
-            {
-              // Client did not send as many bytes as indicated
-              _close(L_NTP_MISSING_DATA);
-            }
-          }
-          else
-          {
-            if (_u_packetBuffer.controlPacket.count > L_NTP_MAX_RX_BUFF - sizeof(S_NTP_CONTROL_PACKET))
-              _close(L_NTP_TOO_MUCH_DATA);
-            else
-              _close(L_NTP_BAD_REQUEST); // illegal request (count out of range, or R/E/M set)
-          }
-        }
-        else
-        {
-          _close(L_NTP_MISSING_DATA); // malformed request
-        }
-      } // Mode check
-      else
-      {
-        _close(L_NTP_NOT_IMPLEMENTED); // unsupported mode
-      }
-    } // Version check
-    else
-    {
-      _close(L_NTP_UNSUPPORTED_VERSION);  // unsupported version
-    }
-  }
+  _udp           = NULL;
+  _listenerCount = 0;
+}
 
-  _packetBufferPtr = 0;
+void NTPServer::update()
+{
+  update(1);
 }
 
-void NTPServer::_timestamp(struct timeval *tv)
+int NTPServer::update(int maxPackets)
 {
-  // Gets the current time
-  // This is last reference time PLUS elpased microseconds since that sync
+  return _update(0xFFFFFFFF, maxPackets);
+}
 
-  static t_ntpTimestamp delta;
+int NTPServer::_update(uint32_t listeners, int maxPackets)
+{
+  int served = 0, i, n;
+
+#if L_NTP_STATISTICS
+  uint64_t now = statNanos();
+
+  if (_lastUpdateNanos != 0)
+    _record(_updateHistogram, now - _lastUpdateNanos);
+
+  _lastUpdateNanos = now;
+#endif
 
-  if (_clockSynchronizedSinceBoot)
+  t_ntpSysClock sysClock = micros64();
+
+#if L_NTP_SOURCES
+  _failOver(sysClock);
+#endif
+
+  // Every listener gets up to maxPackets, and each update() starts with the
+  // next one, so a flood on one socket cannot starve the others
+  for (n = 0; n < _listenerCount; n++)
   {
-    delta = micros64() - _referenceTimeMicros;
-  
-    tv->tv_sec = _referenceTimeAsSeconds;
-
-    while (delta >= 100000000) {
-      delta -= 100000000;
-      tv->tv_sec+=100;
-    }  
-    while (delta >= 10000000) {
-      delta -= 10000000;
-      tv->tv_sec+=10;
-    }  
-    while (delta >= 1000000) {
-      delta -= 1000000;
-      tv->tv_sec++;
-    }
-    
-    tv->tv_usec = delta;
+    i = (_nextListener + n) % _listenerCount;
+
+    if (listeners & (1UL << i))
+      served += _service(i, maxPackets);
   }
-  else
+
+  if (_listenerCount > 0)
+    _nextListener = (_nextListener + 1) % _listenerCount;
+
+  if (_broadcastIntervalSeconds != 0 && _listenerCount > 0 && (int64_t)(sysClock - _nextBroadcastMicros) >= 0)
   {
-    tv->tv_sec = 0;
-    tv->tv_usec = 0;
+    _udp      = _listeners[0];
+    _listener = 0;
+    _sendBroadcast();
   }
+
+#if L_NTP_SOURCES
+  // Queries go out from the first socket too, which is where the replies come in
+  if (_upstreamCount > 0 && _listenerCount > 0)
+  {
+    _udp      = _listeners[0];
+    _listener = 0;
+    _pollUpstreams(micros64());
+  }
+#endif
+
+  return served;
 }
 
-unsigned long NTPServer::getElapsedTimeSinceSync()
+int NTPServer::_service(int listener, int maxPackets)
 {
-  return millis() - _lastTimeSyncMillis;
+  int i;
+
+  _udp      = _listeners[listener];
+  _listener = listener;
+
+  _beginBatch(maxPackets);
+
+  for (i = 0; i < maxPackets; i++)
+  {
+    if (!_processPacket())
+      break;
+  }
+
+  _endBatch();
+
+  return i;
 }
 
-void NTPServer::_htonTimestamp(const struct timeval tv, t_ntpTimestamp *dest)
+int NTPServer::poll(int timeoutMs, int maxPackets)
 {
-  // Packs a timeval struct into NTP format (mainly used to assemble packets)
-  
-  static uint32_t w;
-  static char *ptr;
-  
-  ptr = (char *)dest;
+  // A generic UDP can only be asked whether a datagram is waiting, so this is
+  // a poll: look once a millisecond and sleep in between. On the ESP8266,
+  // delay() hands the time to the SDK, which can idle the CPU and the radio.
+  // The price is that a request may wait up to 1 ms before its receive
+  // timestamp is taken, which the client sees as extra delay on the way in
+  // (WiFiUDP offers no receive callback to wait on). Transports with a way
+  // to block (PosixNTPServer) override this.
+
+  unsigned long start = millis();
+  int n;
+
+  timeoutMs = _pollTimeout(timeoutMs);
+
+  while (!_interrupted)
+  {
+    n = update(maxPackets);
+
+    if (n > 0)
+      return n;
 
-  w = L_NTP_EPOCH + tv.tv_sec;
-  ptr[0] = (w >> 24) & 0xFF;
-  ptr[1] = (w >> 16) & 0xFF;
-  ptr[2] = (w >> 8) & 0xFF;
-  ptr[3] = w & 0xFF;
+    if (timeoutMs >= 0 && millis() - start >= (unsigned long)timeoutMs)
+      return 0;
 
-  w = (tv.tv_usec * 1825) >> 5;
-  w = ((tv.tv_usec << 12) + (tv.tv_usec << 8) - w);
+    delay(1);
+  }
 
-  ptr[4] = (w >> 24) & 0xFF;
-  ptr[5] = (w >> 16) & 0xFF;
-  ptr[6] = (w >> 8) & 0xFF;
-  ptr[7] = w & 0xFF;  
+  _interrupted = false;
+  return -1;
 }
 
-void NTPServer::_ntohs(short *v)
+void NTPServer::run(int maxPackets)
 {
-  // Swap bytes to network order
-  // TODO: Determine based on processor type if this needs to be done
-  static char *cv;
-  static char t;
-
-  cv = (char *)v;
+  while (poll(-1, maxPackets) >= 0)
+    ;
+}
 
-  t = cv[0];
-  cv[0] = cv[1];
-  cv[1] = t;
+void NTPServer::interrupt()
+{
+  _interrupted = true;
 }
 
-void NTPServer::_handleRequest(const struct timeval tvReceived)
+int NTPServer::_pollTimeout(int timeoutMs)
 {
-  // We've already validated the request, pack in the required data and send it back.
-  static struct timeval tv;
+  t_ntpSysClock now = micros64();
+  int64_t dueMicros = INT64_MAX;
 
-  if (!_clockIsSynchronized)
-  {
-    _u_packetBuffer.header.li = L_NTP_LI_UNSYNCH;
-  }
-  else
+  if (_broadcastIntervalSeconds != 0)
+    dueMicros = (int64_t)(_nextBroadcastMicros - now);
+
+#if L_NTP_SOURCES
+  for (int i = 0; i < _upstreamCount; i++)
   {
-    // Note that at this time, we don't have any notion of leap second so we can't
-    // report anything. If someone knows how to get this out of a GPS, please
-    // implement it here
-    
-    _u_packetBuffer.header.li = L_NTP_LI_NONE;
+    if (!_upstreams[i].stopped && (int64_t)(_upstreams[i].nextMicros - now) < dueMicros)
+      dueMicros = (int64_t)(_upstreams[i].nextMicros - now);
   }
+#endif
 
-  _u_packetBuffer.header.vn              = L_NTP_VERSION;
-  _u_packetBuffer.header.mode            = L_NTP_MODE_SERVER;
+  if (dueMicros == INT64_MAX)
+    return timeoutMs;
 
-  _u_packetBuffer.packet.stratum         = (_clockSynchronizedSinceBoot ? _stratum : L_NTP_STRAT_UNSYNCHRONIZED);
-  _u_packetBuffer.packet.poll            = _maxPollInterval;
-  _u_packetBuffer.packet.precision       = _precision;
+  if (dueMicros <= 0)
+    return 0;
 
-  _u_packetBuffer.packet.root_delay      = _rootDelay;
-  _u_packetBuffer.packet.root_dispersion = _rootDispersion;
+  if (timeoutMs < 0 || dueMicros < (int64_t)timeoutMs * 1000)
+    return (int)((dueMicros + 999) / 1000);
 
-  memcpy(_u_packetBuffer.packet.reference_id, _referenceId, sizeof(_referenceId));
+  return timeoutMs;
+}
 
-  // Mirror transmit time back to sender
-  _u_packetBuffer.packet.ts_origin = _u_packetBuffer.packet.ts_transmit;
+int NTPServer::_processPacket()
+{
+  // Returns L_NTP_R_SUCCESS if a datagram was consumed (whether or not it was serviced)
 
-  _timestamp(&tv);
-  tv.tv_usec = 0;
+  t_ntpTimestamp tsReceived;
+  int cbPacket;
+  int reason;
+#if L_NTP_STATISTICS
+  uint64_t startNanos;
+#endif
+#if L_NTP_CONTROL
+  int cbPayload;
+#endif
 
-  _htonTimestamp(tvReceived, &_u_packetBuffer.packet.ts_received);
-  _htonTimestamp(tv,         &_u_packetBuffer.packet.ts_reference);
+  cbPacket = _recv();
 
-  _timestamp(&tv);
-  _htonTimestamp(tv,         &_u_packetBuffer.packet.ts_transmit);
+  if (cbPacket <= 0)
+    return L_NTP_R_ERROR;
 
-  _send(sizeof(S_NTP_PACKET));
-  
-  _requestsSucceeded++;
-}
+  // Anything that is not a well-formed request is dropped right here, before
+  // any timestamps are taken or the client table is touched
+  reason = _classify(cbPacket);
 
-void NTPServer::_handleControlRequest()
-{
-  static short reply_sz;  
-  
-  if (_u_packetBuffer.controlPacket.opcode == L_NTP_CTL_READVAR)
+#if L_NTP_CAPTURE
+  // Everything that came in, so that a replay also has the junk
+  if (_captureRing != NULL)
+    _capture(cbPacket);
+#endif
+
+  if (reason != L_NTP_R_SUCCESS)
   {
-    
-    // L_NTP_CTL_READVAR // "TZ"
-    _u_packetBuffer.controlPacket.response = 1;
+    _close(reason);
+    return L_NTP_R_SUCCESS;
+  }
 
-    // Calc max space for handler routine to dump data
-    reply_sz = L_NTP_MAX_RX_BUFF - sizeof(S_NTP_CONTROL_PACKET);
-  
-    if (onReadVariableCallback != NULL)
+#if L_NTP_STATISTICS
+  startNanos = statNanos();
+#endif
+
+  /* We have a request. The whole datagram is in the packet buffer, service it in place */
+  tsReceived = _receiveTimestamp();
+
+#if L_NTP_SOURCES
+  if (_u_packetBuffer.header.mode == L_NTP_MODE_SERVER)            /* Reply to one of our upstream queries */
+  {
+    _handleUpstreamReply(_receiveMicros());
+  }
+  else
+#endif
+#if L_NTP_THROTTLING
+  if (_clientTable != NULL && !_admitClient())                     /* Client is over its rate limit */
+  {
+    // Let a client know that it needs to back off, drop anything else
+    if (_throttleKissOfDeath && _u_packetBuffer.header.mode == L_NTP_MODE_CLIENT)
+      _sendKissOfDeath(L_NTP_KOD_RATE);
+
+    _requestsThrottled++;
+#if L_NTP_STATISTICS
+    _requestCounts[L_NTP_THROTTLED - L_NTP_UNSUPPORTED_VERSION + 1]++;
+#endif
+  }
+  else
+#endif
+  if (_u_packetBuffer.header.mode == L_NTP_MODE_CLIENT)            /* Basic NTP Request */
+  {
+    _handleRequest(tsReceived, cbPacket);
+  }
+#if L_NTP_CONTROL
+  else                                                             /* Control Mode Request */
+  {
+    // Over the request as it came in, before anything is changed in place
+    _controlAuth = _authenticateControl(cbPacket);
+
+    // Translate words for handler routine
+    _ntohs(&_u_packetBuffer.controlPacket.sequence);
+    _ntohs(&_u_packetBuffer.controlPacket.status);
+    _ntohs(&_u_packetBuffer.controlPacket.association_id);
+    _ntohs(&_u_packetBuffer.controlPacket.offset);
+    _ntohs(&_u_packetBuffer.controlPacket.count);
+
+    cbPayload = _u_packetBuffer.controlPacket.count;
+
+    if (cbPayload > L_NTP_MAX_RX_BUFF - (int)sizeof(S_NTP_CONTROL_PACKET) - 1)
     {
-      if (L_NTP_R_SUCCESS != onReadVariableCallback(&_u_packetBuffer.byteBuffer[sizeof(S_NTP_CONTROL_PACKET)], &_u_packetBuffer.byteBuffer[sizeof(S_NTP_CONTROL_PACKET)], reply_sz))
-      {
-        // Callback reported a non-success, ignore request
-        _close(L_NTP_BAD_VARIABLENAME);
-      }
-      else
-      {
-        // Callback returned success.
-        // Protect against misbehaving callback, ensure a null terminator at the end of the buffer
-        _u_packetBuffer.byteBuffer[ L_NTP_MAX_RX_BUFF - 1 ] = 0;
-
-        // Callback should have stuffed a string in the buffer. Send that back to NTP client
-        _u_packetBuffer.controlPacket.count = strlen( &_u_packetBuffer.byteBuffer[sizeof(S_NTP_CONTROL_PACKET)] );   
-        reply_sz = sizeof(S_NTP_CONTROL_PACKET) + _u_packetBuffer.controlPacket.count;
-    
-        _ntohs(&_u_packetBuffer.controlPacket.sequence);
-        _ntohs(&_u_packetBuffer.controlPacket.status);
-        _ntohs(&_u_packetBuffer.controlPacket.association_id);
-        _ntohs(&_u_packetBuffer.controlPacket.offset);
-        _ntohs(&_u_packetBuffer.controlPacket.count);
-           
-        _send(reply_sz);
-        _requestsSucceeded++;
-      }
+      _close(L_NTP_TOO_MUCH_DATA);   // No room left for the payload terminator
+    }
+    else if (cbPayload < 0 || cbPayload > cbPacket - (int)sizeof(S_NTP_CONTROL_PACKET))
+    {
+      _close(L_NTP_MISSING_DATA);    // Client did not send as many bytes as indicated
     }
     else
     {
-      // Callback not implemented
-      _close(L_NTP_NOT_IMPLEMENTED);
+      // Terminate the payload so that it can be handed out as a string
+      _u_packetBuffer.byteBuffer[sizeof(S_NTP_CONTROL_PACKET) + cbPayload] = 0;
+
+      _handleControlRequest();
     }
   }
-}
+#endif
 
-/***** System Calls ******/
+#if L_NTP_STATISTICS
+  _record(_processingHistogram, statNanos() - startNanos);
+#endif
+
+  return L_NTP_R_SUCCESS;
+}
 
-int NTPServer::_recv(int cbExpectedBytes)
+int NTPServer::_classify(int cbPacket)
 {
-  // Read in next cbExpectedBytes at mReceiveBufferPtr, return 1 if byte count matches
+  // Decides from the datagram length and its first one or two bytes whether
+  // it is a request we service: a v3/v4 client request of at least 48 bytes,
+  // or a v1-v4 control request with none of the response/error/more bits set.
+  // Server replies are taken as well while there are upstream servers to poll.
+  // Returns L_NTP_R_SUCCESS, or the reason to drop it.
 
-  static int rx;
-  static char firstCall = 1;
+  unsigned char first = (unsigned char)_u_packetBuffer.byteBuffer[0];
+  unsigned int  vn    = (first >> 3) & 7;
+  unsigned int  mode  = first & 7;
 
-  if (_udp == NULL)
-    return L_NTP_R_ERROR;
+  if (cbPacket > L_NTP_MAX_RX_BUFF)
+    return L_NTP_TOO_MUCH_DATA;                     // Not read by _recv()
 
-  if (L_NTP_MAX_RX_BUFF - _packetBufferPtr < cbExpectedBytes)
-    return L_NTP_R_ERROR; // Not enough room in buffer
+  if (cbPacket < (int)sizeof(S_NTP_CONTROL_PACKET))
+    return L_NTP_MISSING_DATA;                      // Not read by _recv()
 
-  if (firstCall)
+  if (mode == L_NTP_MODE_CLIENT)
   {
-    _udp->parsePacket();
-    firstCall = 0;
+    if (vn - L_NTP_MIN_VER > L_NTP_MAX_VER - L_NTP_MIN_VER)
+      return L_NTP_UNSUPPORTED_VERSION;
+
+    return (cbPacket >= (int)sizeof(S_NTP_PACKET) ? L_NTP_R_SUCCESS : L_NTP_MISSING_DATA);
   }
 
-  if (_udp->available() >= cbExpectedBytes)
+#if L_NTP_SOURCES
+  if (mode == L_NTP_MODE_SERVER && _upstreamCount > 0)
   {
-    rx = _udp->read(&_u_packetBuffer.byteBuffer[_packetBufferPtr], cbExpectedBytes);
+    if (vn - L_NTP_MIN_VER > L_NTP_MAX_VER - L_NTP_MIN_VER)
+      return L_NTP_UNSUPPORTED_VERSION;
 
-    _packetBufferPtr += rx;
-
-    if (rx >= cbExpectedBytes)
-      return L_NTP_R_SUCCESS;
+    return (cbPacket >= (int)sizeof(S_NTP_PACKET) ? L_NTP_R_SUCCESS : L_NTP_MISSING_DATA);
   }
-  else
-  {    
-    // Nothing left. Look for another packet.
-    if (_udp->parsePacket() > 0)
-    {
-      // We had another packet. Reset pointers and try again.
-      _packetBufferPtr = 0;
+#endif
 
-      if (_udp->available() >= cbExpectedBytes)
-      {
-        rx = _udp->read(&_u_packetBuffer.byteBuffer[_packetBufferPtr], cbExpectedBytes);
-    
-        _packetBufferPtr += rx;
-    
-        if (rx >= cbExpectedBytes)
-          return L_NTP_R_SUCCESS;
-      }
-    }
+#if L_NTP_CONTROL
+  if (mode == L_NTP_MODE_CONTROL)
+  {
+    if (vn - L_NTP_MIN_CTL_VER > L_NTP_MAX_VER - L_NTP_MIN_CTL_VER)
+      return L_NTP_UNSUPPORTED_VERSION;
+
+    return ((_u_packetBuffer.byteBuffer[1] & 0xE0) == 0 ? L_NTP_R_SUCCESS : L_NTP_BAD_REQUEST);
   }
-  
-  return L_NTP_R_ERROR;
+#endif
+
+  return L_NTP_NOT_IMPLEMENTED;
 }
 
-int NTPServer::_send(int cbPacketSize)
+t_ntpTimestamp NTPServer::_timestamp()
 {
-  if (_udp == NULL)
-    return L_NTP_R_ERROR;
-     
-  // Sends out the current packet buffer as a single packet
-  _udp->beginPacket(_udp->remoteIP(), _udp->remotePort());
-  _udp->write((const unsigned char *)_u_packetBuffer.byteBuffer, cbPacketSize);
-  
-  return (_udp->endPacket() == 1 ? L_NTP_R_SUCCESS : L_NTP_R_ERROR);
+  // Gets the current time
+  return _timestampAt(micros64());
 }
 
-int NTPServer::_close(int reason)
+t_ntpTimestamp NTPServer::_receiveTimestamp()
 {
-  if (_udp->available() > 0)
-  {
-    _recv(_udp->available());
-  }
-
-  _requestsFailed++;
+  // Without help from the transport, the best we can do is the time we noticed the datagram
+  return _timestamp();
 }
 
-/***** setter methods ******/
+t_ntpTimestamp NTPServer::_timestampAt(const S_NTP_REFERENCE *ref, t_ntpSysClock sysClock)
+{
+  // This is last reference time PLUS elpased microseconds since that sync, corrected
+  // for the measured rate of our clock. The system clock value may also be a little
+  // before the reference, when that was published by another thread in between.
 
-void NTPServer::setStratum(char stratum)
+  int64_t delta;
+  t_ntpTimestamp elapsed;
+
+  if (!ref->synchronizedSinceBoot)
+    return 0;
+
+  delta   = (int64_t)(sysClock - ref->micros);
+  elapsed = _microsToNtp(delta >= 0 ? delta : -delta);
+
+  // (delta * frequency) >> 20, in two parts: the full product overflows once
+  // delta passes 2^32 us (71 minutes without a reference)
+  return ref->timestamp + (delta >= 0 ? elapsed : 0 - elapsed)
+         + (delta >> 20) * ref->frequency + (((delta & 0xFFFFF) * ref->frequency) >> 20);
+}
+
+t_ntpTimestamp NTPServer::_timestampAt(t_ntpSysClock sysClock)
 {
-  _stratum = stratum;
+  // Gets the time at a given system clock value, as a 64-bit NTP timestamp (host order).
+  // On every request, so this takes only what it needs of the reference (as
+  // _readReference() does).
+
+  const NTPServer *c = _clock;
+  const S_NTP_REFERENCE *published;
+  S_NTP_REFERENCE ref;
+  uint32_t seq;
+
+  do
+  {
+    seq       = __atomic_load_n(&c->_publishSeq, __ATOMIC_ACQUIRE);
+    published = &c->_published[seq & 1];
+
+    ref.timestamp             = published->timestamp;
+    ref.micros                = published->micros;
+    ref.frequency             = published->frequency;
+    ref.synchronizedSinceBoot = published->synchronizedSinceBoot;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&c->_publishSeq, __ATOMIC_RELAXED) != seq);
+
+  return _timestampAt(&ref, sysClock);
 }
 
-void NTPServer::setMaxPollInterval(int pollIntervalSeconds)
+t_ntpTimestamp NTPServer::_microsToNtp(uint64_t micros)
 {
-  // NTP Poll Interval is defined as:
-  // Interval = 2 ^ x
-  //
-  // i.e. x=6, Interval=2^6=64 seconds
+  // Converts a duration into 32.32 fixed point seconds. The remainder is below
+  // 2^20, so shifting it up by 32 bits cannot overflow and the fraction is
+  // exact (rounded to the nearest 2^-32 s, about 0.23 ns).
+
+  uint64_t seconds = micros / 1000000;
+  uint64_t rem     = micros - seconds * 1000000;
 
-  _maxPollInterval = (char)(log((float)pollIntervalSeconds) / log(2.0f));
+  return (seconds << 32) + (((rem << 32) + 500000) / 1000000);
 }
 
-void NTPServer::setServerPrecision(double precisionInSeconds)
+t_ntpTimestamp NTPServer::_nanosToNtp(uint64_t nanos)
 {
-  // Server precision is specified in log2 seconds, signed byte
-  //
-  // i.e. x=-6, Interval=2^-6=0.015625 seconds
+  // Same as _microsToNtp(), for durations in nanoseconds (remainder is below 2^30)
 
-  _precision = (signed char)(log(precisionInSeconds) / log(2.0));
+  uint64_t seconds = nanos / 1000000000;
+  uint64_t rem     = nanos - seconds * 1000000000;
+
+  return (seconds << 32) + (((rem << 32) + 500000000) / 1000000000);
 }
 
-void NTPServer::setRootDelay(double delayInSeconds)
+unsigned long NTPServer::getElapsedTimeSinceSync()
 {
-  // Root delay is stored in a 64-bit fixed decimal point format
-  int delay = (int)delayInSeconds;
-  _rootDelay = htonl(delay);
+  return millis() - _lastTimeSyncMillis;
 }
 
-void NTPServer::setRootDispersion(double dispersionInSeconds)
+void NTPServer::_htonTimestamp(const t_ntpTimestamp ts, t_ntpTimestamp *dest)
 {
-  int disp = (int)dispersionInSeconds;
-  _rootDispersion = htonl(disp);
+  // Stores a 64-bit NTP timestamp in network byte order (mainly used to assemble packets)
+
+  unsigned char *ptr = (unsigned char *)dest;
+
+  ptr[0] = (ts >> 56) & 0xFF;
+  ptr[1] = (ts >> 48) & 0xFF;
+  ptr[2] = (ts >> 40) & 0xFF;
+  ptr[3] = (ts >> 32) & 0xFF;
+  ptr[4] = (ts >> 24) & 0xFF;
+  ptr[5] = (ts >> 16) & 0xFF;
+  ptr[6] = (ts >> 8) & 0xFF;
+  ptr[7] = ts & 0xFF;
 }
 
-/**
-  * setReferenceId
-  *
-  * Sets the NTP Reference ID. Parameter must be a 4-byte string.
-  */
-int NTPServer::setReferenceId(const char * referenceId)
+t_ntpTimestamp NTPServer::_ntohTimestamp(const t_ntpTimestamp *src)
 {
-  if (strlen(referenceId) <= sizeof _referenceId)
-  {
-    memset(_referenceId, 0, sizeof(_referenceId));
-    strcpy(_referenceId, referenceId);
-    
-    return L_NTP_R_SUCCESS;
-  }
+  // Reads a 64-bit NTP timestamp in network byte order (from a received packet)
 
-  return L_NTP_R_ERROR;
+  const unsigned char *ptr = (const unsigned char *)src;
+  t_ntpTimestamp ts = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    ts = (ts << 8) | ptr[i];
+
+  return ts;
 }
 
-void NTPServer::invalidateTimeSynch()
+void NTPServer::_ntohs(short *v)
 {
-  _clockIsSynchronized = 0;
+  // Swap bytes to network order
+  // TODO: Determine based on processor type if this needs to be done
+  char *cv = (char *)v;
+  char t;
+
+  t = cv[0];
+  cv[0] = cv[1];
+  cv[1] = t;
 }
 
-void NTPServer::setReferenceTime(struct tm refTime)
-{ 
-  setReferenceTime(refTime, micros64());
+void NTPServer::_handleRequest(const t_ntpTimestamp tsReceived, int cbPacket)
+{
+  // We've already validated the request. Everything but the timestamps comes
+  // straight out of the response template of the clock source (which is this
+  // instance, unless we are one of several workers sharing a clock).
+
+  const S_NTP_KEY *key = NULL;
+  S_NTP_INTERLEAVE_ENTRY *entry;
+  uint32_t keyId;
+  int cbReply = sizeof(S_NTP_PACKET);
+  int reason  = L_NTP_R_SUCCESS;
+
+#if L_NTP_NTS
+  if (cbPacket > (int)sizeof(S_NTP_PACKET) && _isNtsRequest(cbPacket))
+  {
+    _handleNtsRequest(tsReceived, cbPacket);
+    return;
+  }
+#endif
+
+  // Anything past the header should be a MAC (possibly after extension fields)
+#if L_NTP_AUTH
+  if (cbPacket > (int)sizeof(S_NTP_PACKET) || _clock->_authRequired)
+#else
+  if (cbPacket > (int)sizeof(S_NTP_PACKET))
+#endif
+  {
+    reason = _authenticate(cbPacket, &key);
+
+    if (reason != L_NTP_R_SUCCESS && reason != L_NTP_BAD_AUTH)
+    {
+      _close(reason);
+      return;
+    }
+  }
+
+  entry = _setTimestamps(tsReceived);
+
+  if (reason == L_NTP_BAD_AUTH)
+  {
+    // Crypto-NAK: a key ID of 0 and no digest tells the client its MAC failed
+    memset(&_u_packetBuffer.byteBuffer[cbReply], 0, sizeof(keyId));
+    cbReply += sizeof(keyId);
+  }
+#if L_NTP_AUTH
+  else if (key != NULL)
+  {
+    // Sign with the key the client used
+    keyId = htonl(key->keyId);
+    memcpy(&_u_packetBuffer.byteBuffer[cbReply], &keyId, sizeof(keyId));
+    _computeMac(key, _u_packetBuffer.byteBuffer, cbReply, (uint8_t *)&_u_packetBuffer.byteBuffer[cbReply + sizeof(keyId)]);
+    cbReply += sizeof(keyId) + key->cbDigest;
+  }
+#endif
+
+  _send(cbReply);
+
+  if (entry != NULL)
+    _transmitted(entry, tsReceived);
+
+  if (reason == L_NTP_BAD_AUTH)
+    _close(reason);
+  else
+    _served();
 }
 
-void NTPServer::setReferenceTime(struct tm refTime, t_ntpSysClock refTimeMicros)
+void NTPServer::_prepareResponse(t_ntpSysClock sysClock)
 {
-  _referenceTime = refTime;              // Time aquired from external source
-  _referenceTimeMicros = refTimeMicros;  // Timestamp at which this time was acquried (used to compute fractional seconds)
+  // Fills in everything up to the origin timestamp from the pre-serialized reply,
+  // all from one snapshot of the clock source's reference
 
-  _lastTimeSyncMillis = millis();        // Keeps track of how long it has been since the sync time was set
-  _clockIsSynchronized = 1;              // Clock is now synchronized
-  _clockSynchronizedSinceBoot = 1;
+  S_NTP_REFERENCE ref;
+
+  _clock->_readReference(&ref, true);
 
-  _referenceTimeAsSeconds = mktime(&refTime);
+  memcpy(&_u_packetBuffer.packet, ref.reply[_isSynchronizedAt(&ref, sysClock) ? 1 : 0], sizeof(ref.reply[0]));
+
+  // Our error estimate grows with the time since the last sync
+  _u_packetBuffer.packet.root_dispersion = htonl(_rootDispersionAt(&ref, sysClock));
 }
 
-int NTPServer::getCurrentTime(struct tm *outTime, t_ntpSysClock *outMilliseconds)
+S_NTP_INTERLEAVE_ENTRY *NTPServer::_setTimestamps(const t_ntpTimestamp tsReceived)
 {
-  int result = L_NTP_R_ERROR;
+  // Turns the request in the packet buffer into the header and timestamps of
+  // the reply. In basic mode the transmit timestamp is taken now, before the
+  // reply is sent. A client in interleaved mode instead sends back our receive
+  // timestamp of its last request as its origin timestamp; it then gets the
+  // transmit timestamp of our last reply, taken once that had gone out
+  // (draft-ietf-ntp-interleaved-modes). Returns the client's entry, to be
+  // updated by _transmitted() after the send, or NULL.
 
-  t_ntpSysClock deltaMicros;
-  *outTime = _referenceTime;
+  S_NTP_INTERLEAVE_ENTRY *entry = NULL;
 
-  if (_clockIsSynchronized)
+#if L_NTP_INTERLEAVE
+  t_ntpTimestamp lastReceived;
+  bool interleaved = false;
+
+  if (_interleaveTable != NULL)
   {
-    deltaMicros = micros64() - _referenceTimeMicros;
+    entry = _interleaveEntry();
 
-    while (deltaMicros > 1000000)
+    // A new entry has no transmit timestamp, and a client in basic mode never
+    // has the same receive and transmit timestamps
+    if (entry->tx != 0)
     {
-      deltaMicros -= 1000000;
-      outTime->tm_sec++;
+      _htonTimestamp(entry->rx, &lastReceived);
 
-      if (outTime->tm_sec > 250)
-      {
-        // Make sure that things don't overflow on long loss-of-synch timeframes
-        mktime(outTime);
-      }
+      interleaved = (_u_packetBuffer.packet.ts_origin == lastReceived &&
+                     _u_packetBuffer.packet.ts_received != _u_packetBuffer.packet.ts_transmit);
     }
+  }
+
+  if (interleaved)
+  {
+    // Origin = the client's receive time of our last reply, so it can pair them up
+    _u_packetBuffer.packet.ts_origin = _u_packetBuffer.packet.ts_received;
 
-    // One last call to adjust
-    mktime(outTime);
-    *outMilliseconds = deltaMicros/1000;
-    result = L_NTP_R_SUCCESS;
+    _prepareResponse(micros64());
+
+    _htonTimestamp(tsReceived, &_u_packetBuffer.packet.ts_received);
+    _htonTimestamp(entry->tx,  &_u_packetBuffer.packet.ts_transmit);
+
+    _interleavedReplies++;
   }
   else
+#endif
   {
-    deltaMicros = 0;
-    result = L_NTP_R_NOT_SYNCHED;
+    // Mirror transmit time back to sender
+    _u_packetBuffer.packet.ts_origin = _u_packetBuffer.packet.ts_transmit;
+
+    _prepareResponse(micros64());
+
+    _htonTimestamp(tsReceived,   &_u_packetBuffer.packet.ts_received);
+    _htonTimestamp(_timestamp(), &_u_packetBuffer.packet.ts_transmit);
   }
 
-  return result;
+  return entry;
 }
 
-bool NTPServer::isClockSynchronized()
+void NTPServer::_transmitted(S_NTP_INTERLEAVE_ENTRY *entry, const t_ntpTimestamp tsReceived)
 {
-  return (_clockIsSynchronized != 0);
+  // Kept for the client's next request. Off the reply path: the reply has gone.
+  entry->rx = tsReceived;
+  entry->tx = _transmitTimestamp(entry);
 }
 
-unsigned short NTPServer::getSuccessfulRequests(bool resetCounter)
+void NTPServer::_publishReference()
 {
-  static unsigned short req;
+  // Publishes what the request path needs: the reference, the state of the
+  // clock discipline, and everything in a reply up to the origin timestamp
+  // that does not change from request to request. Needs to be called whenever
+  // the configuration or the reference time changes.
+  //
+  // There are two copies. Readers take the one the low bit of _publishSeq
+  // points at while the other one is written, then check that the sequence
+  // has not moved on (a seqlock "latch", as in the Linux timekeeping code). So
+  // a reader never sees a half-written copy, and never waits for a writer,
+  // not even one that was interrupted or preempted halfway.
+
+  S_NTP_REFERENCE ref;
+  S_NTP_PACKET    t;
+  uint32_t        seq = _publishSeq;
+  int i;
+
+  memset(&ref, 0, sizeof(ref));
+
+  ref.timestamp             = _referenceTimestamp;
+  ref.micros                = _referenceTimeMicros;
+  ref.holdoverMicros        = _maxTimeBetweenUpdates;
+  ref.frequency             = _frequency;
+  ref.dispersionRate        = _dispersionRate;
+  ref.dispersionAtSync      = _dispersionAtSync;
+  ref.synchronized          = _clockIsSynchronized;
+  ref.synchronizedSinceBoot = _clockSynchronizedSinceBoot;
+
+  for (i = 0; i < 2; i++)
+  {
+    memset(&t, 0, sizeof(t));
 
-  req = _requestsSucceeded;
+    // Note that at this time, we don't have any notion of leap second so we can't
+    // report anything. If someone knows how to get this out of a GPS, please
+    // implement it here
+    t.header.li        = (i == 1 ? L_NTP_LI_NONE : L_NTP_LI_UNSYNCH);
+    t.header.vn        = L_NTP_VERSION;
+    t.header.mode      = L_NTP_MODE_SERVER;
+
+    t.stratum          = (_clockSynchronizedSinceBoot ? _stratum : L_NTP_STRAT_UNSYNCHRONIZED);
+    t.poll             = _maxPollInterval;
+    t.precision        = _precision;
+
+    t.root_delay       = _rootDelay;
+    t.root_dispersion  = htonl(_dispersionAtSync);
+
+    memcpy(t.reference_id, _referenceId, sizeof(_referenceId));
+
+    // Reference timestamp is the moment of the last sync
+    if (_clockSynchronizedSinceBoot)
+      _htonTimestamp(_referenceTimestamp, &t.ts_reference);
+
+    memcpy(ref.reply[i], &t, sizeof(ref.reply[i]));
+  }
+
+  // Readers move over to the copy not about to be written, for each in turn
+  for (i = 0; i < 2; i++)
+  {
+    __atomic_store_n(&_publishSeq, ++seq, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(&_published[(seq + 1) & 1], &ref, sizeof(ref));
+  }
+}
+
+void NTPServer::_readReference(S_NTP_REFERENCE *ref, bool withReply) const
+{
+  // Copies a consistent snapshot (the reply headers only if asked for). Only
+  // retries if a publish completed in the meantime, and then gets the other,
+  // settled copy.
+
+  uint32_t seq;
+
+  do
+  {
+    seq = __atomic_load_n(&_publishSeq, __ATOMIC_ACQUIRE);
+
+    // Sizes known at compile time, so that the copies are inlined
+    if (withReply)
+      memcpy(ref, &_published[seq & 1], sizeof(*ref));
+    else
+      memcpy(ref, &_published[seq & 1], offsetof(S_NTP_REFERENCE, reply));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&_publishSeq, __ATOMIC_RELAXED) != seq);
+}
+
+/***** Control Requests ******/
+
+#if L_NTP_CONTROL
+
+// Built-in system variables, named as ntpd names them. The statistics ("ss_")
+// are only returned when asked for by name, like ntpd's sysstats.
+static const char *const s_systemVariables[] =
+{
+  "version", "leap", "stratum", "precision", "rootdelay", "rootdisp",
+  "refid", "reftime", "clock", "offset", "frequency", "sys_jitter",
+
+  // One per outcome, in L_NTP_STAT_ order
+  "ss_processed", "ss_badversion", "ss_missing", "ss_toolong", "ss_badrequest",
+  "ss_unsupported", "ss_badvariable", "ss_denied", "ss_limited", "ss_badauth",
+
+  "ss_proc_hist", "ss_update_hist"
+};
+
+#define L_NTP_SYSTEM_VARIABLES  (int)(sizeof(s_systemVariables) / sizeof(s_systemVariables[0]))
+#define L_NTP_LISTED_VARIABLES  12
+#define L_NTP_FIRST_STAT_VARIABLE  12
+
+void NTPServer::_handleControlRequest()
+{
+  // The request has been validated, its fields are in host order and its
+  // payload is terminated. Replies are assembled in the packet buffer.
+
+  S_NTP_CONTROL_PACKET *ctl = &_u_packetBuffer.controlPacket;
+  char *request = &_u_packetBuffer.byteBuffer[sizeof(S_NTP_CONTROL_PACKET)];
+
+  // Sequence and association go back to the client as they came in
+  _ntohs(&ctl->sequence);
+  _ntohs(&ctl->association_id);
+
+  _controlOffset = 0;
+  _controlCount  = 0;
+
+  if (ctl->association_id != 0)
+  {
+    // We have no peers, only system variables
+    _sendControlError(L_NTP_CERR_BADASSOC);
+    _close(L_NTP_BAD_REQUEST);
+  }
+  else if (ctl->opcode == L_NTP_CTL_READSTAT)
+  {
+    // System status, followed by an (empty) list of associations
+    _sendControlFragment(false);
+    _served();
+  }
+  else if (ctl->opcode == L_NTP_CTL_READVAR)
+  {
+    _readVariables(request);
+  }
+  else if (ctl->opcode == L_NTP_CTL_WRITEVAR)
+  {
+    _writeVariables(request);
+  }
+  else
+  {
+    _sendControlError(L_NTP_CERR_BADOP);
+    _close(L_NTP_NOT_IMPLEMENTED);
+  }
+}
+
+int NTPServer::_authenticateControl(int cbPacket)
+{
+  // Finds the key ID and MAC that ntpq appends to a control request, after the
+  // data padded to a multiple of 8 bytes, and checks the MAC over everything
+  // before it. Returns L_NTP_R_SUCCESS, L_NTP_NOT_PERMITTED if there is no
+  // MAC, or L_NTP_BAD_AUTH.
+
+  const unsigned char *p = (const unsigned char *)_u_packetBuffer.byteBuffer;
+  uint32_t keyId;
+  int offset = ((int)sizeof(S_NTP_CONTROL_PACKET) + ((p[10] << 8) | p[11]) + 7) & ~7;
+
+  if (cbPacket > _packetLength)
+    cbPacket = _packetLength;
+
+  if (cbPacket - offset < (int)sizeof(keyId) + 1)
+    return L_NTP_NOT_PERMITTED;
+
+#if L_NTP_AUTH
+  const S_NTP_KEY *key;
+  uint8_t mac[L_NTP_MAX_MAC];
+
+  keyId = ((uint32_t)p[offset] << 24) | ((uint32_t)p[offset + 1] << 16) | (p[offset + 2] << 8) | p[offset + 3];
+  key   = _clock->_findKey(keyId);
+
+  if (key == NULL || cbPacket - offset - (int)sizeof(keyId) != key->cbDigest)
+    return L_NTP_BAD_AUTH;
+
+  _computeMac(key, p, offset, mac);
+
+  return (ntpMacEqual(mac, &p[offset + sizeof(keyId)], key->cbDigest) ? L_NTP_R_SUCCESS : L_NTP_BAD_AUTH);
+#else
+  return L_NTP_BAD_AUTH;   // No keys to check it with
+#endif
+}
+
+void NTPServer::_readVariables(char *request)
+{
+  // Answers a comma separated list of names with "name=value" pairs, split
+  // over as many fragments as it takes. An empty list reads every variable
+  // that we can enumerate (the onReadVariable callback cannot be). The pairs
+  // are written over the request, so the names are read from a copy.
+
+  char  value[L_NTP_CTL_MAX_VALUE];
+  char *cursor = _controlNames;
+  char *name, *ignored;
+  const S_NTP_CONTROL_VARIABLE *var;
+  int   i, j;
+
+  memcpy(_controlNames, request, _u_packetBuffer.controlPacket.count + 1);
+
+  name = _nextControlItem(&cursor, &ignored);
+
+  if (name == NULL)
+  {
+    for (i = 0; i < L_NTP_LISTED_VARIABLES; i++)
+    {
+      // Skip built-ins that have been replaced through addVariable()
+      for (j = 0; j < _clock->_variableCount; j++)
+      {
+        if (!strcasecmp(_clock->_variables[j].name, s_systemVariables[i]))
+          break;
+      }
+
+      if (j == _clock->_variableCount && _readSystemVariable(i, value, sizeof(value)) == L_NTP_R_SUCCESS)
+        _appendControlData(s_systemVariables[i], value);
+    }
+
+    for (j = 0; j < _clock->_variableCount; j++)
+    {
+      var = &_clock->_variables[j];
+
+      if (_readVariable(var->name, value, sizeof(value)) == L_NTP_R_SUCCESS)
+        _appendControlData(var->name, value);
+    }
+  }
+  else
+  {
+    do
+    {
+      if (_readVariable(name, value, sizeof(value)) != L_NTP_R_SUCCESS)
+      {
+        _sendControlError(L_NTP_CERR_UNKNOWNVAR);
+        _close(L_NTP_BAD_VARIABLENAME);
+        return;
+      }
+
+      _appendControlData(name, value);
+    }
+    while ((name = _nextControlItem(&cursor, &ignored)) != NULL);
+  }
+
+  _sendControlFragment(false);
+  _served();
+}
+
+void NTPServer::_writeVariables(char *request)
+{
+  // Applies a comma separated list of "name=value" pairs. Only a request with
+  // a valid MAC (from a key added with addKey()) may write, and only variables
+  // added with a setter can be written. Every pair is checked before the first
+  // one is applied; a setter that turns its value down stops the rest. The
+  // request is parsed in place: nothing is written to the reply before that.
+
+  const S_NTP_CONTROL_VARIABLE *vars[L_NTP_MAX_VARIABLES];
+  char *values[L_NTP_MAX_VARIABLES];
+  char *cursor = request;
+  char *name, *value;
+  int   count = 0, i, error = -1;
+
+  if (_controlAuth != L_NTP_R_SUCCESS)
+  {
+    _sendControlError(L_NTP_CERR_PERMISSION);
+    _close(_controlAuth);
+    return;
+  }
+
+  while (error < 0 && (name = _nextControlItem(&cursor, &value)) != NULL)
+  {
+    error = L_NTP_CERR_UNKNOWNVAR;
+
+    for (i = 0; i < _clock->_variableCount; i++)
+    {
+      if (!strcasecmp(_clock->_variables[i].name, name))
+      {
+        if (_clock->_variables[i].setter == NULL)
+          error = L_NTP_CERR_PERMISSION;
+        else if (value == NULL || count >= L_NTP_MAX_VARIABLES)
+          error = L_NTP_CERR_BADFMT;
+        else
+          error = -1;
+
+        break;
+      }
+    }
+
+    if (error == L_NTP_CERR_UNKNOWNVAR)
+    {
+      for (i = 0; i < L_NTP_SYSTEM_VARIABLES; i++)
+      {
+        if (!strcasecmp(s_systemVariables[i], name))
+          error = L_NTP_CERR_PERMISSION;
+      }
+    }
+
+    if (error < 0)
+    {
+      vars[count]     = &_clock->_variables[i];
+      values[count++] = value;
+    }
+  }
+
+  for (i = 0; error < 0 && i < count; i++)
+  {
+    if (vars[i]->setter(values[i]) != L_NTP_R_SUCCESS)
+      error = L_NTP_CERR_BADVALUE;
+  }
+
+  if (error >= 0)
+  {
+    _sendControlError(error);
+    _close(error == L_NTP_CERR_UNKNOWNVAR ? L_NTP_BAD_VARIABLENAME :
+           error == L_NTP_CERR_PERMISSION ? L_NTP_NOT_PERMITTED : L_NTP_BAD_REQUEST);
+    return;
+  }
+
+  _sendControlFragment(false);
+  _served();
+}
+
+int NTPServer::_readVariable(const char *name, char *lpBuffer, int cbBuffer)
+{
+  // Looks a variable up in the registry, then among the built-ins, and finally
+  // asks the onReadVariable callback
+
+  int i, result = L_NTP_R_ERROR;
+
+  lpBuffer[0] = 0;
+
+  for (i = 0; i < _clock->_variableCount; i++)
+  {
+    const S_NTP_CONTROL_VARIABLE *var = &_clock->_variables[i];
+
+    if (!strcasecmp(var->name, name))
+    {
+      if (var->value != NULL)
+      {
+        strncpy(lpBuffer, var->value, cbBuffer - 1);
+        lpBuffer[cbBuffer - 1] = 0;
+        return L_NTP_R_SUCCESS;
+      }
+
+      result = var->getter(lpBuffer, cbBuffer);
+      lpBuffer[cbBuffer - 1] = 0;   // Protect against a misbehaving getter
+      return result;
+    }
+  }
+
+  for (i = 0; i < L_NTP_SYSTEM_VARIABLES; i++)
+  {
+    if (!strcasecmp(s_systemVariables[i], name))
+      return _readSystemVariable(i, lpBuffer, cbBuffer);
+  }
+
+  if (_clock->onReadVariableCallback != NULL)
+  {
+    result = _clock->onReadVariableCallback(name, lpBuffer, cbBuffer);
+    lpBuffer[cbBuffer - 1] = 0;
+  }
+
+  return result;
+}
+
+int NTPServer::_readSystemVariable(int index, char *lpBuffer, int cbBuffer)
+{
+  // Formats a built-in variable the way ntpd reports it (times in ms)
+
+  const NTPServer *c = _clock;
+  S_NTP_REFERENCE ref;
+  t_ntpTimestamp ts;
+  uint32_t histogram[L_NTP_HIST_BUCKETS];
+
+  if (index >= L_NTP_FIRST_STAT_VARIABLE && index < L_NTP_FIRST_STAT_VARIABLE + L_NTP_STAT_OUTCOMES)
+  {
+    // Served and rejected requests (summed over all workers of a pool)
+    snprintf(lpBuffer, cbBuffer, "%llu", (unsigned long long)c->getRequestCount(index == L_NTP_FIRST_STAT_VARIABLE ? L_NTP_STAT_SERVED :
+                                         L_NTP_UNSUPPORTED_VERSION + index - L_NTP_FIRST_STAT_VARIABLE - 1));
+    return L_NTP_R_SUCCESS;
+  }
+
+  switch (index)
+  {
+    case 0:   // version
+      snprintf(lpBuffer, cbBuffer, "\"%s\"", L_NTP_LIBRARY_VERSION);
+      break;
+
+    case 1:   // leap
+      snprintf(lpBuffer, cbBuffer, "%d", c->_isSynchronizedAt(micros64()) ? L_NTP_LI_NONE : L_NTP_LI_UNSYNCH);
+      break;
+
+    case 2:   // stratum
+      snprintf(lpBuffer, cbBuffer, "%d", c->_clockSynchronizedSinceBoot ? c->_stratum : L_NTP_STRAT_UNSYNCHRONIZED);
+      break;
+
+    case 3:   // precision
+      snprintf(lpBuffer, cbBuffer, "%d", c->_precision);
+      break;
+
+    case 4:   // rootdelay
+      snprintf(lpBuffer, cbBuffer, "%.3f", (int32_t)ntohl(c->_rootDelay) / 65.536);
+      break;
+
+    case 5:   // rootdisp
+      snprintf(lpBuffer, cbBuffer, "%.3f", c->_rootDispersionAt(micros64()) / 65.536);
+      break;
+
+    case 6:   // refid
+      snprintf(lpBuffer, cbBuffer, "\"%.4s\"", c->_referenceId);
+      break;
+
+    case 7:   // reftime
+      c->_readReference(&ref, false);
+      ts = ref.timestamp;
+      snprintf(lpBuffer, cbBuffer, "0x%08lx.%08lx", (unsigned long)(ts >> 32), (unsigned long)(ts & 0xFFFFFFFF));
+      break;
+
+    case 8:   // clock
+      ts = _timestamp();
+      snprintf(lpBuffer, cbBuffer, "0x%08lx.%08lx", (unsigned long)(ts >> 32), (unsigned long)(ts & 0xFFFFFFFF));
+      break;
+
+    case 9:   // offset
+      snprintf(lpBuffer, cbBuffer, "%.6f", c->_lastOffset * 1000.0);
+      break;
+
+    case 10:  // frequency
+      c->_readReference(&ref, false);
+      snprintf(lpBuffer, cbBuffer, "%.3f", ref.frequency / L_NTP_FREQ_SCALE * 1e6);
+      break;
+
+    case 11:  // sys_jitter
+      snprintf(lpBuffer, cbBuffer, "%.6f", c->_jitter * 1000.0);
+      break;
+
+    case L_NTP_FIRST_STAT_VARIABLE + L_NTP_STAT_OUTCOMES:       // ss_proc_hist
+      c->getProcessingHistogram(histogram);
+      _formatHistogram(histogram, lpBuffer, cbBuffer);
+      break;
+
+    case L_NTP_FIRST_STAT_VARIABLE + L_NTP_STAT_OUTCOMES + 1:   // ss_update_hist
+      c->getUpdateIntervalHistogram(histogram);
+      _formatHistogram(histogram, lpBuffer, cbBuffer);
+      break;
+
+    default:
+      return L_NTP_R_ERROR;
+  }
+
+  return L_NTP_R_SUCCESS;
+}
+
+void NTPServer::_appendControlData(const char *name, const char *value)
+{
+  // Adds "name=value" to the response, sending the current fragment first if
+  // the pair does not fit in it anymore. Oversized values are cut short.
+
+  char *data     = &_u_packetBuffer.byteBuffer[sizeof(S_NTP_CONTROL_PACKET)];
+  int   cbName   = strlen(name);
+  int   cbValue  = strlen(value);
+  int   cbSep;
+
+  if (_controlCount > 0 && _controlCount + 2 + cbName + 1 + cbValue > L_NTP_CTL_MAX_DATA)
+    _sendControlFragment(true);
+
+  // Clients concatenate the fragments, so the separator may start a fragment,
+  // and then counts against the room for the pair
+  cbSep = (_controlOffset + _controlCount > 0 ? 2 : 0);
+
+  if (cbName > L_NTP_CTL_MAX_DATA - cbSep - 1)
+    cbName = L_NTP_CTL_MAX_DATA - cbSep - 1;
+
+  if (_controlCount + cbSep + cbName + 1 + cbValue > L_NTP_CTL_MAX_DATA)
+    cbValue = L_NTP_CTL_MAX_DATA - _controlCount - cbSep - cbName - 1;
+
+  if (cbSep > 0)
+  {
+    data[_controlCount++] = ',';
+    data[_controlCount++] = ' ';
+  }
+
+  memcpy(&data[_controlCount], name, cbName);
+  _controlCount += cbName;
+  data[_controlCount++] = '=';
+  memcpy(&data[_controlCount], value, cbValue);
+  _controlCount += cbValue;
+}
+
+void NTPServer::_sendControlFragment(bool more)
+{
+  // Sends the response data gathered so far, padded to a 32-bit boundary
+
+  S_NTP_CONTROL_PACKET *ctl = &_u_packetBuffer.controlPacket;
+  int cbData = _controlCount;
+
+  while (cbData & 3)
+    _u_packetBuffer.byteBuffer[sizeof(S_NTP_CONTROL_PACKET) + cbData++] = 0;
+
+  ctl->response = 1;
+  ctl->error    = 0;
+  ctl->more     = (more ? 1 : 0);
+  ctl->status   = _systemStatus();
+  ctl->offset   = _controlOffset;
+  ctl->count    = _controlCount;
+
+  _ntohs(&ctl->status);
+  _ntohs(&ctl->offset);
+  _ntohs(&ctl->count);
+
+  _send(sizeof(S_NTP_CONTROL_PACKET) + cbData);
+
+  _controlOffset += _controlCount;
+  _controlCount   = 0;
+}
+
+void NTPServer::_sendControlError(int errorCode)
+{
+  S_NTP_CONTROL_PACKET *ctl = &_u_packetBuffer.controlPacket;
+
+  ctl->response = 1;
+  ctl->error    = 1;
+  ctl->more     = 0;
+  ctl->status   = (short)(errorCode << 8);
+  ctl->offset   = 0;
+  ctl->count    = 0;
+
+  _ntohs(&ctl->status);
+
+  _send(sizeof(S_NTP_CONTROL_PACKET));
+}
+
+unsigned short NTPServer::_systemStatus()
+{
+  // System status word: leap indicator, clock source, event count and code
+  // (no events are kept). A stratum 1 source is taken to be a GPS receiver.
+
+  int leap   = (_clock->_isSynchronizedAt(micros64()) ? L_NTP_LI_NONE : L_NTP_LI_UNSYNCH);
+  int source = 0;
+
+  if (leap == L_NTP_LI_NONE)
+    source = (_clock->_stratum <= L_NTP_STRAT_PRIMARY ? 4 /* UHF radio */ : 6 /* NTP */);
+
+  return (unsigned short)((leap << 14) | (source << 8));
+}
+
+char *NTPServer::_nextControlItem(char **cursor, char **value)
+{
+  // Splits the next item off a "name[=value], ..." list, in place. Values may
+  // be quoted. Returns NULL at the end of the list.
+
+  char *p = *cursor;
+  char *name, *nameEnd, *valueEnd;
+  bool  quoted;
+
+  *value = NULL;
+
+  while (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    p++;
+
+  if (*p == 0)
+    return NULL;
+
+  name = p;
+
+  while (*p != 0 && *p != ',' && *p != '=')
+    p++;
+
+  nameEnd = p;
+
+  if (*p == '=')
+  {
+    p++;
+
+    while (*p == ' ' || *p == '\t')
+      p++;
+
+    quoted = (*p == '"');
+
+    if (quoted)
+      p++;
+
+    *value = p;
+
+    while (*p != 0 && *p != (quoted ? '"' : ','))
+      p++;
+
+    valueEnd = p;
+
+    while (*p != 0 && *p != ',')
+      p++;
+
+    while (valueEnd > *value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t' || valueEnd[-1] == '\r' || valueEnd[-1] == '\n'))
+      valueEnd--;
+  }
+  else
+  {
+    valueEnd = NULL;
+  }
+
+  // p is on the separator (or the end of the list)
+  if (*p != 0)
+    *p++ = 0;
+
+  if (valueEnd != NULL)
+    *valueEnd = 0;
+
+  while (nameEnd > name && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t' || nameEnd[-1] == '\r' || nameEnd[-1] == '\n'))
+    nameEnd--;
+
+  *nameEnd = 0;
+  *cursor = p;
+
+  return name;
+}
+
+/**
+  * addVariable
+  *
+  * Adds a variable that control (mode 6) clients such as ntpq can read. Either
+  * a fixed value, or a getter that fills in the current value when asked for.
+  * Variables with a setter can also be written, but only by a request with a
+  * valid MAC from a key added with addKey(); every pair of a write is checked
+  * before any setter is called.
+  * Adding a variable with the name of a built-in replaces the built-in.
+  */
+int NTPServer::addVariable(const char *name, const char *value)
+{
+  if (_variableCount >= L_NTP_MAX_VARIABLES || name == NULL || value == NULL)
+    return L_NTP_R_ERROR;
+
+  _variables[_variableCount].name   = name;
+  _variables[_variableCount].value  = value;
+  _variables[_variableCount].getter = NULL;
+  _variables[_variableCount].setter = NULL;
+  _variableCount++;
+
+  return L_NTP_R_SUCCESS;
+}
+
+int NTPServer::addVariable(const char *name, int (*getter)(char *lpBuffer, int cbBuffer), int (*setter)(const char *value))
+{
+  if (_variableCount >= L_NTP_MAX_VARIABLES || name == NULL || getter == NULL)
+    return L_NTP_R_ERROR;
+
+  _variables[_variableCount].name   = name;
+  _variables[_variableCount].value  = NULL;
+  _variables[_variableCount].getter = getter;
+  _variables[_variableCount].setter = setter;
+  _variableCount++;
+
+  return L_NTP_R_SUCCESS;
+}
+
+#else
+
+int NTPServer::addVariable(const char * /* name */, const char * /* value */)
+{
+  // Compiled without control requests: nobody could read it
+  return L_NTP_R_ERROR;
+}
+
+int NTPServer::addVariable(const char * /* name */, int (* /* getter */)(char *lpBuffer, int cbBuffer), int (* /* setter */)(const char *value))
+{
+  return L_NTP_R_ERROR;
+}
+
+#endif
+
+/***** System Calls ******/
+
+int NTPServer::_recv()
+{
+  // Pulls the next datagram into the packet buffer with a single read.
+  // Returns the size of the datagram as it was on the wire, which may be larger
+  // than what was read. Returns 0 if nothing is pending.
+
+  int cbPacket;
+
+  if (_udp == NULL)
+    return 0;
+
+  cbPacket = _udp->L_NTP_TRANSPORT_CALL(parsePacket)();
+
+  if (cbPacket <= 0)
+  {
+    _packetLength = 0;
+    return 0;
+  }
+
+  // Datagrams of a size that no request can have are not even read, the
+  // transport discards them with the next parsePacket()
+  if (cbPacket < (int)sizeof(S_NTP_CONTROL_PACKET) || cbPacket > L_NTP_MAX_RX_BUFF)
+  {
+    _packetLength = 0;
+    return cbPacket;
+  }
+
+  _packetLength = _udp->L_NTP_TRANSPORT_CALL(read)(_u_packetBuffer.byteBuffer, L_NTP_MAX_RX_BUFF);
+
+  return cbPacket;
+}
+
+int NTPServer::_send(int cbPacketSize)
+{
+  if (_udp == NULL)
+    return L_NTP_R_ERROR;
+
+  // Replies go back to the sender of the current datagram
+  return _sendTo(_udp->L_NTP_TRANSPORT_CALL(remoteIP)(), _udp->L_NTP_TRANSPORT_CALL(remotePort)(), cbPacketSize);
+}
+
+int NTPServer::_sendTo(IPAddress ip, uint16_t port, int cbPacketSize)
+{
+  if (_udp == NULL)
+    return L_NTP_R_ERROR;
+     
+  // Sends out the current packet buffer as a single packet
+  _udp->L_NTP_TRANSPORT_CALL(beginPacket)(ip, port);
+  _udp->L_NTP_TRANSPORT_CALL(write)((const unsigned char *)_u_packetBuffer.byteBuffer, cbPacketSize);
+  
+  return (_udp->L_NTP_TRANSPORT_CALL(endPacket)() == 1 ? L_NTP_R_SUCCESS : L_NTP_R_ERROR);
+}
+
+int NTPServer::_close(int reason)
+{
+  // Whatever was not read of the datagram is discarded by the next parsePacket()
+  _requestsFailed++;
+
+#if L_NTP_STATISTICS
+  if (reason >= L_NTP_UNSUPPORTED_VERSION && reason <= L_NTP_LAST_REASON)
+    _requestCounts[reason - L_NTP_UNSUPPORTED_VERSION + 1]++;
+#endif
+
+  return reason;
+}
+
+void NTPServer::_served()
+{
+  _requestsSucceeded++;
+#if L_NTP_STATISTICS
+  _requestCounts[L_NTP_STAT_SERVED]++;
+#endif
+}
+
+#if L_NTP_STATISTICS
+void NTPServer::_record(uint32_t *histogram, uint64_t nanos)
+{
+  // Counts a duration in its log2 bucket (one count-leading-zeros instruction)
+
+  int bucket = 63 - __builtin_clzll(nanos | 1);
+
+  histogram[bucket < L_NTP_HIST_BUCKETS ? bucket : L_NTP_HIST_BUCKETS - 1]++;
+}
+#endif
+
+#if L_NTP_CONTROL
+void NTPServer::_formatHistogram(const uint32_t *histogram, char *lpBuffer, int cbBuffer)
+{
+  // Quoted list of "bucket:count" pairs, skipping empty buckets
+
+  int i, n;
+
+  n = snprintf(lpBuffer, cbBuffer, "\"");
+
+  for (i = 0; i < L_NTP_HIST_BUCKETS && n < cbBuffer - 1; i++)
+  {
+    if (histogram[i] != 0)
+      n += snprintf(&lpBuffer[n], cbBuffer - n, (n > 1 ? " %d:%lu" : "%d:%lu"), i, (unsigned long)histogram[i]);
+  }
+
+  if (n < cbBuffer - 1)
+    snprintf(&lpBuffer[n], cbBuffer - n, "\"");
+}
+#endif
+
+/***** Traffic Throttling ******/
+
+#if L_NTP_THROTTLING
+
+/**
+  * enableThrottling
+  *
+  * Limits each client to an average of one request per minIntervalMillis,
+  * with bursts of up to `burst` requests. Clients are tracked in a fixed-size
+  * table of at least tableEntries entries; when it fills up, the least recently
+  * seen client of a bucket is forgotten. Requests over the limit are dropped,
+  * or answered with a "RATE" Kiss-o'-Death packet if kissOfDeath is set.
+  */
+int NTPServer::enableThrottling(int tableEntries, unsigned long minIntervalMillis, int burst, bool kissOfDeath)
+{
+  unsigned short buckets = 1;
+
+  disableThrottling();
+
+  while (buckets * L_NTP_THROTTLE_WAYS < tableEntries && buckets < 0x8000)
+    buckets <<= 1;
+
+  _clientTable = new (std::nothrow) S_NTP_CLIENT_ENTRY[buckets * L_NTP_THROTTLE_WAYS];
+
+  if (_clientTable == NULL)
+    return L_NTP_R_ERROR;
+
+  memset(_clientTable, 0, sizeof(S_NTP_CLIENT_ENTRY) * buckets * L_NTP_THROTTLE_WAYS);
+
+  _clientTableBuckets     = buckets;
+  _throttleIntervalMillis = minIntervalMillis;
+  _throttleBurst          = (burst > 0 ? burst : 1);
+  _throttleKissOfDeath    = kissOfDeath;
+
+  return L_NTP_R_SUCCESS;
+}
+
+void NTPServer::disableThrottling()
+{
+  if (_clientTable != NULL)
+  {
+    delete[] _clientTable;
+    _clientTable = NULL;
+  }
+
+  _clientTableBuckets = 0;
+}
+
+#else
+
+int NTPServer::enableThrottling(int /* tableEntries */, unsigned long /* minIntervalMillis */, int /* burst */, bool /* kissOfDeath */)
+{
+  // Compiled without throttling
+  return L_NTP_R_ERROR;
+}
+
+void NTPServer::disableThrottling()
+{
+}
+
+#endif
+
+uint32_t NTPServer::_clientKey(IPAddress ip)
+{
+  // Hashes the client address down to a non-zero 32-bit key
+
+  uint32_t key = (uint32_t)ip;
+
+#ifndef ARDUINO
+  if (ip.isV6())
+  {
+    const uint8_t *raw = ip.raw_address();
+    int i;
+
+    for (i = 0; i < 16; i += 4)
+      key = (key * 0x9E3779B1) ^ ((uint32_t)raw[i] << 24 | (uint32_t)raw[i + 1] << 16 | (uint32_t)raw[i + 2] << 8 | raw[i + 3]);
+  }
+#endif
+
+  key *= 0x9E3779B1;   // Spread the address bits over the bucket index
+
+  return (key != 0 ? key : 1);
+}
+
+template <typename T>
+static T *findClient(T *bucket, int ways, uint32_t key, uint32_t now, bool *found)
+{
+  // Looks up a client in its bucket (a handful of adjacent entries). A client
+  // that is not there gets an unused entry if there is one, otherwise the
+  // entry of the least recently seen client.
+
+  T *victim = &bucket[0];
+  int i;
+
+  for (i = 0; i < ways; i++)
+  {
+    if (bucket[i].key == key)
+    {
+      *found = true;
+      return &bucket[i];
+    }
+
+    if (victim->key != 0 &&
+        (bucket[i].key == 0 || now - bucket[i].lastMillis > now - victim->lastMillis))
+    {
+      victim = &bucket[i];
+    }
+  }
+
+  *found = false;
+  return victim;
+}
+
+#if L_NTP_THROTTLING
+bool NTPServer::_admitClient()
+{
+  // Charges the sender's token bucket and reports whether the request may be
+  // serviced.
+
+  uint32_t key = _clientKey(_udp->L_NTP_TRANSPORT_CALL(remoteIP)());
+  uint32_t now = millis();
+  uint32_t capacity = _throttleIntervalMillis * _throttleBurst;
+  uint32_t elapsed;
+  S_NTP_CLIENT_ENTRY *entry;
+  bool found;
+
+  entry = findClient(&_clientTable[((key >> 16) & (_clientTableBuckets - 1)) * L_NTP_THROTTLE_WAYS],
+                     L_NTP_THROTTLE_WAYS, key, now, &found);
+
+  if (!found)
+  {
+    // New client, starts out with a full bucket
+    entry->key    = key;
+    entry->credit = capacity;
+  }
+  else
+  {
+    elapsed = now - entry->lastMillis;
+
+    if (elapsed >= capacity - entry->credit)
+      entry->credit = capacity;
+    else
+      entry->credit += elapsed;
+  }
+
+  entry->lastMillis = now;
+
+  if (entry->credit < _throttleIntervalMillis)
+    return false;
+
+  entry->credit -= _throttleIntervalMillis;
+
+  return true;
+}
+#endif
+
+void NTPServer::_sendKissOfDeath(const char *code, int cbPacket)
+{
+  // Turns the request around in place: no timestamps are taken, the client's
+  // transmit timestamp is simply echoed back.
+
+  _u_packetBuffer.packet.ts_origin    = _u_packetBuffer.packet.ts_transmit;
+  _u_packetBuffer.packet.ts_received  = _u_packetBuffer.packet.ts_transmit;
+  _u_packetBuffer.packet.ts_reference = 0;
+
+  _u_packetBuffer.header.li               = L_NTP_LI_UNSYNCH;
+  _u_packetBuffer.header.mode             = L_NTP_MODE_SERVER;
+  _u_packetBuffer.packet.stratum          = L_NTP_STRAT_UNSPECIFIED;
+  _u_packetBuffer.packet.root_delay       = 0;
+  _u_packetBuffer.packet.root_dispersion  = 0;
+
+  if (_u_packetBuffer.packet.poll < _clock->_maxPollInterval)
+    _u_packetBuffer.packet.poll = _clock->_maxPollInterval;
+
+  memcpy(_u_packetBuffer.packet.reference_id, code, 4);
+
+  _send(cbPacket);
+}
+
+/***** Symmetric Key Authentication ******/
+
+int NTPServer::_authenticate(int cbPacket, const S_NTP_KEY **outKey)
+{
+  // Finds the key ID and MAC trailer of a client request (RFC 5905 7.3) and
+  // checks the MAC. Returns L_NTP_R_SUCCESS with the key to sign the reply
+  // with (NULL for an unauthenticated request), L_NTP_BAD_AUTH if the reply
+  // should be a crypto-NAK, or the reason to drop the request.
+
+  const unsigned char *p = (const unsigned char *)_u_packetBuffer.byteBuffer;
+  uint32_t keyId;
+  int offset = sizeof(S_NTP_PACKET);
+  int cbField;
+
+  *outKey = NULL;
+
+  // Extension fields come first, the trailer is whatever is too short to be one
+  while (cbPacket - offset > L_NTP_MAX_MAC)
+  {
+    cbField = (p[offset + 2] << 8) | p[offset + 3];
+
+    if (cbField < L_NTP_MIN_EXT_FIELD || (cbField & 3) != 0 || cbField > cbPacket - offset)
+      return L_NTP_BAD_REQUEST;
+
+    offset += cbField;
+  }
+
+#if L_NTP_AUTH
+  if (offset == cbPacket)
+    return (_clock->_authRequired ? L_NTP_NOT_PERMITTED : L_NTP_R_SUCCESS);
+#else
+  if (offset == cbPacket)
+    return L_NTP_R_SUCCESS;
+#endif
+
+  if (cbPacket - offset < (int)sizeof(keyId) + 1)
+    return L_NTP_BAD_REQUEST;
+
+#if L_NTP_AUTH
+  const S_NTP_KEY *key;
+  uint8_t mac[L_NTP_MAX_MAC];
+
+  keyId = ((uint32_t)p[offset] << 24) | ((uint32_t)p[offset + 1] << 16) | (p[offset + 2] << 8) | p[offset + 3];
+  key   = _clock->_findKey(keyId);
+
+  if (key == NULL || cbPacket - offset - (int)sizeof(keyId) != key->cbDigest)
+    return L_NTP_BAD_AUTH;
+
+  _computeMac(key, p, offset, mac);
+
+  if (!ntpMacEqual(mac, &p[offset + sizeof(keyId)], key->cbDigest))
+    return L_NTP_BAD_AUTH;
+
+  *outKey = key;
+  return L_NTP_R_SUCCESS;
+#else
+  return L_NTP_BAD_AUTH;   // No keys: the client gets a crypto-NAK
+#endif
+}
+
+#if L_NTP_AUTH
+
+const S_NTP_KEY *NTPServer::_findKey(uint32_t keyId) const
+{
+  int i;
+
+  for (i = 0; i < _keyCount; i++)
+  {
+    if (_keys[i].keyId == keyId)
+      return &_keys[i];
+  }
+
+  return NULL;
+}
+
+void NTPServer::_computeMac(const S_NTP_KEY *key, const void *data, int cbData, uint8_t *mac)
+{
+  if (key->type == L_NTP_KEY_AES128CMAC)
+  {
+    key->state.cmac.compute(data, cbData, mac);
+  }
+  else
+  {
+    // Carry on from the state left by hashing the key
+    NTPSha1 sha1 = key->state.sha1;
+
+    sha1.update(data, cbData);
+    sha1.final(mac);
+  }
+}
+
+/**
+  * addKey
+  *
+  * Adds a symmetric key (or replaces the key with the same ID), as found in
+  * an ntpd keys file. Client requests with a MAC made with one of the keys
+  * are answered with a reply signed by the same key; requests with a MAC
+  * that does not check out get a crypto-NAK. Only the state derived from the
+  * key is kept: the SHA-1 state after hashing the key, or the AES key schedule
+  * and CMAC subkeys. AES-CMAC keys are cut or zero padded to 16 bytes, like
+  * ntpd does.
+  */
+int NTPServer::addKey(uint32_t keyId, int keyType, const uint8_t *key, int cbKey)
+{
+  S_NTP_KEY *entry = (S_NTP_KEY *)_findKey(keyId);
+  uint8_t    aesKey[L_NTP_AES128_KEY];
+
+  if (keyId == 0 || key == NULL || cbKey <= 0)
+    return L_NTP_R_ERROR;
+
+  if (keyType != L_NTP_KEY_SHA1 && keyType != L_NTP_KEY_AES128CMAC)
+    return L_NTP_R_ERROR;
+
+  if (entry == NULL)
+  {
+    if (_keyCount >= L_NTP_MAX_KEYS)
+      return L_NTP_R_ERROR;
+
+    entry = &_keys[_keyCount++];
+  }
+
+  entry->keyId = keyId;
+  entry->type  = keyType;
+
+  if (keyType == L_NTP_KEY_AES128CMAC)
+  {
+    memset(aesKey, 0, sizeof(aesKey));
+    memcpy(aesKey, key, cbKey < L_NTP_AES128_KEY ? cbKey : L_NTP_AES128_KEY);
+
+    entry->state.cmac.setKey(aesKey);
+    entry->cbDigest = L_NTP_AES_BLOCK;
+  }
+  else
+  {
+    entry->state.sha1.init();
+    entry->state.sha1.update(key, cbKey);
+    entry->cbDigest = L_NTP_SHA1_DIGEST;
+  }
+
+  return L_NTP_R_SUCCESS;
+}
+
+void NTPServer::removeAllKeys()
+{
+  memset(_keys, 0, sizeof(_keys));
+  _keyCount = 0;
+}
+
+/**
+  * setAuthenticationRequired
+  *
+  * When set, client requests without a valid MAC are not answered.
+  */
+void NTPServer::setAuthenticationRequired(bool required)
+{
+  _authRequired = required;
+}
+
+#else
+
+int NTPServer::addKey(uint32_t /* keyId */, int /* keyType */, const uint8_t * /* key */, int /* cbKey */)
+{
+  // Compiled without authentication
+  return L_NTP_R_ERROR;
+}
+
+void NTPServer::removeAllKeys()
+{
+}
+
+void NTPServer::setAuthenticationRequired(bool /* required */)
+{
+}
+
+#endif
+
+/***** Network Time Security ******/
+
+#if L_NTP_NTS
+
+static void putExtensionField(unsigned char *p, int type, int cbField)
+{
+  p[0] = (unsigned char)(type >> 8);
+  p[1] = (unsigned char)type;
+  p[2] = (unsigned char)(cbField >> 8);
+  p[3] = (unsigned char)cbField;
+}
+
+bool NTPServer::_isNtsRequest(int cbPacket)
+{
+  // NTS requests lead with the unique identifier (or the cookie). Anything
+  // short enough to be a MAC trailer is not one.
+
+  const unsigned char *p = (const unsigned char *)&_u_packetBuffer.byteBuffer[sizeof(S_NTP_PACKET)];
+  int type;
+
+  if (!_clock->_ntsEnabled || cbPacket - (int)sizeof(S_NTP_PACKET) <= L_NTP_MAX_MAC)
+    return false;
+
+  type = (p[0] << 8) | p[1];
+
+  return (type == L_NTP_NTS_EF_UNIQUE_ID || type == L_NTP_NTS_EF_COOKIE);
+}
+
+void NTPServer::_handleNtsRequest(const t_ntpTimestamp tsReceived, int cbPacket)
+{
+  // Opens the cookie for the client's keys and checks the authenticator with
+  // the C2S key. The reply echoes the unique identifier and carries fresh
+  // cookies (one for the cookie used up, one per placeholder), encrypted and
+  // authenticated with the S2C key. No state is kept and nothing is allocated:
+  // what is needed of the request is copied to the stack before the reply is
+  // built over it. `plain` holds no more cookies than fit in the receive buffer
+  // (L_NTP_NTS_REPLY_COOKIES), so it stays small on boards with a small buffer.
+
+  unsigned char *p = (unsigned char *)_u_packetBuffer.byteBuffer;
+  uint8_t   uid[L_NTP_NTS_MAX_UID];
+  uint8_t   keys[2 * L_NTP_NTS_KEY];
+  uint8_t   nonce[L_NTP_NTS_NONCE];
+  uint8_t   plain[L_NTP_NTS_REPLY_COOKIES * (4 + L_NTP_NTS_COOKIE)];
+  NTPAesSiv aead;
+  S_NTP_INTERLEAVE_ENTRY *entry;
+  uint32_t  period;
+  int offset = sizeof(S_NTP_PACKET), type, cbField;
+  int cbUid = 0, cookieOffset = 0, cbCookie = 0, authOffset = 0, cbAuth = 0, placeholders = 0;
+  int cbNonce, cbCipher, cbPlain, cookies, cbReply, i;
+  bool valid;
+
+  // Same master key as the clock source, but keys derived by and for us
+  if (_ntsCookiesGeneration != _clock->_ntsGeneration)
+  {
+    _ntsCookies.setMasterKey(_clock->_ntsMasterKey, _timestamp() ^ (uint64_t)(uintptr_t)this);
+    _ntsCookiesGeneration = _clock->_ntsGeneration;
+  }
+
+  // Extension fields up to the authenticator (anything after it is not covered)
+  while (authOffset == 0 && cbPacket - offset >= 4)
+  {
+    type    = (p[offset] << 8) | p[offset + 1];
+    cbField = (p[offset + 2] << 8) | p[offset + 3];
+
+    if (cbField < 4 || (cbField & 3) != 0 || cbField > cbPacket - offset)
+    {
+      _close(L_NTP_BAD_REQUEST);
+      return;
+    }
+
+    switch (type)
+    {
+      case L_NTP_NTS_EF_UNIQUE_ID:
+        cbUid = cbField - 4;
+        memcpy(uid, &p[offset + 4], cbUid <= L_NTP_NTS_MAX_UID ? cbUid : 0);
+        break;
+
+      case L_NTP_NTS_EF_COOKIE:
+        cookieOffset = offset + 4;
+        cbCookie     = cbField - 4;
+        break;
+
+      case L_NTP_NTS_EF_PLACEHOLDER:
+        placeholders++;
+        break;
+
+      case L_NTP_NTS_EF_AUTHENTICATOR:
+        authOffset = offset;
+        cbAuth     = cbField;
+        break;
+    }
+
+    offset += cbField;
+  }
+
+  if (cbUid < L_NTP_NTS_MIN_UID || cbUid > L_NTP_NTS_MAX_UID || cookieOffset == 0 || cbAuth < 8)
+  {
+    _close(L_NTP_BAD_REQUEST);
+    return;
+  }
+
+  cbNonce  = (p[authOffset + 4] << 8) | p[authOffset + 5];
+  cbCipher = (p[authOffset + 6] << 8) | p[authOffset + 7];
+  cbPlain  = cbCipher - L_NTP_AES_BLOCK;
+
+  if (cbNonce == 0 || cbPlain < 0 || cbPlain > (int)sizeof(plain) ||
+      8 + ((cbNonce + 3) & ~3) + ((cbCipher + 3) & ~3) > cbAuth)
+  {
+    _close(L_NTP_BAD_REQUEST);
+    return;
+  }
+
+  period = NTPNtsCookies::currentPeriod();
+
+  valid = _ntsCookies.open(period, &p[cookieOffset], cbCookie, keys);
+
+  if (valid)
+  {
+    aead.setKey(keys);   // C2S
+    valid = aead.open(p, authOffset, &p[authOffset + 8], cbNonce,
+                      &p[authOffset + 8 + ((cbNonce + 3) & ~3)], cbCipher, plain);
+  }
+
+  if (!valid)
+  {
+    // NTS NAK: a kiss-o'-death that only carries the unique identifier
+    putExtensionField(&p[sizeof(S_NTP_PACKET)], L_NTP_NTS_EF_UNIQUE_ID, 4 + cbUid);
+    memcpy(&p[sizeof(S_NTP_PACKET) + 4], uid, cbUid);
+
+    _sendKissOfDeath(L_NTP_NTS_KOD_NAK, sizeof(S_NTP_PACKET) + 4 + cbUid);
+    _close(L_NTP_BAD_AUTH);
+    return;
+  }
+
+  // Placeholders may also come encrypted
+  for (offset = 0; cbPlain - offset >= 4; offset += cbField)
+  {
+    cbField = (plain[offset + 2] << 8) | plain[offset + 3];
+
+    if (cbField < 4 || cbField > cbPlain - offset)
+      break;
+
+    if (((plain[offset] << 8) | plain[offset + 1]) == L_NTP_NTS_EF_PLACEHOLDER)
+      placeholders++;
+  }
+
+  // As many cookies as asked for, while the reply is no larger than the request
+  cbReply = sizeof(S_NTP_PACKET) + 4 + cbUid + 8 + L_NTP_NTS_NONCE + L_NTP_AES_BLOCK;
+  cookies = (placeholders < L_NTP_NTS_REPLY_COOKIES ? placeholders + 1 : L_NTP_NTS_REPLY_COOKIES);
+
+  while (cookies > 0 && cbReply + cookies * (4 + L_NTP_NTS_COOKIE) > cbPacket)
+    cookies--;
+
+  for (i = 0, cbPlain = 0; i < cookies; i++, cbPlain += 4 + L_NTP_NTS_COOKIE)
+  {
+    putExtensionField(&plain[cbPlain], L_NTP_NTS_EF_COOKIE, 4 + L_NTP_NTS_COOKIE);
+    _ntsCookies.seal(period, keys, &plain[cbPlain + 4]);
+  }
+
+  // Header and timestamps as for any reply
+  entry = _setTimestamps(tsReceived);
+
+  offset = sizeof(S_NTP_PACKET);
+  putExtensionField(&p[offset], L_NTP_NTS_EF_UNIQUE_ID, 4 + cbUid);
+  memcpy(&p[offset + 4], uid, cbUid);
+  offset += 4 + cbUid;
+
+  // Authenticator: our nonce, then the cookies sealed with everything before it
+  _ntsCookies.nonce(nonce);
+
+  cbField = 8 + L_NTP_NTS_NONCE + L_NTP_AES_BLOCK + cbPlain;
+  putExtensionField(&p[offset], L_NTP_NTS_EF_AUTHENTICATOR, cbField);
+  putExtensionField(&p[offset + 4], L_NTP_NTS_NONCE, L_NTP_AES_BLOCK + cbPlain);   // Nonce and ciphertext lengths
+  memcpy(&p[offset + 8], nonce, L_NTP_NTS_NONCE);
+
+  aead.setKey(&keys[L_NTP_NTS_KEY]);   // S2C
+  aead.seal(p, offset, nonce, L_NTP_NTS_NONCE, plain, cbPlain, &p[offset + 8 + L_NTP_NTS_NONCE]);
+
+  _send(offset + cbField);
+
+  if (entry != NULL)
+    _transmitted(entry, tsReceived);
+
+  _served();
+}
+
+/**
+  * enableNts
+  *
+  * Serves NTS (RFC 8915) clients whose cookies were sealed with masterKey (32
+  * bytes), normally by a PosixNTSKEServer given the same key. The keys that
+  * seal cookies are derived from it and change once a day; cookies of the
+  * previous day are still accepted.
+  */
+int NTPServer::enableNts(const uint8_t *masterKey, int cbKey)
+{
+  if (masterKey == NULL || cbKey != L_NTP_NTS_MASTER_KEY)
+    return L_NTP_R_ERROR;
+
+  memcpy(_ntsMasterKey, masterKey, sizeof(_ntsMasterKey));
+  _ntsGeneration++;
+  _ntsEnabled = true;
+
+  return L_NTP_R_SUCCESS;
+}
+
+void NTPServer::disableNts()
+{
+  _ntsEnabled = false;
+}
+
+#else
+
+int NTPServer::enableNts(const uint8_t * /* masterKey */, int /* cbKey */)
+{
+  // Compiled without NTS
+  return L_NTP_R_ERROR;
+}
+
+void NTPServer::disableNts()
+{
+}
+
+#endif
+
+/***** Interleaved Mode ******/
+
+#if L_NTP_INTERLEAVE
+
+/**
+  * enableInterleaved
+  *
+  * Answers clients in interleaved mode when they ask for it: the reply then
+  * carries the transmit timestamp of the previous reply to the same client,
+  * taken after it was sent (or by the kernel as it left, see PosixNTPServer),
+  * so the time spent sending is no longer missing from it. Clients are
+  * tracked in a fixed-size table of at least tableEntries entries; when it
+  * fills up, the least recently seen client of a bucket is forgotten and falls
+  * back to basic mode for one exchange.
+  */
+int NTPServer::enableInterleaved(int tableEntries)
+{
+  unsigned short buckets = 1;
+
+  disableInterleaved();
+
+  while (buckets * L_NTP_INTERLEAVE_WAYS < tableEntries && buckets < 0x8000)
+    buckets <<= 1;
+
+  _interleaveTable = new (std::nothrow) S_NTP_INTERLEAVE_ENTRY[buckets * L_NTP_INTERLEAVE_WAYS];
+
+  if (_interleaveTable == NULL)
+    return L_NTP_R_ERROR;
+
+  memset(_interleaveTable, 0, sizeof(S_NTP_INTERLEAVE_ENTRY) * buckets * L_NTP_INTERLEAVE_WAYS);
+
+  _interleaveBuckets = buckets;
+
+  return L_NTP_R_SUCCESS;
+}
+
+void NTPServer::disableInterleaved()
+{
+  if (_interleaveTable != NULL)
+  {
+    delete[] _interleaveTable;
+    _interleaveTable = NULL;
+  }
+
+  _interleaveBuckets = 0;
+}
+
+unsigned long NTPServer::getInterleavedReplies()
+{
+  return _interleavedReplies;
+}
+
+S_NTP_INTERLEAVE_ENTRY *NTPServer::_interleaveEntry()
+{
+  uint32_t key = _clientKey(_udp->L_NTP_TRANSPORT_CALL(remoteIP)());
+  uint32_t now = millis();
+  S_NTP_INTERLEAVE_ENTRY *entry;
+  bool found;
+
+  entry = findClient(&_interleaveTable[((key >> 16) & (_interleaveBuckets - 1)) * L_NTP_INTERLEAVE_WAYS],
+                     L_NTP_INTERLEAVE_WAYS, key, now, &found);
+
+  if (!found)
+  {
+    entry->key = key;
+    entry->rx  = 0;
+    entry->tx  = 0;
+  }
+
+  entry->lastMillis = now;
+
+  return entry;
+}
+
+#else
+
+int NTPServer::enableInterleaved(int /* tableEntries */)
+{
+  // Compiled without interleaved mode
+  return L_NTP_R_ERROR;
+}
+
+void NTPServer::disableInterleaved()
+{
+}
+
+unsigned long NTPServer::getInterleavedReplies()
+{
+  return 0;
+}
+
+#endif
+
+/***** Broadcast Mode ******/
+
+/**
+  * enableBroadcast
+  *
+  * Sends a broadcast (mode 5) packet to the given broadcast or multicast
+  * address every intervalSeconds, so that clients can follow our time without
+  * polling. The interval is rounded to a power of 2 and defaults to the
+  * maximum poll interval. Packets go out on whole multiples of the interval,
+  * from update(), and only while the clock is synchronized.
+  */
+int NTPServer::enableBroadcast(IPAddress address, int intervalSeconds)
+{
+  int poll = 0;
+
+  if (intervalSeconds <= 0)
+    intervalSeconds = 1 << _maxPollInterval;
+
+  while (poll < 17 && (1L << (poll + 1)) <= intervalSeconds)
+    poll++;
+
+  _broadcastAddress         = address;
+  _broadcastPoll            = poll;
+  _broadcastIntervalSeconds = 1UL << poll;
+  _nextBroadcastMicros      = micros64();
+
+  return L_NTP_R_SUCCESS;
+}
+
+void NTPServer::disableBroadcast()
+{
+  _broadcastIntervalSeconds = 0;
+}
+
+void NTPServer::_sendBroadcast()
+{
+  // Same packet as a reply to a client, minus the client's timestamps. Sent
+  // between batches, so the packet buffer is free.
+
+  t_ntpSysClock  now = micros64();
+  t_ntpTimestamp ts;
+  uint32_t       seconds, next;
+
+  if (!_clock->_isSynchronizedAt(now))
+  {
+    // Nothing worth listening to, look again in a second
+    _nextBroadcastMicros = now + 1000000;
+    return;
+  }
+
+  _prepareResponse(now);
+
+  _u_packetBuffer.header.mode         = L_NTP_MODE_BROADCAST;
+  _u_packetBuffer.packet.poll         = _broadcastPoll;
+  _u_packetBuffer.packet.ts_origin    = 0;
+  _u_packetBuffer.packet.ts_received  = 0;
+
+  ts = _timestampAt(now);
+  _htonTimestamp(ts, &_u_packetBuffer.packet.ts_transmit);
+
+  if (_sendTo(_broadcastAddress, L_NTP_PORT, sizeof(S_NTP_PACKET)) == L_NTP_R_SUCCESS)
+    _broadcastsSent++;
+
+  // Next one on the next multiple of the interval (of served time)
+  seconds = (uint32_t)(ts >> 32);
+  next    = (seconds | (_broadcastIntervalSeconds - 1)) + 1;
+
+  _nextBroadcastMicros = now + (t_ntpSysClock)(next - seconds) * 1000000
+                             - (((ts & 0xFFFFFFFF) * 1000000) >> 32);
+}
+
+unsigned long NTPServer::getBroadcastsSent()
+{
+  return _broadcastsSent;
+}
+
+/***** Packet Capture ******/
+
+#if L_NTP_CAPTURE
+
+/**
+  * enableCapture
+  *
+  * Keeps a copy of the last `packets` datagrams received, up to snapLength
+  * bytes each, with their receive timestamps and senders. writeCapture() turns
+  * them into a pcap file that Wireshark can decode, and that the ntpreplay tool
+  * (extras/host/bench) feeds back through update() to reproduce the traffic.
+  */
+int NTPServer::enableCapture(int packets, int snapLength)
+{
+  disableCapture();
+
+  if (packets <= 0 || snapLength < 0)
+    return L_NTP_R_ERROR;
+
+  if (snapLength > L_NTP_MAX_RX_BUFF)
+    snapLength = L_NTP_MAX_RX_BUFF;
+
+  _captureSlotSize = (sizeof(S_NTP_CAPTURE_RECORD) + snapLength + 7) & ~7;
+  _captureRing     = new (std::nothrow) uint8_t[(size_t)_captureSlotSize * packets];
+
+  if (_captureRing == NULL)
+    return L_NTP_R_ERROR;
+
+  memset(_captureRing, 0, (size_t)_captureSlotSize * packets);
+
+  _captureSlots      = packets;
+  _captureSnapLength = snapLength;
+  _captureCount      = 0;
+
+  return L_NTP_R_SUCCESS;
+}
+
+void NTPServer::disableCapture()
+{
+  if (_captureRing != NULL)
+  {
+    delete[] _captureRing;
+    _captureRing = NULL;
+  }
+
+  _captureSlots = 0;
+}
+
+unsigned long NTPServer::getCapturedPackets()
+{
+  return __atomic_load_n(&_captureCount, __ATOMIC_ACQUIRE);
+}
+
+void NTPServer::_capture(int cbPacket)
+{
+  // Overwrites the oldest slot. Its sequence is odd while that happens, so
+  // writeCapture() on another thread skips it rather than write a torn record.
+
+  uint32_t n = _captureCount;
+  S_NTP_CAPTURE_RECORD *rec = (S_NTP_CAPTURE_RECORD *)&_captureRing[(size_t)(n % _captureSlots) * _captureSlotSize];
+  IPAddress ip = _udp->L_NTP_TRANSPORT_CALL(remoteIP)();
+  t_ntpTimestamp ts = _receiveTimestamp();
+  uint32_t v4;
+
+  __atomic_store_n(&rec->seq, 2 * n + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  rec->size         = (uint16_t)(cbPacket < 0xFFFF ? cbPacket : 0xFFFF);
+  rec->length       = (uint16_t)(_packetLength < _captureSnapLength ? _packetLength : _captureSnapLength);
+  rec->synchronized = (ts != 0);
+  rec->received     = (ts != 0 ? ts : _microsToNtp(micros64()));
+  rec->port         = _udp->L_NTP_TRANSPORT_CALL(remotePort)();
+
+#ifndef ARDUINO
+  if (ip.isV6())
+  {
+    rec->addressLength = 16;
+    memcpy(rec->address, ip.raw_address(), 16);
+  }
+  else
+#endif
+  {
+    rec->addressLength = 4;
+    v4 = (uint32_t)ip;
+    memcpy(rec->address, &v4, 4);
+  }
+
+  memcpy(&rec[1], _u_packetBuffer.byteBuffer, rec->length);
+
+  __atomic_store_n(&rec->seq, 2 * n + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&_captureCount, n + 1, __ATOMIC_RELEASE);
+}
+
+/**
+  * writeCapture
+  *
+  * Writes the captured datagrams out as a pcap file (nanosecond timestamps,
+  * raw IP), oldest first. Each gets an IP and UDP header addressed from the
+  * client to port 123, with the lengths it had on the wire. Timestamps are
+  * the times of day they were received at, or the times since boot while the
+  * clock was not synchronized. With fileHeader false, only the records are
+  * written, to append them to a capture already begun.
+  *
+  * May be called while another thread services requests: datagrams that are
+  * overwritten while being written out are left out. Returns the number of
+  * datagrams written.
+  */
+int NTPServer::writeCapture(Print &out, bool fileHeader)
+{
+  uint32_t hdr[6];
+
+  if (fileHeader)
+  {
+    hdr[0] = L_NTP_PCAP_MAGIC;
+    hdr[1] = 2 | (4 << 16);                                   // Version 2.4
+    hdr[2] = 0;                                               // UTC
+    hdr[3] = 0;                                               // Accuracy
+    hdr[4] = 40 + 8 + (_captureSnapLength > 0 ? _captureSnapLength : L_NTP_MAX_RX_BUFF);
+    hdr[5] = L_NTP_PCAP_RAW;
+
+    if (out.write((const uint8_t *)hdr, sizeof(hdr)) != sizeof(hdr))
+      return 0;
+  }
+
+  return _writeCaptureRecords(out);
+}
+
+int NTPServer::_writeCaptureRecords(Print &out)
+{
+  S_NTP_CAPTURE_RECORD *slot;
+  union
+  {
+    S_NTP_CAPTURE_RECORD rec;
+    uint8_t              bytes[sizeof(S_NTP_CAPTURE_RECORD) + L_NTP_MAX_RX_BUFF];
+  } copy;
+  uint8_t  headers[40 + 8];
+  uint32_t rec[4];
+  uint32_t n, i, seq, sum;
+  int64_t  seconds;
+  int cbHeaders, written = 0, j;
+
+  if (_captureRing == NULL)
+    return 0;
+
+  n = __atomic_load_n(&_captureCount, __ATOMIC_ACQUIRE);
+
+  for (i = (n > (uint32_t)_captureSlots ? n - _captureSlots : 0); i != n; i++)
+  {
+    slot = (S_NTP_CAPTURE_RECORD *)&_captureRing[(size_t)(i % _captureSlots) * _captureSlotSize];
+
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    memcpy(&copy, slot, sizeof(S_NTP_CAPTURE_RECORD) + _captureSnapLength);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (seq != 2 * i + 2 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+      continue;   // Already overwritten by a newer one
+
+    memset(headers, 0, sizeof(headers));
+
+    if (copy.rec.addressLength == 16)
+    {
+      cbHeaders   = 40 + 8;
+      headers[0]  = 0x60;
+      headers[4]  = (uint8_t)((8 + copy.rec.size) >> 8);
+      headers[5]  = (uint8_t)(8 + copy.rec.size);
+      headers[6]  = 17;                                       // UDP
+      headers[7]  = 64;
+      memcpy(&headers[8], copy.rec.address, 16);              // To the unspecified address
+    }
+    else
+    {
+      cbHeaders   = 20 + 8;
+      headers[0]  = 0x45;
+      headers[2]  = (uint8_t)((28 + copy.rec.size) >> 8);
+      headers[3]  = (uint8_t)(28 + copy.rec.size);
+      headers[8]  = 64;
+      headers[9]  = 17;
+      memcpy(&headers[12], copy.rec.address, 4);
+
+      for (sum = 0, j = 0; j < 20; j += 2)
+        sum += (headers[j] << 8) | headers[j + 1];
+
+      sum = (sum & 0xFFFF) + (sum >> 16);
+      sum = ~(sum + (sum >> 16)) & 0xFFFF;
+      headers[10] = (uint8_t)(sum >> 8);
+      headers[11] = (uint8_t)sum;
+    }
+
+    // UDP, without a checksum
+    headers[cbHeaders - 8] = (uint8_t)(copy.rec.port >> 8);
+    headers[cbHeaders - 7] = (uint8_t)copy.rec.port;
+    headers[cbHeaders - 6] = (uint8_t)(L_NTP_PORT >> 8);
+    headers[cbHeaders - 5] = (uint8_t)L_NTP_PORT;
+    headers[cbHeaders - 4] = (uint8_t)((8 + copy.rec.size) >> 8);
+    headers[cbHeaders - 3] = (uint8_t)(8 + copy.rec.size);
+
+    seconds = (copy.rec.synchronized ? _unixSeconds(copy.rec.received) : (int64_t)(copy.rec.received >> 32));
+
+    rec[0] = (uint32_t)seconds;
+    rec[1] = (uint32_t)(((copy.rec.received & 0xFFFFFFFF) * 1000000000ULL) >> 32);
+    rec[2] = cbHeaders + copy.rec.length;
+    rec[3] = cbHeaders + copy.rec.size;
+
+    out.write((const uint8_t *)rec, sizeof(rec));
+    out.write(headers, cbHeaders);
+
+    if (copy.rec.length > 0)
+      out.write(&copy.bytes[sizeof(S_NTP_CAPTURE_RECORD)], copy.rec.length);
+
+    written++;
+  }
+
+  return written;
+}
+
+#else
+
+int NTPServer::enableCapture(int /* packets */, int /* snapLength */)
+{
+  // Compiled without packet capture
+  return L_NTP_R_ERROR;
+}
+
+void NTPServer::disableCapture()
+{
+}
+
+unsigned long NTPServer::getCapturedPackets()
+{
+  return 0;
+}
+
+int NTPServer::writeCapture(Print & /* out */, bool /* fileHeader */)
+{
+  return 0;
+}
+
+#endif
+
+/***** setter methods ******/
+
+// The setters take turns with the other reference writers (update() failing
+// over, updateSource(), setReferenceTime()) through the writer lock, so that
+// two publishes cannot fill the same snapshot slot at once
+
+void NTPServer::setStratum(char stratum)
+{
+  _lockWriter();
+
+  _stratum = stratum;
+  _publishReference();
+
+  _unlockWriter();
+}
+
+void NTPServer::setMaxPollInterval(int pollIntervalSeconds)
+{
+  // NTP Poll Interval is defined as:
+  // Interval = 2 ^ x
+  //
+  // i.e. x=6, Interval=2^6=64 seconds
+
+  _lockWriter();
+
+  _maxPollInterval = (char)_log2(pollIntervalSeconds);
+  _publishReference();
+
+  _unlockWriter();
+}
+
+void NTPServer::setServerPrecision(double precisionInSeconds)
+{
+  // Server precision is specified in log2 seconds, signed byte
+  //
+  // i.e. x=-6, Interval=2^-6=0.015625 seconds
+
+  _lockWriter();
+
+  _precision = (signed char)_log2(precisionInSeconds);
+  _publishReference();
+
+  _unlockWriter();
+}
+
+void NTPServer::setRootDelay(double delayInSeconds)
+{
+  // Root delay is stored in a 32-bit fixed decimal point format (16.16 seconds)
+  int delay = (int)(delayInSeconds * 65536.0);
+
+  _lockWriter();
+
+  _rootDelay = htonl(delay);
+  _publishReference();
+
+  _unlockWriter();
+}
+
+void NTPServer::setRootDispersion(double dispersionInSeconds)
+{
+  // Dispersion of the time source itself. Our own error estimate is added on top.
+  _lockWriter();
+
+  _rootDispersion = (uint32_t)(dispersionInSeconds * 65536.0);
+  _updateHoldover();
+  _publishReference();
+
+  _unlockWriter();
+}
+
+/**
+  * setMaxTimeError
+  *
+  * Sets how large the estimated error (root dispersion) may grow while no
+  * reference time comes in, before the clock is declared unsynchronized.
+  */
+void NTPServer::setMaxTimeError(double errorInSeconds)
+{
+  _lockWriter();
+
+  _maxTimeError = errorInSeconds;
+  _updateHoldover();
+  _publishReference();     // Readers take the holdover from the snapshot
+
+  _unlockWriter();
+}
+
+/**
+  * setReferenceId
+  *
+  * Sets the NTP Reference ID. Parameter must be a 4-byte string.
+  */
+int NTPServer::setReferenceId(const char * referenceId)
+{
+  if (strlen(referenceId) <= sizeof _referenceId)
+  {
+    _lockWriter();
+
+    memset(_referenceId, 0, sizeof(_referenceId));
+    memcpy(_referenceId, referenceId, strlen(referenceId));
+    _publishReference();
+
+    _unlockWriter();
+
+    return L_NTP_R_SUCCESS;
+  }
+
+  return L_NTP_R_ERROR;
+}
+
+void NTPServer::invalidateTimeSynch()
+{
+  _lockWriter();
+
+  _clockIsSynchronized = 0;
+  _publishReference();
+
+  _unlockWriter();
+}
+
+void NTPServer::setReferenceTime(struct tm refTime)
+{ 
+  setReferenceTime(refTime, micros64());
+}
+
+void NTPServer::setReferenceTime(struct tm refTime, t_ntpSysClock refTimeMicros)
+{
+  _lockWriter();
+  _setReference((t_ntpTimestamp)(uint32_t)(L_NTP_EPOCH + _secondsFromCivil(&refTime)) << 32, refTimeMicros);
+  _unlockWriter();
+}
+
+/**
+  * capturePpsEdge
+  *
+  * First half of a PPS sync, for the interrupt handler of the PPS pin: only
+  * stores micros64() (or the edge time given), so it is quick and safe to call
+  * in the middle of anything else, including a request being serviced or the
+  * reference being set. publishReferenceTime() then pairs it with the time of
+  * that second, once the receiver's serial data has been decoded. Both
+  * overloads are placed in IRAM on the ESP8266, as the handler calling them
+  * has to be.
+  */
+IRAM_ATTR void NTPServer::capturePpsEdge()
+{
+  capturePpsEdge(micros64());
+}
+
+IRAM_ATTR void NTPServer::capturePpsEdge(t_ntpSysClock edgeMicros)
+{
+  // Sequence is odd while the edge is being written (in two halves on 32-bit MCUs)
+  uint32_t seq = _ppsSeq;
+
+  __atomic_store_n(&_ppsSeq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  _ppsMicros = edgeMicros;
+
+  __atomic_store_n(&_ppsSeq, seq + 2, __ATOMIC_RELEASE);
+}
+
+t_ntpSysClock NTPServer::getPpsEdge()
+{
+  t_ntpSysClock edge;
+  uint32_t seq;
+
+  do
+  {
+    seq  = __atomic_load_n(&_ppsSeq, __ATOMIC_ACQUIRE);
+    edge = _ppsMicros;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) != 0 || __atomic_load_n(&_ppsSeq, __ATOMIC_RELAXED) != seq);
+
+  return edge;
+}
+
+/**
+  * publishReferenceTime
+  *
+  * Second half of a PPS sync: refTime is the UTC time of the second that
+  * began at the last captured edge. Fails if there is no edge that recent
+  * (L_NTP_PPS_MAX_AGE), or if it was published already, as the time would then
+  * belong to an edge that was missed.
+  */
+int NTPServer::publishReferenceTime(struct tm refTime)
+{
+  t_ntpSysClock edge = getPpsEdge();
+
+  if (edge == 0 || edge == _ppsPublished || micros64() - edge >= L_NTP_PPS_MAX_AGE)
+    return L_NTP_R_ERROR;
+
+  _ppsPublished = edge;
+  setReferenceTime(refTime, edge);
+
+  return L_NTP_R_SUCCESS;
+}
+
+void NTPServer::_setReference(t_ntpTimestamp refTimestamp, t_ntpSysClock refTimeMicros)
+{
+  // Learn from how far off we would have been, before replacing the old reference
+  _disciplineClock(refTimestamp, refTimeMicros);
+
+  _referenceTimeMicros = refTimeMicros;  // Timestamp at which this time was acquried (used to compute fractional seconds)
+
+  _lastTimeSyncMillis = millis();        // Keeps track of how long it has been since the sync time was set
+  _clockIsSynchronized = 1;              // Clock is now synchronized
+  _clockSynchronizedSinceBoot = 1;
+
+  _referenceTimeAsSeconds = (time_t)_unixSeconds(refTimestamp);
+  _referenceTimestamp     = refTimestamp;
+
+  _publishReference();
+}
+
+/***** Reference Sources ******/
+
+#if L_NTP_SOURCES
+
+/**
+  * addSource
+  *
+  * Registers a reference source (a GPS receiver, an upstream server, ...) that
+  * then reports its samples through updateSource(). While a source is
+  * selected, the server serves its reference ID and stratum, and its delay and
+  * error estimate as root delay and root dispersion. A source that has not
+  * reported for timeoutMillis (default: the max poll interval) is passed over.
+  */
+int NTPServer::addSource(const char *referenceId, char stratum, unsigned long timeoutMillis)
+{
+  S_NTP_SOURCE *source;
+
+  if (_sourceCount >= L_NTP_MAX_SOURCES || strlen(referenceId) > sizeof(source->referenceId))
+    return -1;
+
+  source = &_sources[_sourceCount];
+  memset(source, 0, sizeof(*source));
+  memcpy(source->referenceId, referenceId, strlen(referenceId));
+
+  source->stratum       = stratum;
+  source->timeoutMicros = (t_ntpSysClock)(timeoutMillis != 0 ? timeoutMillis : 1000UL << _maxPollInterval) * 1000;
+
+  return _sourceCount++;
+}
+
+/**
+  * updateSource
+  *
+  * Reports a sample: the reference time at micros64() value refTimeMicros, how
+  * far off it may be, and how well the source is doing (0..L_NTP_QUALITY_MAX,
+  * 0 = not usable). The best source is selected again, and a sample of the
+  * selected source becomes the new reference.
+  */
+int NTPServer::updateSource(int source, t_ntpTimestamp refTimestamp, t_ntpSysClock refTimeMicros, double errorSeconds, int quality, double delaySeconds)
+{
+  S_NTP_SOURCE *s;
+  int previous;
+
+  if (source < 0 || source >= _sourceCount)
+    return L_NTP_R_ERROR;
+
+  _lockWriter();
+
+  previous = _selectedSource;
+
+  s = &_sources[source];
+  s->timestamp      = refTimestamp;
+  s->sampleMicros   = refTimeMicros;
+  s->rootDispersion = (uint32_t)(errorSeconds * 65536.0);
+  s->rootDelay      = (uint32_t)(delaySeconds * 65536.0);
+  s->quality        = (uint8_t)(quality < 0 ? 0 : (quality > L_NTP_QUALITY_MAX ? L_NTP_QUALITY_MAX : quality));
+
+  // A switch to this source has fed its sample already
+  if (_selectSource(micros64()) == source && previous == source)
+    _feedSource(source);
+
+  _unlockWriter();
+
+  return L_NTP_R_SUCCESS;
+}
+
+int NTPServer::updateSource(int source, struct tm refTime, t_ntpSysClock refTimeMicros, double errorSeconds, int quality)
+{
+  return updateSource(source, (t_ntpTimestamp)(uint32_t)(L_NTP_EPOCH + _secondsFromCivil(&refTime)) << 32,
+                      refTimeMicros, errorSeconds, quality);
+}
+
+void NTPServer::invalidateSource(int source)
+{
+  if (source < 0 || source >= _sourceCount)
+    return;
+
+  _lockWriter();
+
+  _sources[source].quality = 0;
+  _selectSource(micros64());
+
+  _unlockWriter();
+}
+
+int NTPServer::selectSource()
+{
+  int selected;
+
+  _lockWriter();
+  selected = _selectSource(micros64());
+  _unlockWriter();
+
+  return selected;
+}
+
+int64_t NTPServer::_failOver(t_ntpSysClock now)
+{
+  // Fails over as soon as the selected source has gone quiet. If the sources
+  // are being updated on another thread right now, that takes care of it.
+  // Run by update(), and by the pool's own thread (workers have no sources).
+
+  int selected = _selectedSource;
+  int64_t due;
+
+  if (selected < 0)
+    return -1;
+
+  due = (int64_t)_sources[selected].timeoutMicros - (int64_t)(now - _sources[selected].sampleMicros);
+
+  if (due >= 0 || !_tryLockWriter())
+    return (due >= 0 ? due : 0);
+
+  selected = _selectSource(micros64());
+  _unlockWriter();
+
+  if (selected < 0)
+    return -1;
+
+  due = (int64_t)_sources[selected].timeoutMicros - (int64_t)(micros64() - _sources[selected].sampleMicros);
+
+  return (due >= 0 ? due : 0);
+}
+
+bool NTPServer::_sourceUsable(int source, t_ntpSysClock now) const
+{
+  const S_NTP_SOURCE *s = &_sources[source];
+
+  return s->quality > 0 && s->sampleMicros != 0 && now - s->sampleMicros <= s->timeoutMicros;
+}
+
+double NTPServer::_sourceDistance(int source, t_ntpSysClock now) const
+{
+  // Half the round trip plus the error estimate, grown by the worst case drift
+  // since the sample (RFC 5905 root distance)
+
+  const S_NTP_SOURCE *s = &_sources[source];
+
+  return s->rootDelay / 131072.0 + s->rootDispersion / 65536.0 + (now - s->sampleMicros) * 1e-6 * L_NTP_TOLERANCE + 1e-6;
+}
+
+int NTPServer::_selectSource(t_ntpSysClock now)
+{
+  // Ranks the usable sources by stratum, then by root distance scaled down
+  // by their quality (as ntpd ranks its survivors). The selected source keeps
+  // its place unless another one is clearly better, so that two close
+  // sources do not take turns.
+
+  double score, bestScore = 0, selectedScore = 0;
+  int best = -1, i;
+
+  for (i = 0; i < _sourceCount; i++)
+  {
+    if (!_sourceUsable(i, now))
+      continue;
+
+    score = _sources[i].stratum * L_NTP_STRATUM_DISTANCE + _sourceDistance(i, now) * L_NTP_QUALITY_MAX / _sources[i].quality;
+
+    if (i == _selectedSource)
+      selectedScore = score;
+
+    if (best < 0 || score < bestScore)
+    {
+      best      = i;
+      bestScore = score;
+    }
+  }
+
+  if (best >= 0 && best != _selectedSource && selectedScore > 0 && bestScore > selectedScore * L_NTP_SOURCE_HYSTERESIS)
+    best = _selectedSource;
+
+  if (best != _selectedSource)
+  {
+    _selectedSource = best;
+
+    if (best >= 0)
+      _feedSource(best);
+  }
+
+  return _selectedSource;
+}
+
+void NTPServer::_feedSource(int source)
+{
+  // Takes over the identity of the source, and its last sample as the new
+  // reference unless that is older than the current one (right after a switch)
+
+  const S_NTP_SOURCE *s = &_sources[source];
+
+  _stratum        = s->stratum;
+  _rootDelay      = htonl(s->rootDelay);
+  _rootDispersion = s->rootDispersion;
+  memcpy(_referenceId, s->referenceId, sizeof(_referenceId));
+
+  if (_clockSynchronizedSinceBoot && (int64_t)(s->sampleMicros - _referenceTimeMicros) <= 0)
+  {
+    _updateHoldover();
+    _publishReference();
+    return;
+  }
+
+  _setReference(_combineSources(source), s->sampleMicros);
+}
+
+t_ntpTimestamp NTPServer::_combineSources(int source)
+{
+  // Averages the offsets (from our clock) of the selected source and of every
+  // other usable source that agrees with it to within their root distances,
+  // weighted by quality over distance squared, and returns the reference time
+  // at the selected source's sample
+
+  const S_NTP_SOURCE *s = &_sources[source];
+  t_ntpSysClock now = micros64();
+  t_ntpTimestamp local;
+  double offset, selectedOffset, distance, selectedDistance, weight, sum, total;
+  int i;
+
+  if (!_clockSynchronizedSinceBoot)
+    return s->timestamp;
+
+  local            = _timestampAt(s->sampleMicros);
+  selectedOffset   = (double)(int64_t)(s->timestamp - local) / 4294967296.0;
+  selectedDistance = _sourceDistance(source, now);
+
+  total = s->quality / (selectedDistance * selectedDistance);
+  sum   = selectedOffset * total;
+
+  for (i = 0; i < _sourceCount; i++)
+  {
+    if (i == source || !_sourceUsable(i, now))
+      continue;
+
+    offset   = (double)(int64_t)(_sources[i].timestamp - _timestampAt(_sources[i].sampleMicros)) / 4294967296.0;
+    distance = _sourceDistance(i, now);
+
+    if (fabs(offset - selectedOffset) > distance + selectedDistance)
+      continue;
+
+    weight = _sources[i].quality / (distance * distance);
+    sum   += offset * weight;
+    total += weight;
+  }
+
+  return local + (t_ntpTimestamp)(int64_t)llround(sum / total * 4294967296.0);
+}
+
+/***** Upstream Servers ******/
+
+/**
+  * addUpstreamServer
+  *
+  * Makes the server a client of another NTP server: it is queried every
+  * pollSeconds (rounded to a power of 2), starting with a burst of
+  * L_NTP_IBURST_COUNT queries 2 s apart, so that the first samples are in
+  * within seconds of begin(). Of the last L_NTP_UPSTREAM_FILTER samples, the
+  * one with the least round trip delay is reported to a reference source
+  * added for the server, at the server's stratum + 1 and with its address as
+  * reference ID. Returns that source, or -1 if no more servers can be added.
+  */
+int NTPServer::addUpstreamServer(IPAddress address, uint16_t port, int pollSeconds)
+{
+  S_NTP_UPSTREAM *u;
+  uint32_t refid;
+  int source;
+  int poll = _log2(pollSeconds > 0 ? pollSeconds : 64);
+
+  if (_upstreamCount >= L_NTP_MAX_UPSTREAMS)
+    return -1;
+
+  if (poll > L_NTP_UPSTREAM_MAX_POLL)
+    poll = L_NTP_UPSTREAM_MAX_POLL;
+
+  // Gone quiet once the filter has nothing left but samples from before the last 2 polls
+  source = addSource("", L_NTP_STRAT_UNSYNCHRONIZED, (L_NTP_UPSTREAM_FILTER + 2) * 1000UL << poll);
+
+  if (source < 0)
+    return -1;
+
+  // Reference ID of a server at stratum 2+ is its upstream's IPv4 address (a hash for IPv6)
+  refid = (uint32_t)address;
+
+#ifndef ARDUINO
+  if (address.isV6())
+    refid = htonl(_clientKey(address));
+#endif
+
+  memcpy(_sources[source].referenceId, &refid, sizeof(refid));
+
+  u = &_upstreams[_upstreamCount++];
+  *u = S_NTP_UPSTREAM();
+
+  u->address    = address;
+  u->port       = port;
+  u->source     = source;
+  u->poll       = poll;
+  u->nextMicros = micros64();
+
+  return source;
+}
+
+int NTPServer::getUpstreamReach(int source)
+{
+  int i;
+
+  for (i = 0; i < _upstreamCount; i++)
+  {
+    if (_upstreams[i].source == source)
+      return _upstreams[i].reach;
+  }
+
+  return -1;
+}
+
+void NTPServer::_pollUpstreams(t_ntpSysClock now)
+{
+  int i;
+
+  for (i = 0; i < _upstreamCount; i++)
+  {
+    if (!_upstreams[i].stopped && (int64_t)(now - _upstreams[i].nextMicros) >= 0)
+      _sendUpstreamQuery(&_upstreams[i]);
+  }
+}
+
+void NTPServer::_sendUpstreamQuery(S_NTP_UPSTREAM *u)
+{
+  // A plain mode 3 request. Until the clock is set, the transmit timestamp is
+  // just a value the reply has to echo back.
+
+  t_ntpSysClock now = micros64();
+
+  // A burst at the first query, and at every poll while the server does not answer
+  if (u->burst == 0 && u->reach == 0)
+    u->burst = L_NTP_IBURST_COUNT;
+
+  memset(&_u_packetBuffer.packet, 0, sizeof(S_NTP_PACKET));
+
+  _u_packetBuffer.header.li        = (_isSynchronizedAt(now) ? L_NTP_LI_NONE : L_NTP_LI_UNSYNCH);
+  _u_packetBuffer.header.vn        = L_NTP_MAX_VER;
+  _u_packetBuffer.header.mode      = L_NTP_MODE_CLIENT;
+  _u_packetBuffer.packet.poll      = u->poll;
+  _u_packetBuffer.packet.precision = _precision;
+
+  u->origin = (_isSynchronizedAt(now) ? _timestampAt(now) : _microsToNtp(now));
+  _htonTimestamp(u->origin, &_u_packetBuffer.packet.ts_transmit);
+
+  // Shifted on every query, the reply sets the bit again
+  u->reach <<= 1;
+
+  if (u->queries < 8)
+    u->queries++;
+
+  u->sentMicros = micros64();
+  _sendTo(u->address, u->port, sizeof(S_NTP_PACKET));
+
+  if (u->burst > 0)
+    u->burst--;
+
+  u->nextMicros = now + (u->burst > 0 ? (t_ntpSysClock)L_NTP_IBURST_INTERVAL : (t_ntpSysClock)1000000 << u->poll);
+}
+
+int NTPServer::_handleUpstreamReply(t_ntpSysClock receivedMicros)
+{
+  // Takes the reply to the query awaiting one, if it is that: same server,
+  // and our transmit timestamp echoed back. Anything else is dropped.
+
+  S_NTP_PACKET *reply = &_u_packetBuffer.packet;
+  IPAddress address = _udp->L_NTP_TRANSPORT_CALL(remoteIP)();
+  uint16_t port = _udp->L_NTP_TRANSPORT_CALL(remotePort)();
+  S_NTP_UPSTREAM *u = NULL;
+  int i;
+
+  for (i = 0; i < _upstreamCount; i++)
+  {
+    if (_upstreams[i].origin != 0 && _upstreams[i].port == port && _upstreams[i].address == address)
+    {
+      u = &_upstreams[i];
+      break;
+    }
+  }
+
+  if (u == NULL)
+    return _close(L_NTP_NOT_IMPLEMENTED);
+
+  if (_ntohTimestamp(&reply->ts_origin) != u->origin)
+    return _close(L_NTP_BAD_REQUEST);                    // Stale or spoofed
+
+  u->origin = 0;
+  u->reach |= 1;
+
+  if (reply->stratum == L_NTP_STRAT_UNSPECIFIED)
+  {
+    // Kiss-o'-death: slow down, or stop asking altogether
+    if (memcmp(reply->reference_id, L_NTP_KOD_RATE, 4) == 0)
+    {
+      if (u->poll < L_NTP_UPSTREAM_MAX_POLL)
+        u->poll++;
+
+      u->burst      = 0;
+      u->nextMicros = receivedMicros + ((t_ntpSysClock)1000000 << u->poll);
+    }
+    else if (memcmp(reply->reference_id, L_NTP_KOD_DENY, 4) == 0 || memcmp(reply->reference_id, L_NTP_KOD_RSTR, 4) == 0)
+    {
+      u->stopped = true;
+      invalidateSource(u->source);
+    }
+
+    return L_NTP_R_SUCCESS;
+  }
+
+  // Not synchronized itself, or of no use to our clients
+  if (reply->header.li == L_NTP_LI_UNSYNCH || (unsigned char)reply->stratum >= L_NTP_STRAT_UNSYNCHRONIZED - 1 || reply->ts_transmit == 0)
+    return L_NTP_R_SUCCESS;
+
+  _feedUpstream(u, reply, receivedMicros);
+
+  return L_NTP_R_SUCCESS;
+}
+
+void NTPServer::_feedUpstream(S_NTP_UPSTREAM *u, const S_NTP_PACKET *reply, t_ntpSysClock receivedMicros)
+{
+  // Round trip on our clock (so that it does not matter whether that is set
+  // yet) less the time the server held on to the query. The server's time at
+  // receivedMicros is its transmit timestamp plus half of that.
+
+  S_NTP_UPSTREAM_SAMPLE *sample, *best;
+  S_NTP_SOURCE *s = &_sources[u->source];
+  t_ntpTimestamp held, delay;
+  double rootDelay, rootDispersion;
+  int i;
+
+  held  = _ntohTimestamp(&reply->ts_transmit) - _ntohTimestamp(&reply->ts_received);
+  delay = _microsToNtp(receivedMicros - u->sentMicros);
+  delay = ((int64_t)(delay - held) > 0 ? delay - held : 0);
+
+  rootDelay      = (uint32_t)ntohl(reply->root_delay) / 65536.0 + delay / 4294967296.0;
+  rootDispersion = (uint32_t)ntohl(reply->root_dispersion) / 65536.0 + ldexp(1.0, (signed char)reply->precision);
+
+  if (rootDelay / 2 + rootDispersion > L_NTP_UPSTREAM_MAX_DIST)
+    return;
+
+  sample = &u->samples[u->nextSample];
+  sample->timestamp = _ntohTimestamp(&reply->ts_transmit) + delay / 2;
+  sample->micros    = receivedMicros;
+  sample->delay     = delay;
+
+  u->nextSample = (u->nextSample + 1) % L_NTP_UPSTREAM_FILTER;
+
+  if (u->sampleCount < L_NTP_UPSTREAM_FILTER)
+    u->sampleCount++;
+
+  // The sample that was delayed the least has the least error from asymmetry.
+  // Fed once only: without a new best one, the source ages until it does.
+  best = &u->samples[0];
+
+  for (i = 1; i < u->sampleCount; i++)
+  {
+    if (u->samples[i].delay < best->delay)
+      best = &u->samples[i];
+  }
+
+  if (best != sample && s->sampleMicros != 0 && (int64_t)(best->micros - s->sampleMicros) <= 0)
+    return;
+
+  _lockWriter();
+  s->stratum = (unsigned char)reply->stratum + 1;
+  _unlockWriter();
+
+  updateSource(u->source, best->timestamp, best->micros,
+               rootDispersion,
+               __builtin_popcount(u->reach) * L_NTP_QUALITY_MAX / u->queries,
+               (uint32_t)ntohl(reply->root_delay) / 65536.0 + best->delay / 4294967296.0);
+}
+
+#else
+
+int NTPServer::addSource(const char * /* referenceId */, char /* stratum */, unsigned long /* timeoutMillis */)
+{
+  // Compiled without sources: the reference is set with setReferenceTime()
+  return -1;
+}
+
+int NTPServer::updateSource(int /* source */, t_ntpTimestamp /* refTimestamp */, t_ntpSysClock /* refTimeMicros */, double /* errorSeconds */, int /* quality */, double /* delaySeconds */)
+{
+  return L_NTP_R_ERROR;
+}
+
+int NTPServer::updateSource(int /* source */, struct tm /* refTime */, t_ntpSysClock /* refTimeMicros */, double /* errorSeconds */, int /* quality */)
+{
+  return L_NTP_R_ERROR;
+}
+
+void NTPServer::invalidateSource(int /* source */)
+{
+}
+
+int NTPServer::selectSource()
+{
+  return -1;
+}
+
+int64_t NTPServer::_failOver(t_ntpSysClock /* now */)
+{
+  return -1;
+}
+
+int NTPServer::addUpstreamServer(IPAddress /* address */, uint16_t /* port */, int /* pollSeconds */)
+{
+  return -1;
+}
+
+int NTPServer::getUpstreamReach(int /* source */)
+{
+  return -1;
+}
+
+#endif
+
+void NTPServer::_disciplineClock(t_ntpTimestamp refTimestamp, t_ntpSysClock refTimeMicros)
+{
+  // Frequency-locked loop. Every reference sample is compared against the time
+  // we would have served at that moment (the offset, which feeds the jitter
+  // estimate). Once at least L_NTP_FREQ_INTERVAL has passed since the sample
+  // that started the current measurement, the rate of our clock against the
+  // reference over that span is averaged into the frequency correction.
+
+  t_ntpTimestamp localElapsed;
+  double offset, measured, frequency;
+
+  if (!_clockSynchronizedSinceBoot)
+  {
+    _freqAnchorMicros    = refTimeMicros;
+    _freqAnchorTimestamp = refTimestamp;
+    _updateHoldover();
+    return;
+  }
+
+  offset = (double)(int64_t)(refTimestamp - _timestampAt(refTimeMicros)) / 4294967296.0;
+  _lastOffset = offset;
+
+  if (fabs(offset) > L_NTP_STEP_THRESHOLD)
+  {
+    // The reference jumped (or our prediction is way off): start measuring over
+    _freqAnchorMicros    = refTimeMicros;
+    _freqAnchorTimestamp = refTimestamp;
+    _updateHoldover();
+    return;
+  }
+
+  _jitter += (fabs(offset) - _jitter) / L_NTP_FREQ_AVG;
+
+  if (refTimeMicros - _freqAnchorMicros >= L_NTP_FREQ_INTERVAL)
+  {
+    localElapsed = _microsToNtp(refTimeMicros - _freqAnchorMicros);
+    measured     = (double)(int64_t)(refTimestamp - _freqAnchorTimestamp - localElapsed) / (double)localElapsed;
+
+    if (fabs(measured) <= L_NTP_MAX_FREQ)
+    {
+      frequency = _frequency / L_NTP_FREQ_SCALE;
+
+      if (_frequencyKnown)
+      {
+        _wander   += (fabs(measured - frequency) - _wander) / L_NTP_FREQ_AVG;
+        frequency += (measured - frequency) / L_NTP_FREQ_AVG;
+      }
+      else
+      {
+        frequency = measured;
+        _frequencyKnown = true;
+      }
+
+      _frequency = (int32_t)lround(frequency * L_NTP_FREQ_SCALE);
+    }
+
+    _freqAnchorMicros    = refTimeMicros;
+    _freqAnchorTimestamp = refTimestamp;
+  }
+
+  _updateHoldover();
+}
+
+void NTPServer::_updateHoldover()
+{
+  // Works out how fast our error estimate grows between syncs, and from that how
+  // long we can go without a reference before exceeding the error budget
+
+  double rate   = (_frequencyKnown ? _wander + L_NTP_MIN_WANDER : L_NTP_TOLERANCE);
+  double budget;
+
+  _dispersionRate   = (uint32_t)(rate * L_NTP_FREQ_SCALE);
+  _dispersionAtSync = _rootDispersion + (uint32_t)(_jitter * 65536.0);
+
+  budget = _maxTimeError - _dispersionAtSync / 65536.0;
+
+  _maxTimeBetweenUpdates = (budget > 0 ? (t_ntpSysClock)(budget / rate * 1000000.0) : 0);
+
+  if (_maxTimeBetweenUpdates > L_NTP_MAX_HOLDOVER)
+    _maxTimeBetweenUpdates = L_NTP_MAX_HOLDOVER;
+}
+
+uint32_t NTPServer::_rootDispersionAt(t_ntpSysClock sysClock) const
+{
+  S_NTP_REFERENCE ref;
+
+  _readReference(&ref, false);
+
+  return _rootDispersionAt(&ref, sysClock);
+}
+
+uint32_t NTPServer::_rootDispersionAt(const S_NTP_REFERENCE *ref, t_ntpSysClock sysClock)
+{
+  // Dispersion at the last sync, plus the worst case drift since then
+  int64_t  age  = (int64_t)(sysClock - ref->micros);
+  uint64_t disp = ref->dispersionAtSync + (age > 0 ? ((uint64_t)age * ref->dispersionRate) >> 36 : 0);
+
+  return (disp > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)disp);
+}
+
+double NTPServer::getFrequencyOffset()
+{
+  return _frequency / L_NTP_FREQ_SCALE * 1e6;
+}
+
+double NTPServer::getEstimatedError()
+{
+  return _rootDispersionAt(micros64()) / 65536.0;
+}
+
+int NTPServer::getCurrentTime(struct tm *outTime, t_ntpSysClock *outMilliseconds)
+{
+  return _civilTimeAt(micros64(), outTime, outMilliseconds);
+}
+
+int NTPServer::_civilTimeAt(t_ntpSysClock sysClock, struct tm *outTime, t_ntpSysClock *outMilliseconds)
+{
+  // Converts the served time at a given system clock value to UTC calendar
+  // time. Takes the same time regardless of how long ago the last sync was.
+
+  S_NTP_REFERENCE ref;
+  t_ntpTimestamp elapsed;
+
+  _readReference(&ref, false);
+
+  if (!_isSynchronizedAt(&ref, sysClock))
+  {
+    // The last reference time, if there was one
+    if (ref.synchronizedSinceBoot)
+      _civilFromSeconds(_unixSeconds(ref.timestamp), outTime);
+    else
+      memset(outTime, 0, sizeof(*outTime));
+
+    return L_NTP_R_NOT_SYNCHED;
+  }
+
+  // Elapsed time since the (whole second of the) reference, corrected for the rate of our clock
+  elapsed = _timestampAt(&ref, sysClock) - (ref.timestamp & 0xFFFFFFFF00000000ULL);
+
+  _civilFromSeconds(_unixSeconds(ref.timestamp) + (int64_t)(elapsed >> 32), outTime);
+  *outMilliseconds = ((elapsed & 0xFFFFFFFF) * 1000) >> 32;
+
+  return L_NTP_R_SUCCESS;
+}
+
+int64_t NTPServer::_daysFromCivil(int64_t year, int month, int day)
+{
+  // Counts days in 400-year eras that start on March 1st, which puts the leap
+  // day at the end of each year (H. Hinnant, "chrono-Compatible Low-Level Date
+  // Algorithms"). month is 1..12.
+
+  int64_t era;
+  int64_t yoe, doy, doe;
+
+  year -= (month <= 2);
+  era   = (year >= 0 ? year : year - 399) / 400;
+  yoe   = year - era * 400;                                        // [0, 399]
+  doy   = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;  // [0, 365]
+  doe   = yoe * 365 + yoe / 4 - yoe / 100 + doy;                   // [0, 146096]
+
+  return era * 146097 + doe - 719468;
+}
+
+int64_t NTPServer::_secondsFromCivil(const struct tm *civil)
+{
+  // Out of range fields carry over, as with mktime()
+
+  int64_t year  = (int64_t)civil->tm_year + 1900;
+  int64_t month = civil->tm_mon;
+
+  year  += (month >= 0 ? month / 12 : (month - 11) / 12);
+  month -= (month >= 0 ? month / 12 : (month - 11) / 12) * 12;
+
+  return _daysFromCivil(year, (int)month + 1, 1) * 86400 +
+         (int64_t)(civil->tm_mday - 1) * 86400 +
+         (int64_t)civil->tm_hour * 3600 +
+         (int64_t)civil->tm_min * 60 +
+         civil->tm_sec;
+}
+
+int64_t NTPServer::_unixSeconds(t_ntpTimestamp ts)
+{
+  int64_t seconds = (int64_t)(uint32_t)(ts >> 32) - L_NTP_EPOCH;
+
+  return (seconds < 0 ? seconds + 0x100000000LL : seconds);   // NTP era 1, from 2036 on
+}
+
+void NTPServer::_civilFromSeconds(int64_t seconds, struct tm *civil)
+{
+  // Inverse of _daysFromCivil(), see there
+
+  int64_t days = (seconds >= 0 ? seconds : seconds - 86399) / 86400;
+  int64_t secs = seconds - days * 86400;
+  int64_t z, era, doe, yoe, doy, mp, year;
+  int     month;
+
+  z    = days + 719468;
+  era  = (z >= 0 ? z : z - 146096) / 146097;
+  doe  = z - era * 146097;                                         // [0, 146096]
+  yoe  = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;    // [0, 399]
+  doy  = doe - (yoe * 365 + yoe / 4 - yoe / 100);                  // [0, 365]
+  mp   = (5 * doy + 2) / 153;                                      // [0, 11], March based
+  month = (int)(mp < 10 ? mp + 3 : mp - 9);
+  year = yoe + era * 400 + (month <= 2);
+
+  memset(civil, 0, sizeof(*civil));
+
+  civil->tm_year = (int)(year - 1900);
+  civil->tm_mon  = month - 1;
+  civil->tm_mday = (int)(doy - (153 * mp + 2) / 5 + 1);
+  civil->tm_hour = (int)(secs / 3600);
+  civil->tm_min  = (int)(secs / 60 % 60);
+  civil->tm_sec  = (int)(secs % 60);
+  civil->tm_wday = (int)((days % 7 + 11) % 7);                     // 1970-01-01 was a Thursday
+  civil->tm_yday = (int)(days - _daysFromCivil(year, 1, 1));
+}
+
+bool NTPServer::isClockSynchronized()
+{
+  return _isSynchronizedAt(micros64());
+}
+
+bool NTPServer::_isSynchronizedAt(t_ntpSysClock sysClock) const
+{
+  S_NTP_REFERENCE ref;
+
+  _readReference(&ref, false);
+
+  return _isSynchronizedAt(&ref, sysClock);
+}
+
+bool NTPServer::_isSynchronizedAt(const S_NTP_REFERENCE *ref, t_ntpSysClock sysClock)
+{
+  // Synchronized until the holdover runs out, which readers work out for
+  // themselves: nothing has to flag a stale reference
+  int64_t age = (int64_t)(sysClock - ref->micros);
+
+  return ref->synchronized && (age <= 0 || (t_ntpSysClock)age <= ref->holdoverMicros);
+}
+
+void NTPServer::setClockSource(const NTPServer *source)
+{
+  _clock = (source != NULL ? source : this);
+}
+
+unsigned short NTPServer::getSuccessfulRequests(bool resetCounter)
+{
+  unsigned short req = _requestsSucceeded;
 
   if (resetCounter)
     _requestsSucceeded = 0;
@@ -520,12 +3526,69 @@ unsigned short NTPServer::getSuccessfulRequests(bool resetCounter)
 
 unsigned short NTPServer::getFailedRequests(bool resetCounter)
 {
-  static unsigned short req;
-
-  req = _requestsFailed;
+  unsigned short req = _requestsFailed;
 
   if (resetCounter)
     _requestsFailed = 0;
   
   return req;
 }
+
+unsigned long NTPServer::getThrottledRequests(bool resetCounter)
+{
+  unsigned long req = _requestsThrottled;
+
+  if (resetCounter)
+    _requestsThrottled = 0;
+
+  return req;
+}
+
+/**
+  * getRequestCount
+  *
+  * Returns the number of requests that were serviced (L_NTP_STAT_SERVED), or
+  * rejected for the given reason (L_NTP_MISSING_DATA, L_NTP_THROTTLED, ...),
+  * since start or the last resetStatistics().
+  */
+uint64_t NTPServer::getRequestCount(int outcome) const
+{
+#if L_NTP_STATISTICS
+  if (outcome == L_NTP_STAT_SERVED)
+    return _requestCounts[L_NTP_STAT_SERVED];
+
+  if (outcome >= L_NTP_UNSUPPORTED_VERSION && outcome <= L_NTP_LAST_REASON)
+    return _requestCounts[outcome - L_NTP_UNSUPPORTED_VERSION + 1];
+#else
+  (void)outcome;
+#endif
+
+  return 0;
+}
+
+void NTPServer::getProcessingHistogram(uint32_t *buckets) const
+{
+#if L_NTP_STATISTICS
+  memcpy(buckets, _processingHistogram, sizeof(_processingHistogram));
+#else
+  memset(buckets, 0, sizeof(uint32_t) * L_NTP_HIST_BUCKETS);
+#endif
+}
+
+void NTPServer::getUpdateIntervalHistogram(uint32_t *buckets) const
+{
+#if L_NTP_STATISTICS
+  memcpy(buckets, _updateHistogram, sizeof(_updateHistogram));
+#else
+  memset(buckets, 0, sizeof(uint32_t) * L_NTP_HIST_BUCKETS);
+#endif
+}
+
+void NTPServer::resetStatistics()
+{
+#if L_NTP_STATISTICS
+  memset(_requestCounts, 0, sizeof(_requestCounts));
+  memset(_processingHistogram, 0, sizeof(_processingHistogram));
+  memset(_updateHistogram, 0, sizeof(_updateHistogram));
+#endif
+}
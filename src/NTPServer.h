@@ -3,25 +3,110 @@
 /*
   NTPServer.h
 
-  Implements a single-threaded NTP Server. The server will support control packets
-  (specifically, only "read variable") if the onReadVariableCallback function is
-  hooked into by the client.
+  Implements an NTP Server, with optional symmetric key and NTS
+  authentication of client requests. The server answers control (mode 6)
+  read/write variable requests from a registry of built-in system variables and
+  variables added through addVariable(), falling back to the onReadVariableCallback
+  function for names it does not know.
+
+  An instance keeps all of its working state (packet buffer, counters) in members,
+  so several instances may service requests on separate threads. Such workers can
+  serve one shared reference clock through setClockSource(); PosixNTPServerPool
+  runs one per SO_REUSEPORT socket this way on the host.
+
+  The request path reads the reference time from a snapshot published as a
+  seqlock latch: setters serialise on a writer flag and fill one of two copies
+  while readers use the other, retrying if the sequence moved on meanwhile, so
+  readers never take a lock or wait for a writer. The reference may thus be set
+  from another thread than the ones answering requests, and a PPS edge may be
+  captured in an interrupt handler (capturePpsEdge(), then publishReferenceTime()
+  once the time is decoded).
 
   Revision History
   Version    Date        Author           Description
   ---------  ----------  ---------------  -----------------------------------------
   1.0.0      9/15/2022   J. Heaton        Initial library release
-
-  TODO:
-    - implement setting of variables
-    - implement auto de-synch
-    - implement traffic throttling
 */
 
+#ifdef ARDUINO
+#include <Arduino.h>         /* IRAM_ATTR on the ESP8266 */
 #include <Udp.h>
+#else
+#include "NTPHostCompat.h"   /* Host build (see extras/host) */
+#endif
+
+#include "NTPCrypto.h"
+#include "NTPNts.h"
+
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 
+/* Features. Each can be turned on or off with a build flag (e.g.
+   -DL_NTP_CONTROL=0 in PlatformIO's build_flags); one that is off saves the
+   flash of its code and the RAM of the state that goes with it. The API stays,
+   with the enable/add methods failing and the statistics reading 0. The first
+   four are on everywhere, the rest only on the host: on the Arduino, a server
+   that needs them has to ask (e.g. -DL_NTP_AUTH=1). */
+#ifdef ARDUINO
+#define L_NTP_ON_HOST           0
+#else
+#define L_NTP_ON_HOST           1
+#endif
+
+#ifndef L_NTP_CONTROL
+#define L_NTP_CONTROL           1   /* Control (mode 6) requests and the variable registry */
+#endif
+
+#ifndef L_NTP_STATISTICS
+#define L_NTP_STATISTICS        1   /* Counts by outcome and the latency histograms */
+#endif
+
+#ifndef L_NTP_THROTTLING
+#define L_NTP_THROTTLING        1   /* Per-client rate limiting */
+#endif
+
+#ifndef L_NTP_CAPTURE
+#define L_NTP_CAPTURE           1   /* Ring of received datagrams, written out as pcap */
+#endif
+
+#ifndef L_NTP_AUTH
+#define L_NTP_AUTH              L_NTP_ON_HOST   /* Symmetric key authentication (addKey) */
+#endif
+
+#ifndef L_NTP_NTS
+#define L_NTP_NTS               L_NTP_ON_HOST   /* Network Time Security (enableNts) */
+#endif
+
+#ifndef L_NTP_SOURCES
+#define L_NTP_SOURCES           L_NTP_ON_HOST   /* Reference source selection (addSource) and upstream servers */
+#endif
+
+#ifndef L_NTP_INTERLEAVE
+#define L_NTP_INTERLEAVE        L_NTP_ON_HOST   /* Interleaved mode (enableInterleaved) */
+#endif
+
+/* Transport. Listeners are UDP objects, called through the UDP vtable. A build
+   that only ever uses one UDP class can name it (and the header declaring it),
+   e.g. -DL_NTP_TRANSPORT=WiFiUDP -DL_NTP_TRANSPORT_HEADER='<WiFiUdp.h>', and
+   the calls on the request path are then bound to it at compile time. */
+#ifdef L_NTP_TRANSPORT
+#ifdef L_NTP_TRANSPORT_HEADER
+#include L_NTP_TRANSPORT_HEADER
+#endif
+#define L_NTP_TRANSPORT_CALL(fn)  L_NTP_TRANSPORT::fn
+#else
+#define L_NTP_TRANSPORT           UDP
+#define L_NTP_TRANSPORT_CALL(fn)  fn
+#endif
+
+/* Interrupt handlers, and everything they call, have to be in IRAM on the
+   ESP8266: flash cannot be read while it is being written */
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
 /* Tracing Levels */
 #define TL_NTP_ERROR            0
 #define TL_NTP_WARN             1
@@ -41,6 +126,10 @@
 #define L_NTP_BAD_REQUEST          103
 #define L_NTP_NOT_IMPLEMENTED      104
 #define L_NTP_BAD_VARIABLENAME     105
+#define L_NTP_NOT_PERMITTED        106
+#define L_NTP_THROTTLED            107
+#define L_NTP_BAD_AUTH             108
+#define L_NTP_LAST_REASON          L_NTP_BAD_AUTH
 
 /* Reject Reasons */
 
@@ -53,6 +142,7 @@
 #define L_NTP_VERSION                3   /* Server version to identify as in replies */
 #define L_NTP_MIN_VER                3   /* Minimum packet version # to accept */
 #define L_NTP_MAX_VER                4   /* Maximum packet version # to accept */
+#define L_NTP_MIN_CTL_VER            1   /* Minimum control packet version # to accept (ntpq sends 2) */
 
 /* NTP Modes */
 #define L_NTP_MODE_CLIENT            3
@@ -61,7 +151,24 @@
 #define L_NTP_MODE_CONTROL           6
 
 /* NTP Control Opcodes */
+#define L_NTP_CTL_READSTAT           1   /* Read Status */
 #define L_NTP_CTL_READVAR            2   /* Read System or Peer Variables */
+#define L_NTP_CTL_WRITEVAR           3   /* Write System or Peer Variables */
+
+/* NTP Control Error Codes (sent in the high byte of the status word) */
+#define L_NTP_CERR_UNSPEC            0
+#define L_NTP_CERR_PERMISSION        1
+#define L_NTP_CERR_BADFMT            2
+#define L_NTP_CERR_BADOP             3
+#define L_NTP_CERR_BADASSOC          4
+#define L_NTP_CERR_UNKNOWNVAR        5
+#define L_NTP_CERR_BADVALUE          6
+
+/* NTP Control Variables */
+#define L_NTP_CTL_MAX_DATA         468   /* Max data bytes per response fragment (as ntpd) */
+#define L_NTP_CTL_MAX_VALUE        256   /* Max length of a single variable value */
+#define L_NTP_MAX_VARIABLES         16   /* Max number of variables added through addVariable() */
+#define L_NTP_LIBRARY_VERSION  "NTPServer 1.0.0"
 
 /* NTP Stratums */
 #define L_NTP_STRAT_UNSPECIFIED      0
@@ -70,8 +177,74 @@
 #define L_NTP_STRAT_UNSYNCHRONIZED  16
 
 #define L_NTP_EPOCH       2208988800UL
+#define L_NTP_PORT                 123
+#define L_NTP_MAX_LISTENERS          8  /* Sockets served by one instance, see addListener() */
 
+#if defined(ARDUINO) && L_NTP_CONTROL
 #define L_NTP_MAX_RX_BUFF          500  /* Max receive buffuer size, bytes */
+#elif defined(ARDUINO)
+#define L_NTP_MAX_RX_BUFF          256  /* Without control requests: client requests with a MAC, or NTS with one cookie */
+#else
+#define L_NTP_MAX_RX_BUFF         1024  /* Host: room for NTS requests asking for several cookies */
+#endif
+
+/* NTS cookies per reply: as many as a reply of L_NTP_MAX_RX_BUFF bytes can hold next to
+   the header, the shortest unique identifier and the authenticator (1 at 256, 3 at 500) */
+#define L_NTP_NTS_REPLY_COOKIES_FIT  ((L_NTP_MAX_RX_BUFF - (int)sizeof(S_NTP_PACKET) - 4 - L_NTP_NTS_MIN_UID - 8 - L_NTP_NTS_NONCE - L_NTP_AES_BLOCK) / (4 + L_NTP_NTS_COOKIE))
+#define L_NTP_NTS_REPLY_COOKIES      (L_NTP_NTS_REPLY_COOKIES_FIT < L_NTP_NTS_MAX_COOKIES ? L_NTP_NTS_REPLY_COOKIES_FIT : L_NTP_NTS_MAX_COOKIES)
+
+/* Traffic Throttling */
+#define L_NTP_THROTTLE_WAYS          4  /* Client table entries per bucket (one cache line) */
+#define L_NTP_KOD_RATE          "RATE"  /* Kiss code sent to clients over their rate limit */
+
+/* Interleaved Mode */
+#define L_NTP_INTERLEAVE_WAYS        4  /* Client table entries per bucket */
+
+/* Symmetric Key Authentication */
+#define L_NTP_KEY_SHA1               1   /* MAC = SHA-1(key || packet), as ntpd "SHA1" keys */
+#define L_NTP_KEY_AES128CMAC         2   /* MAC = AES-CMAC(key, packet), as ntpd "AES128CMAC" keys */
+#define L_NTP_MAX_KEYS               8   /* Max number of keys added through addKey() */
+#define L_NTP_MAX_MAC               24   /* Longest key ID + digest trailer, bytes */
+#define L_NTP_MIN_EXT_FIELD         16   /* Shortest extension field, bytes */
+
+/* Clock Discipline */
+#define L_NTP_FREQ_SCALE    4503599627.370496  /* Frequency units per unit of fractional frequency (2^52 / 10^6) */
+#define L_NTP_MAX_FREQ      500e-6     /* Largest frequency error taken as genuine (500 ppm) */
+#define L_NTP_TOLERANCE      15e-6     /* Drift assumed until the frequency has been measured (PHI, RFC 5905) */
+#define L_NTP_MIN_WANDER      1e-7     /* Floor for the dispersion growth once the frequency is known */
+#define L_NTP_STEP_THRESHOLD  0.128    /* Offsets above this are treated as a step of the reference, s */
+#define L_NTP_FREQ_INTERVAL  16000000  /* Min. time between frequency measurements, us */
+#define L_NTP_FREQ_AVG           4     /* Averaging constant of the frequency loop, in measurements */
+#define L_NTP_MAX_ERROR        1.0     /* Default error budget before declaring unsynched, s */
+#define L_NTP_MAX_HOLDOVER  (1ULL << 41)  /* Holdover limit, us (about 25 days, keeps the rate correction in 64 bits) */
+
+/* Reference Sources */
+#define L_NTP_MAX_SOURCES            4   /* Sources registered through addSource() */
+#define L_NTP_QUALITY_MAX          100   /* Quality of a source working as well as it can, 0 = unusable */
+#define L_NTP_STRATUM_DISTANCE     1.0   /* Distance charged per stratum when ranking sources, s (MAXDIST, RFC 5905) */
+#define L_NTP_SOURCE_HYSTERESIS    0.8   /* Another source must score below this fraction of the selected one to take over */
+
+/* Upstream Servers */
+#define L_NTP_MAX_UPSTREAMS          2   /* Servers queried through addUpstreamServer(), each takes a source */
+#define L_NTP_UPSTREAM_FILTER        8   /* Samples kept per server, the one with the least delay is used */
+#define L_NTP_IBURST_COUNT           4   /* Queries in the burst at start, and at every poll while unreachable */
+#define L_NTP_IBURST_INTERVAL  2000000   /* Between the queries of a burst, us */
+#define L_NTP_UPSTREAM_MAX_POLL     17   /* A server asking us to slow down backs us off up to 2^17 s */
+#define L_NTP_UPSTREAM_MAX_DIST    1.5   /* Root distance above which a sample is not used, s (MAXDIST) */
+#define L_NTP_KOD_DENY          "DENY"   /* Kiss codes that end our queries to a server */
+#define L_NTP_KOD_RSTR          "RSTR"
+
+/* PPS Edges */
+#define L_NTP_PPS_MAX_AGE      1000000   /* A decoded time is paired with an edge at most this old, us */
+
+/* Packet Capture */
+#define L_NTP_PCAP_MAGIC    0xA1B23C4D   /* pcap file with nanosecond timestamps */
+#define L_NTP_PCAP_RAW             101   /* Link type: raw IPv4/IPv6, no link layer header */
+
+/* Statistics */
+#define L_NTP_STAT_SERVED            0   /* Outcome index of serviced requests, followed by one per reject reason */
+#define L_NTP_STAT_OUTCOMES   (L_NTP_LAST_REASON - L_NTP_UNSUPPORTED_VERSION + 2)
+#define L_NTP_HIST_BUCKETS          32   /* Log2 histogram buckets, bucket i counts [2^i, 2^(i+1)) ns */
 
 /* Type Aliases */
 typedef uint64_t      t_ntpTimestamp;   /* Type for 64-bit NTP timestamps */
@@ -84,9 +257,9 @@ typedef uint64_t      t_ntpSysClock;    /* Type for native system clock (micros6
 
 typedef struct s_ntp_header
 {
-  char mode : 3;
-	char vn : 3;
-  char li : 2;
+  unsigned char mode : 3;
+	unsigned char vn : 3;
+  unsigned char li : 2;
 } S_NTP_HEADER;
 
 typedef struct s_ntp_packet
@@ -115,10 +288,10 @@ typedef struct s_ntp_control_packet
 	/* Header */
 	S_NTP_HEADER header;
 
-  char opcode : 5;
-  char more : 1;
-  char error : 1;
-	char response : 1;
+  unsigned char opcode : 5;
+  unsigned char more : 1;
+  unsigned char error : 1;
+	unsigned char response : 1;
   
 	short sequence;
 
@@ -133,6 +306,104 @@ typedef struct s_ntp_control_packet
 
 #pragma pack(pop)
 
+typedef struct s_ntp_control_variable
+{
+  const char *name;
+  const char *value;                              // Static value, or NULL to use the getter
+  int (*getter)(char *lpBuffer, int cbBuffer);
+  int (*setter)(const char *value);               // NULL = read-only
+} S_NTP_CONTROL_VARIABLE;
+
+typedef struct s_ntp_client_entry
+{
+  uint32_t key;            // Hashed client address, 0 = unused
+  uint32_t lastMillis;     // millis() of the client's last request
+  uint32_t credit;         // Token bucket, in milliseconds of request spacing
+  uint32_t reserved;
+} S_NTP_CLIENT_ENTRY;
+
+typedef struct s_ntp_interleave_entry
+{
+  uint32_t       key;      // Hashed client address, 0 = unused
+  uint32_t       lastMillis;
+  t_ntpTimestamp rx;       // Receive timestamp of the client's last request
+  t_ntpTimestamp tx;       // Transmit timestamp of our reply to it, taken once it was sent
+} S_NTP_INTERLEAVE_ENTRY;
+
+typedef struct s_ntp_source
+{
+  char           referenceId[4];   // Served while selected
+  char           stratum;          // Served while selected
+  uint8_t        quality;          // 0..L_NTP_QUALITY_MAX, 0 = unusable
+  t_ntpSysClock  timeoutMicros;    // A sample older than this is stale
+  t_ntpTimestamp timestamp;        // Last sample: reference time...
+  t_ntpSysClock  sampleMicros;     // ...at this micros64(), 0 = no sample yet
+  uint32_t       rootDelay;        // 16.16 seconds, host order
+  uint32_t       rootDispersion;   // Error estimate of the sample, 16.16 seconds
+} S_NTP_SOURCE;
+
+typedef struct s_ntp_upstream_sample
+{
+  t_ntpTimestamp timestamp;      // Server's time...
+  t_ntpSysClock  micros;         // ...at this micros64(), when the reply came in
+  t_ntpTimestamp delay;          // Round trip minus the server's processing, 32.32 seconds
+} S_NTP_UPSTREAM_SAMPLE;
+
+typedef struct s_ntp_upstream
+{
+  IPAddress      address;
+  uint16_t       port;
+  int            source;         // Its entry in the source registry
+  char           poll;           // Poll interval, log2 seconds
+  uint8_t        burst;          // Queries left in the current burst
+  uint8_t        reach;          // Shift register, one bit per query, set when it was answered
+  uint8_t        queries;        // Queries sent, up to 8
+  bool           stopped;        // Told to go away (DENY/RSTR)
+  t_ntpTimestamp origin;         // Transmit timestamp of the query awaiting its reply, 0 = none
+  t_ntpSysClock  sentMicros;
+  t_ntpSysClock  nextMicros;     // When the next query goes out
+  S_NTP_UPSTREAM_SAMPLE samples[L_NTP_UPSTREAM_FILTER];
+  uint8_t        sampleCount;
+  uint8_t        nextSample;
+} S_NTP_UPSTREAM;
+
+typedef struct s_ntp_reference
+{
+  t_ntpTimestamp timestamp;              // Reference time (host order)...
+  t_ntpSysClock  micros;                 // ...at this micros64()
+  t_ntpSysClock  holdoverMicros;         // Synchronized for this long after it
+  int32_t        frequency;              // Rate correction for the local clock, 2^-52 s per us
+  uint32_t       dispersionRate;         // Growth of the root dispersion during holdover, same units
+  uint32_t       dispersionAtSync;       // Root dispersion at the reference, 16.16 seconds
+  uint8_t        synchronized;           // Not invalidated since the reference
+  uint8_t        synchronizedSinceBoot;
+  char           reply[2][offsetof(S_NTP_PACKET, ts_origin)];   // Pre-serialized reply up to the origin timestamp, [0] = unsynchronized, [1] = synchronized
+} S_NTP_REFERENCE;
+
+typedef struct s_ntp_capture_record
+{
+  uint32_t       seq;            // 2 * (n + 1) once it holds the n-th datagram captured, odd while written
+  uint16_t       size;           // Datagram size on the wire
+  uint16_t       length;         // Bytes captured, which follow the record
+  t_ntpTimestamp received;       // Receive timestamp, or the time since boot while unsynchronized
+  uint16_t       port;           // Client's port
+  uint8_t        synchronized;   // Whether received is the time of day
+  uint8_t        addressLength;  // 4 (IPv4) or 16 (IPv6)
+  uint8_t        address[16];    // Client's address, network order
+} S_NTP_CAPTURE_RECORD;
+
+typedef struct s_ntp_key
+{
+  uint32_t keyId;
+  int      type;           // L_NTP_KEY_*
+  int      cbDigest;       // MAC length, without the key ID
+  union
+  {
+    NTPSha1 sha1;          // Digest state with the key already hashed
+    NTPCmac cmac;          // Expanded AES key and CMAC subkeys
+  } state;
+} S_NTP_KEY;
+
 
 
 /* Begin Server Class Definition */
@@ -150,77 +421,366 @@ protected:
 		char                  byteBuffer[L_NTP_MAX_RX_BUFF];
 	} _u_packetBuffer;
 
-	short _packetBufferPtr;                     // Points to next byte location in byteBuffer for next receive call
+	short _packetLength;                        // Number of bytes of the current datagram held in byteBuffer
 
   /* Server State */
-	char _clockIsSynchronized : 1;              // Current synch status
-  char _clockSynchronizedSinceBoot : 1;       // Keeps track of synch status since boot
+	unsigned char _clockIsSynchronized : 1;        // Current synch status
+  unsigned char _clockSynchronizedSinceBoot : 1; // Keeps track of synch status since boot
 
-  t_ntpSysClock _maxTimeBetweenUpdates;       // Maximum time between updates before declaring unsynched
+  t_ntpSysClock _maxTimeBetweenUpdates;       // Holdover time before declaring unsynched (derived from _maxTimeError)
 
   /* NTP Configuration Items */
 	char _stratum;
 	char _maxPollInterval;
 	char _precision;
-	int  _rootDelay;
-	int  _rootDispersion;
+	int  _rootDelay;                            // 16.16 seconds, network order
+	uint32_t _rootDispersion;                   // 16.16 seconds, host order
 	char _referenceId[4];
 
   /* Clock Synch Items */
 	t_ntpSysClock _lastTimeSyncMillis;
 	t_ntpSysClock _referenceTimeMicros;
-	struct tm      _referenceTime;
   time_t         _referenceTimeAsSeconds;
-
-  /* Network Items */
-  UDP *_udp;
+  t_ntpTimestamp _referenceTimestamp;       // Reference time as an NTP timestamp (host order)
+
+  /* Clock Discipline */
+  int32_t        _frequency;                // Rate correction for the local clock, 2^-52 s per us
+  uint32_t       _dispersionRate;           // Growth of the root dispersion during holdover, same units
+  uint32_t       _dispersionAtSync;         // Root dispersion at the last sync, 16.16 seconds
+  bool           _frequencyKnown;
+  double         _wander;                   // Averaged error of the frequency measurements
+  double         _jitter;                   // Averaged offset of the reference from our prediction, s
+  double         _maxTimeError;             // Error budget, s
+  t_ntpSysClock  _freqAnchorMicros;         // Sample that started the current frequency measurement
+  t_ntpTimestamp _freqAnchorTimestamp;
+  double         _lastOffset;               // Offset of the last reference sample from our prediction, s
+
+  /* What the request path reads of all the above, see _publishReference() */
+  S_NTP_REFERENCE _published[2];
+  uint32_t        _publishSeq;              // Low bit = the copy to read
+  bool            _writeLock;               // Held while the reference is being changed
+
+  /* PPS Edges */
+  uint32_t        _ppsSeq;                  // Odd while capturePpsEdge() writes
+  t_ntpSysClock   _ppsMicros;               // Last edge, 0 = none yet
+  t_ntpSysClock   _ppsPublished;            // Edge the last publishReferenceTime() used
+
+  /* Network Items. _udp is the listener being serviced, replies go out through it */
+  L_NTP_TRANSPORT *_udp;
+  L_NTP_TRANSPORT *_listeners[L_NTP_MAX_LISTENERS];
+  int  _listenerCount;
+  int  _listener;                           // Index of _udp in _listeners
+  int  _nextListener;                       // Serviced first by the next update(), so none is starved
+
+  /* Instance whose reference clock and configuration are served (normally this one) */
+  const NTPServer *_clock;
+
+#if L_NTP_THROTTLING
+  /* Traffic Throttling */
+  S_NTP_CLIENT_ENTRY *_clientTable;         // Per-client token buckets (NULL = throttling off)
+  unsigned short      _clientTableBuckets;  // Number of buckets, power of 2
+  unsigned long       _throttleIntervalMillis;
+  unsigned short      _throttleBurst;
+  bool                _throttleKissOfDeath;
+#endif
+
+#if L_NTP_SOURCES
+  /* Reference Sources */
+  S_NTP_SOURCE _sources[L_NTP_MAX_SOURCES];
+  int          _sourceCount;
+  int          _selectedSource;                   // -1 = none usable (holdover on the last one)
+
+  /* Upstream Servers */
+  S_NTP_UPSTREAM _upstreams[L_NTP_MAX_UPSTREAMS];
+  int            _upstreamCount;
+#endif
+
+#if L_NTP_INTERLEAVE
+  /* Interleaved Mode */
+  S_NTP_INTERLEAVE_ENTRY *_interleaveTable;     // Per-client timestamps (NULL = interleaved mode off)
+  unsigned short          _interleaveBuckets;   // Number of buckets, power of 2
+  unsigned long           _interleavedReplies;
+#endif
+
+#if L_NTP_CAPTURE
+  /* Packet Capture */
+  uint8_t      *_captureRing;          // Slots of a record and up to _captureSnapLength bytes (NULL = off)
+  int           _captureSlots;
+  int           _captureSnapLength;
+  int           _captureSlotSize;      // Bytes per slot, a multiple of 8
+  uint32_t      _captureCount;         // Datagrams captured since enableCapture()
+#endif
+
+#if L_NTP_CONTROL
+  /* Control Variables */
+  S_NTP_CONTROL_VARIABLE _variables[L_NTP_MAX_VARIABLES];
+  int                    _variableCount;
+  unsigned short         _controlOffset;    // Response data sent in earlier fragments
+  unsigned short         _controlCount;     // Response data in the current fragment
+  int                    _controlAuth;      // L_NTP_R_SUCCESS if the request has a valid MAC, else why not
+  char                   _controlNames[L_NTP_MAX_RX_BUFF - sizeof(S_NTP_CONTROL_PACKET)];   // READVAR names, as replies are built over the request
+#endif
+
+#if L_NTP_AUTH
+  /* Symmetric Key Authentication */
+  S_NTP_KEY      _keys[L_NTP_MAX_KEYS];
+  int            _keyCount;
+  bool           _authRequired;             // Drop requests without a valid MAC
+#endif
+
+#if L_NTP_NTS
+  /* Network Time Security */
+  uint8_t        _ntsMasterKey[L_NTP_NTS_MASTER_KEY];
+  bool           _ntsEnabled;
+  uint32_t       _ntsGeneration;            // Bumped when the master key changes
+  NTPNtsCookies  _ntsCookies;               // This instance's cookie keys (workers derive their own)
+  uint32_t       _ntsCookiesGeneration;     // _ntsGeneration of the clock source they were derived for
+#endif
+
+  /* Broadcast Mode */
+  IPAddress      _broadcastAddress;
+  unsigned long  _broadcastIntervalSeconds;   // Power of 2, 0 = broadcasting off
+  char           _broadcastPoll;
+  t_ntpSysClock  _nextBroadcastMicros;
+  unsigned long  _broadcastsSent;
 
   /* Stat Counters */
   unsigned short _requestsSucceeded,
                  _requestsFailed;
+  unsigned long  _requestsThrottled;
+
+#if L_NTP_STATISTICS
+  uint64_t _requestCounts[L_NTP_STAT_OUTCOMES];          // By outcome, never wrap or reset
+  uint32_t _processingHistogram[L_NTP_HIST_BUCKETS];     // Receive to transmit
+  uint32_t _updateHistogram[L_NTP_HIST_BUCKETS];         // Between update() calls
+  uint64_t _lastUpdateNanos;
+#endif
 
 	/* Wrappers for arduino calls */
-	int _recv(int cbExpectedBytes);         // Read next N bytes from input stream into tcp buffer
+	int _recv();                            // Read next datagram into the packet buffer, returns its size
 	int _send(int cbPacketSize);            // Send out first N bytes from the tcp buffer
+	int _sendTo(IPAddress ip, uint16_t port, int cbPacketSize);
   int _close(int reason);                 // Closes out current receive
+  void _served();                         // Counts a serviced request
+#if L_NTP_STATISTICS
+  static void _record(uint32_t *histogram, uint64_t nanos);
+#endif
   
-	void _timestamp(struct timeval *tv);       // Snapshot current timestamp
-  void _htonTimestamp(const struct timeval tv, t_ntpTimestamp *dest); // Copy timestamp into network packet format
+	t_ntpTimestamp _timestamp();                            // Snapshot current timestamp
+	t_ntpTimestamp _timestampAt(t_ntpSysClock sysClock);    // Timestamp for a given system clock value
+  static t_ntpTimestamp _timestampAt(const S_NTP_REFERENCE *ref, t_ntpSysClock sysClock);
+  void _htonTimestamp(const t_ntpTimestamp ts, t_ntpTimestamp *dest); // Copy timestamp into network packet format
+  t_ntpTimestamp _ntohTimestamp(const t_ntpTimestamp *src);            // And back
+
+  static t_ntpTimestamp _microsToNtp(uint64_t micros);    // Duration to 32.32 fixed point seconds
+  static t_ntpTimestamp _nanosToNtp(uint64_t nanos);
   void _ntohs(short *v);
 
-	void _handleRequest(const struct timeval tvReceived);
+  int  _civilTimeAt(t_ntpSysClock sysClock, struct tm *outTime, t_ntpSysClock *outMilliseconds);
+  static int64_t _daysFromCivil(int64_t year, int month, int day);   // Days since 1970-01-01 (proleptic Gregorian)
+  static int64_t _secondsFromCivil(const struct tm *civil);           // UTC, like timegm()
+  static void    _civilFromSeconds(int64_t seconds, struct tm *civil); // UTC, like gmtime_r()
+  static int64_t _unixSeconds(t_ntpTimestamp ts);                      // Whole seconds of an NTP timestamp since 1970
+
+  bool _isSynchronizedAt(t_ntpSysClock sysClock) const;
+  uint32_t _rootDispersionAt(t_ntpSysClock sysClock) const;   // 16.16 seconds
+  static bool _isSynchronizedAt(const S_NTP_REFERENCE *ref, t_ntpSysClock sysClock);
+  static uint32_t _rootDispersionAt(const S_NTP_REFERENCE *ref, t_ntpSysClock sysClock);
+
+  void _publishReference();                                    // After any change to the reference or the configuration
+  void _readReference(S_NTP_REFERENCE *ref, bool withReply) const;   // Lock-free, never waits for a writer
+
+  /* Writers of the reference (the thread feeding it, update() failing over) take turns */
+  void _lockWriter()    { while (__atomic_test_and_set(&_writeLock, __ATOMIC_ACQUIRE)) ; }
+  bool _tryLockWriter() { return !__atomic_test_and_set(&_writeLock, __ATOMIC_ACQUIRE); }
+  void _unlockWriter()  { __atomic_clear(&_writeLock, __ATOMIC_RELEASE); }
+
+  void _disciplineClock(t_ntpTimestamp refTimestamp, t_ntpSysClock refTimeMicros);
+  void _updateHoldover();
+  void _setReference(t_ntpTimestamp refTimestamp, t_ntpSysClock refTimeMicros);
+
+  int64_t _failOver(t_ntpSysClock now);                            // Returns us until the selected source times out, -1 = none
+#if L_NTP_SOURCES
+  bool   _sourceUsable(int source, t_ntpSysClock now) const;
+  double _sourceDistance(int source, t_ntpSysClock now) const;   // Root distance of its last sample, s
+  int    _selectSource(t_ntpSysClock now);
+  void   _feedSource(int source);                                  // Serves the selected source's last sample
+  t_ntpTimestamp _combineSources(int source);
+
+  void _pollUpstreams(t_ntpSysClock now);                          // Sends the queries that are due
+  void _sendUpstreamQuery(S_NTP_UPSTREAM *u);
+  int  _handleUpstreamReply(t_ntpSysClock receivedMicros);
+  void _feedUpstream(S_NTP_UPSTREAM *u, const S_NTP_PACKET *reply, t_ntpSysClock receivedMicros);
+#endif
+
+	int  _processPacket();                  // Receives and services a single datagram
+	int  _classify(int cbPacket);           // Early drop: L_NTP_R_SUCCESS for a serviceable request, else the reason
+	void _handleRequest(const t_ntpTimestamp tsReceived, int cbPacket);
+	int  _authenticate(int cbPacket, const S_NTP_KEY **outKey);   // Checks the MAC trailer of a client request
+#if L_NTP_AUTH
+	const S_NTP_KEY *_findKey(uint32_t keyId) const;
+	static void _computeMac(const S_NTP_KEY *key, const void *data, int cbData, uint8_t *mac);
+#endif
+#if L_NTP_NTS
+	bool _isNtsRequest(int cbPacket);
+	void _handleNtsRequest(const t_ntpTimestamp tsReceived, int cbPacket);
+#endif
+#if L_NTP_CONTROL
 	void _handleControlRequest();
-
+	int  _authenticateControl(int cbPacket);   // Checks the MAC trailer of a control request
+	void _readVariables(char *request);
+	void _writeVariables(char *request);
+	int  _readVariable(const char *name, char *lpBuffer, int cbBuffer);
+	int  _readSystemVariable(int index, char *lpBuffer, int cbBuffer);
+	void _appendControlData(const char *name, const char *value);
+	void _sendControlFragment(bool more);
+	void _sendControlError(int errorCode);
+	unsigned short _systemStatus();
+	static char *_nextControlItem(char **cursor, char **value);
+	static void _formatHistogram(const uint32_t *histogram, char *lpBuffer, int cbBuffer);
+#endif
+	void _prepareResponse(t_ntpSysClock sysClock);   // Header fields of a reply, from the published reference
+	S_NTP_INTERLEAVE_ENTRY *_setTimestamps(const t_ntpTimestamp tsReceived);   // Header and timestamps of a reply
+	void _transmitted(S_NTP_INTERLEAVE_ENTRY *entry, const t_ntpTimestamp tsReceived);
+	void _sendBroadcast();
+#if L_NTP_CAPTURE
+	void _capture(int cbPacket);            // Copies the datagram in the packet buffer to the ring
+	int  _writeCaptureRecords(Print &out);
+#endif
+
+	uint32_t _clientKey(IPAddress ip);
+#if L_NTP_THROTTLING
+	bool _admitClient();                    // Charges the sender's token bucket, false if over its limit
+#endif
+#if L_NTP_INTERLEAVE
+	S_NTP_INTERLEAVE_ENTRY *_interleaveEntry();   // The sender's timestamps, a fresh entry for a new client
+#endif
+	void _sendKissOfDeath(const char *code, int cbPacket = sizeof(S_NTP_PACKET));   // Sends the first cbPacket bytes
+
+	/* Transport hooks, overridden by transports that can do better than one datagram at a time */
+	virtual void _beginBatch(int /* maxPackets */) { }    // Called before draining up to maxPackets datagrams
+	virtual void _endBatch() { }                          // Called once the batch has been serviced
+	virtual t_ntpTimestamp _receiveTimestamp();          // Receive time of the current datagram
+	virtual t_ntpSysClock  _receiveMicros() { return micros64(); }   // The same, as a micros64() value
+	virtual t_ntpTimestamp _transmitTimestamp(S_NTP_INTERLEAVE_ENTRY * /* entry */) { return _timestamp(); }   // Just after _send()
+
+	volatile bool _interrupted;             // Set by interrupt(), consumed by poll()
+	int  _update(uint32_t listeners, int maxPackets);   // Services the listeners in the bit mask
+	int  _service(int listener, int maxPackets);
+	int  _pollTimeout(int timeoutMs);       // Shortened so that poll() returns in time for the next broadcast or query
+
+#if L_NTP_CONTROL
   int (*onReadVariableCallback)(const char *var, char *lpBuffer, int cbBuffer);
+#endif
+
+  // log2, truncated toward zero like (int)(log(value) / log(2)), but without
+  // libm and at compile time for a constant
+  static constexpr int _log2(double value)
+  {
+    return (value >= 2 ? 1 + _log2(value / 2) : (value > 0 && value <= 0.5 ? _log2(value * 2) - 1 : 0));
+  }
 
 public:
 	NTPServer();
+	virtual ~NTPServer();
   NTPServer(const char *referenceId, const char stratum);
 
-  int begin(UDP &udp);
-  void end();
+  int begin(L_NTP_TRANSPORT &udp);
+  int addListener(L_NTP_TRANSPORT &udp);              // Serves another socket (IPv6, another interface) after begin()
+  virtual void end();
 
 	void setStratum(char stratum);
 	void setMaxPollInterval(int pollIntervalSeconds);
 	void setServerPrecision(double precisionInSeconds);
 	void setRootDelay(double delayInSeconds);
 	void setRootDispersion(double dispersionInSeconds);
+	void setMaxTimeError(double errorInSeconds);
 	int  setReferenceId(const char * referenceId);
 
 	void setReferenceTime(struct tm refTime);
 	void setReferenceTime(struct tm refTime, t_ntpSysClock refTimeMillis);
+
+  void capturePpsEdge();                          // Safe from an interrupt handler (IRAM_ATTR where defined)
+  void capturePpsEdge(t_ntpSysClock edgeMicros);  // E.g. from a timer's input capture
+  t_ntpSysClock getPpsEdge();                     // Last captured edge, 0 = none
+  int  publishReferenceTime(struct tm refTime);   // The time of the second that began at the last edge
+
+  int  addSource(const char *referenceId, char stratum, unsigned long timeoutMillis = 0);   // Returns the source, -1 if full
+  int  updateSource(int source, t_ntpTimestamp refTimestamp, t_ntpSysClock refTimeMicros, double errorSeconds, int quality, double delaySeconds = 0);
+  int  updateSource(int source, struct tm refTime, t_ntpSysClock refTimeMicros, double errorSeconds, int quality);
+  void invalidateSource(int source);      // E.g. the GPS lost its fix: fails over right away
+  int  selectSource();                    // Re-runs the selection, returns the selected source (-1 = none)
+  int  getSelectedSource()
+  {
+#if L_NTP_SOURCES
+    return _selectedSource;
+#else
+    return -1;
+#endif
+  }
+
+  virtual int addUpstreamServer(IPAddress address, uint16_t port = L_NTP_PORT, int pollSeconds = 64);   // Returns its source, -1 if full
+  int  getUpstreamReach(int source);      // Last 8 queries to the server of this source, one bit each (1 = answered), -1 if none
   unsigned long getElapsedTimeSinceSync();
 
 	int  getCurrentTime(struct tm *outTime, t_ntpSysClock *outMilliseconds);
 
   bool isClockSynchronized();
+  double getFrequencyOffset();    // Measured rate error of the local clock, ppm
+  double getEstimatedError();     // Current root dispersion, seconds
 	void invalidateTimeSynch();
 
+  void setClockSource(const NTPServer *source); // Serve the clock of another instance (NULL = our own)
+
+  virtual int enableBroadcast(IPAddress address, int intervalSeconds = 0);   // 0 = max poll interval
+  void disableBroadcast();
+  unsigned long getBroadcastsSent();
+
+  int  addKey(uint32_t keyId, int keyType, const uint8_t *key, int cbKey);   // Derives the per-key state once
+  void removeAllKeys();
+  void setAuthenticationRequired(bool required);
+
+  int  enableNts(const uint8_t *masterKey, int cbKey);   // Accepts cookies sealed with this key (see PosixNTSKEServer)
+  void disableNts();
+
+  int  enableThrottling(int tableEntries, unsigned long minIntervalMillis, int burst, bool kissOfDeath);
+  void disableThrottling();
+
+  int  enableInterleaved(int tableEntries);
+  void disableInterleaved();
+  virtual unsigned long getInterleavedReplies();   // Replies that carried the transmit time of an earlier one
+
+  virtual int  enableCapture(int packets, int snapLength = L_NTP_MAX_RX_BUFF);   // Keeps the last `packets` datagrams
+  virtual void disableCapture();
+  virtual unsigned long getCapturedPackets();
+  virtual int  writeCapture(Print &out, bool fileHeader = true);   // As pcap, returns # datagrams written
+
 	void update(); // Checks for requests and services them, if need be
+	int  update(int maxPackets); // Services up to maxPackets queued requests in one call, returns # consumed
+
+	virtual int poll(int timeoutMs, int maxPackets = 1);   // Waits for a request (1 ms poll, epoll in PosixNTPServer), then services it (-1 = no timeout)
+	void run(int maxPackets = 1);                          // Serves requests until interrupt()
+	virtual void interrupt();                              // Wakes poll()/run() up, safe from another thread or a signal
+
+  virtual unsigned short getSuccessfulRequests(bool resetCounter);
+  virtual unsigned short getFailedRequests(bool resetCounter);
+  virtual unsigned long getThrottledRequests(bool resetCounter);
+
+  virtual uint64_t getRequestCount(int outcome) const;                 // L_NTP_STAT_SERVED or a reject reason
+  virtual void getProcessingHistogram(uint32_t *buckets) const;        // Fills L_NTP_HIST_BUCKETS counts
+  virtual void getUpdateIntervalHistogram(uint32_t *buckets) const;
+  virtual void resetStatistics();
 
-  unsigned short getSuccessfulRequests(bool resetCounter);
-  unsigned short getFailedRequests(bool resetCounter);
+  int addVariable(const char *name, const char *value);   // Static value (pointers must stay valid)
+  int addVariable(const char *name, int (*getter)(char *lpBuffer, int cbBuffer), int (*setter)(const char *value) = NULL);
 
   /* Event Hooks */
-  void onReadVariable(int (*fn)(const char *var, char *lpBuffer, int cbBuffer)) { onReadVariableCallback = fn; } 
+  void onReadVariable(int (*fn)(const char *var, char *lpBuffer, int cbBuffer))
+  {
+#if L_NTP_CONTROL
+    onReadVariableCallback = fn;
+#else
+    (void)fn;
+#endif
+  }
 };
@@ -0,0 +1,297 @@
+#ifndef ARDUINO
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "PosixNTPServer.h"
+
+#define L_NTP_WAKE_EVENT   L_NTP_MAX_LISTENERS   /* epoll tag of the wakeup pipe, listeners are tagged by index */
+
+void PosixNTPServer::_init()
+{
+  memset(_sockets, 0, sizeof(_sockets));
+  _socketCount  = 0;
+  _addressCount = 0;
+  _reusePort    = false;
+  _pollFd       = -1;
+  _wakeFds[0]   = -1;
+  _wakeFds[1]   = -1;
+}
+
+int PosixNTPServer::addListenAddress(IPAddress address)
+{
+  if (_addressCount >= L_NTP_MAX_LISTENERS)
+    return L_NTP_R_ERROR;
+
+  _addresses[_addressCount++] = address;
+
+  return L_NTP_R_SUCCESS;
+}
+
+int PosixNTPServer::begin(int portNum)
+{
+  // All sockets or none: a listen address that cannot be bound fails begin()
+
+  S_NTP_POSIX_LISTENER *listener;
+  int count = (_addressCount > 0 ? _addressCount : 1);
+  int i;
+
+  end();
+
+  for (i = 0; i < count; i++)
+  {
+    listener = new S_NTP_POSIX_LISTENER;
+    memset(listener->txPending, 0, sizeof(listener->txPending));
+
+    _sockets[_socketCount++] = listener;
+
+    listener->socket.setReusePort(_reusePort);
+#if L_NTP_INTERLEAVE
+    listener->socket.setTxTimestamps(_interleaveTable != NULL);
+#endif
+
+    if (!listener->socket.begin(_addressCount > 0 ? _addresses[i] : IPAddress(), portNum))
+    {
+      end();
+      return L_NTP_R_ERROR;
+    }
+
+    if (i == 0)
+      NTPServer::begin(listener->socket);
+    else
+      addListener(listener->socket);
+  }
+
+  if (_openPoll() != L_NTP_R_SUCCESS)
+  {
+    end();
+    return L_NTP_R_ERROR;
+  }
+
+  return L_NTP_R_SUCCESS;
+}
+
+void PosixNTPServer::end()
+{
+  int i;
+
+  _closePoll();
+  NTPServer::end();
+
+  for (i = 0; i < _socketCount; i++)
+  {
+    _sockets[i]->socket.stop();
+    delete _sockets[i];
+    _sockets[i] = NULL;
+  }
+
+  _socketCount = 0;
+}
+
+int PosixNTPServer::_openPoll()
+{
+#ifdef __linux__
+  struct epoll_event ev;
+  int i;
+#endif
+
+  if (pipe(_wakeFds) < 0)
+  {
+    _wakeFds[0] = _wakeFds[1] = -1;
+    return L_NTP_R_ERROR;
+  }
+
+  fcntl(_wakeFds[0], F_SETFL, O_NONBLOCK);
+  fcntl(_wakeFds[1], F_SETFL, O_NONBLOCK);
+
+#ifdef __linux__
+  _pollFd = epoll_create1(EPOLL_CLOEXEC);
+
+  if (_pollFd < 0)
+    return L_NTP_R_ERROR;
+
+  // Level-triggered: whatever one update() leaves queued wakes the next poll()
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+
+  for (i = 0; i < _socketCount; i++)
+  {
+    ev.data.u32 = i;
+
+    if (epoll_ctl(_pollFd, EPOLL_CTL_ADD, _sockets[i]->socket.getFd(), &ev) < 0)
+      return L_NTP_R_ERROR;
+  }
+
+  ev.data.u32 = L_NTP_WAKE_EVENT;
+
+  if (epoll_ctl(_pollFd, EPOLL_CTL_ADD, _wakeFds[0], &ev) < 0)
+    return L_NTP_R_ERROR;
+#endif
+
+  return L_NTP_R_SUCCESS;
+}
+
+void PosixNTPServer::_closePoll()
+{
+  int i;
+
+  if (_pollFd >= 0)
+    close(_pollFd);
+
+  for (i = 0; i < 2; i++)
+  {
+    if (_wakeFds[i] >= 0)
+      close(_wakeFds[i]);
+  }
+
+  _pollFd     = -1;
+  _wakeFds[0] = -1;
+  _wakeFds[1] = -1;
+}
+
+int PosixNTPServer::poll(int timeoutMs, int maxPackets)
+{
+  // Sleeps in the kernel until a datagram (or a transmit timestamp) is queued
+  // on any socket, then services the sockets that have one straight away.
+  // Returns # datagrams consumed, 0 on a timeout, -1 after interrupt().
+
+  char     drain[16];
+  uint32_t ready = 0;
+  bool     woken = false;
+  int      n, i;
+
+  if (_wakeFds[0] < 0)
+    return -1;
+
+#ifdef __linux__
+  struct epoll_event events[L_NTP_MAX_LISTENERS + 1];
+
+  n = epoll_wait(_pollFd, events, L_NTP_MAX_LISTENERS + 1, _pollTimeout(timeoutMs));
+
+  for (i = 0; i < n; i++)
+  {
+    if (events[i].data.u32 == L_NTP_WAKE_EVENT)
+      woken = true;
+    else
+      ready |= (1UL << events[i].data.u32);
+  }
+#else
+  struct pollfd pfds[L_NTP_MAX_LISTENERS + 1];
+
+  for (i = 0; i < _socketCount; i++)
+  {
+    pfds[i].fd     = _sockets[i]->socket.getFd();
+    pfds[i].events = POLLIN;
+  }
+
+  pfds[i].fd     = _wakeFds[0];
+  pfds[i].events = POLLIN;
+
+  n = ::poll(pfds, _socketCount + 1, _pollTimeout(timeoutMs));
+
+  for (i = 0; n > 0 && i < _socketCount; i++)
+  {
+    if (pfds[i].revents != 0)
+      ready |= (1UL << i);
+  }
+
+  woken = (n > 0 && (pfds[_socketCount].revents & POLLIN));
+#endif
+
+  if (woken)
+  {
+    while (read(_wakeFds[0], drain, sizeof(drain)) > 0)
+      ;
+
+    return -1;
+  }
+
+  // Also on a timeout (nothing ready), which may be the one set for a broadcast
+  return _update(ready, maxPackets);
+}
+
+void PosixNTPServer::interrupt()
+{
+  // A full pipe already holds a wakeup
+  if (_wakeFds[1] >= 0 && write(_wakeFds[1], "", 1) < 0)
+    return;
+}
+
+#if L_NTP_INTERLEAVE
+
+t_ntpTimestamp PosixNTPServer::_transmitTimestamp(S_NTP_INTERLEAVE_ENTRY *entry)
+{
+  // Stands until the kernel reports when the reply actually left: the time it
+  // was handed to the socket (or queued, while a batch is open)
+
+  S_NTP_TX_PENDING *pending;
+  uint32_t id;
+
+  if (_socket()->hasTxTimestamps() && _socket()->lastTxId(&id))
+  {
+    pending = &_sockets[_listener]->txPending[id & (L_NTP_TX_PENDING - 1)];
+    pending->id   = id;
+    pending->key  = entry->key;
+    pending->slot = (uint32_t)(entry - _interleaveTable);
+    pending->rx   = entry->rx;
+  }
+
+  return _timestamp();
+}
+
+void PosixNTPServer::_readTxTimestamps()
+{
+  // Replaces the stand-in transmit timestamps with the kernel's, for entries
+  // that still hold the exchange the reply was for (current socket only)
+
+  S_POSIX_UDP_TX_TIMESTAMP stamps[L_POSIX_UDP_MAX_BATCH];
+  S_NTP_TX_PENDING *txPending = _sockets[_listener]->txPending;
+  S_NTP_TX_PENDING *pending;
+  S_NTP_INTERLEAVE_ENTRY *entry;
+  PosixUDP *socket = _socket();
+  t_ntpTimestamp ts;
+  int n, i;
+
+  if (!socket->hasTxTimestamps())
+    return;
+
+  do
+  {
+    n = socket->readTxTimestamps(stamps, L_POSIX_UDP_MAX_BATCH);
+
+    for (i = 0; i < n; i++)
+    {
+      pending = &txPending[stamps[i].id & (L_NTP_TX_PENDING - 1)];
+
+      if (pending->key == 0 || pending->id != stamps[i].id)
+        continue;
+
+      if (_interleaveTable != NULL && pending->slot < (uint32_t)_interleaveBuckets * L_NTP_INTERLEAVE_WAYS)
+      {
+        entry = &_interleaveTable[pending->slot];
+        ts    = _timestampAt(stamps[i].readAt);
+
+        if (ts != 0 && entry->key == pending->key && entry->rx == pending->rx)
+          entry->tx = ts - _nanosToNtp(stamps[i].ageNs);
+      }
+
+      pending->key = 0;
+    }
+  } while (n == L_POSIX_UDP_MAX_BATCH);
+
+  // Queued replies that never went out leave ids the kernel hands out again
+  for (i = 0; i < L_NTP_TX_PENDING; i++)
+  {
+    if (txPending[i].key != 0 && (int32_t)(txPending[i].id - socket->nextTxId()) >= 0)
+      txPending[i].key = 0;
+  }
+}
+
+#endif
+
+#endif
@@ -0,0 +1,151 @@
+#pragma once
+
+/*
+ * PosixNTPServer.h
+ *
+ * Implements an NTP Server on top of POSIX UDP sockets, so that the server
+ * core can be run as a host daemon (tested on Linux).
+ *
+ * By default the server listens on 0.0.0.0. addListenAddress() adds sockets
+ * for IPv6 (::) or for the addresses of single interfaces (e.g. one per VLAN);
+ * they all serve the same clock and share the client tables and statistics,
+ * and every request is answered from the socket and address it came in on.
+ *
+ * poll() and run() sleep in epoll_wait (Linux, else poll) until a datagram
+ * arrives on any of the sockets, so an idle server costs no CPU. To fold the
+ * server into another event loop instead, watch getPollFd() for readability
+ * and call poll(0).
+ *
+ * With interleaved mode enabled before begin(), the transmit timestamps kept
+ * for interleaved clients are the kernel's, taken as each reply left (Linux),
+ * rather than ones taken in user space around sendmsg/sendmmsg.
+ */
+
+#ifndef ARDUINO
+
+#include <string.h>
+
+#include "NTPServer.h"
+#include "PosixUDP.h"
+
+#define L_NTP_TX_PENDING   64   /* Replies awaiting their kernel transmit timestamp (power of 2) */
+
+typedef struct s_ntp_tx_pending
+{
+  uint32_t       id;      // PosixUDP::lastTxId() of the reply
+  uint32_t       key;     // Client it went to, 0 = unused
+  uint32_t       slot;    // Client's entry in the interleave table
+  t_ntpTimestamp rx;      // Receive timestamp of the request, tells if the entry still holds that exchange
+} S_NTP_TX_PENDING;
+
+typedef struct s_ntp_posix_listener
+{
+  PosixUDP         socket;
+  S_NTP_TX_PENDING txPending[L_NTP_TX_PENDING];   // Indexed by id (ids count per socket)
+} S_NTP_POSIX_LISTENER;
+
+class PosixNTPServer : public NTPServer
+{
+	protected:
+
+	S_NTP_POSIX_LISTENER *_sockets[L_NTP_MAX_LISTENERS];   // Same order as _listeners
+	int _socketCount;
+	IPAddress _addresses[L_NTP_MAX_LISTENERS];             // From addListenAddress()
+	int _addressCount;
+	bool _reusePort;
+	int _pollFd;                                            // epoll set of the sockets and the wakeup pipe (Linux)
+	int _wakeFds[2];                                        // Written to by interrupt()
+
+	void _init();
+	int  _openPoll();
+	void _closePoll();
+
+	PosixUDP *_socket() { return &_sockets[_listener]->socket; }   // The one being serviced
+
+	/* Batched draining: one recvmmsg in, one sendmmsg out */
+	virtual void _beginBatch(int maxPackets)
+	{
+		_readTxTimestamps();
+
+		if (maxPackets > 1)
+			_socket()->receiveBatch(maxPackets);
+	}
+
+	virtual void _endBatch()
+	{
+		_socket()->flushBatch();
+		_readTxTimestamps();
+	}
+
+#if L_NTP_INTERLEAVE
+	virtual t_ntpTimestamp _transmitTimestamp(S_NTP_INTERLEAVE_ENTRY *entry);
+	void _readTxTimestamps();
+#else
+	void _readTxTimestamps() { }   // Only interleaved mode asks for transmit timestamps
+#endif
+
+	virtual t_ntpTimestamp _receiveTimestamp()
+	{
+		// Back out the time the datagram spent queued in the kernel
+		t_ntpTimestamp ts = _timestampAt(_socket()->receivedAt());
+
+		return (ts != 0 ? ts - _nanosToNtp(_socket()->receiveQueuedNs()) : 0);
+	}
+
+	virtual t_ntpSysClock _receiveMicros()
+	{
+		return _socket()->receivedAt() - _socket()->receiveQueuedNs() / 1000;
+	}
+
+	public:
+
+	PosixNTPServer() : NTPServer()
+	{
+		_init();
+	}
+
+	PosixNTPServer(const char *referenceId, const char stratum) : NTPServer(referenceId, stratum)
+	{
+		_init();
+	}
+
+	virtual ~PosixNTPServer()
+	{
+		end();
+	}
+
+	int addListenAddress(IPAddress address);   // Before begin(): 0.0.0.0, ::, or an interface's address
+
+	int begin(int portNum);                    // Opens a socket per listen address (0.0.0.0 if none were added)
+
+	int begin()
+	{
+		return begin(123);
+	}
+
+	virtual void end();
+
+	virtual int poll(int timeoutMs, int maxPackets = 1);
+	virtual void interrupt();
+
+	int getFd()       // The first socket
+	{
+		return (_socketCount > 0 ? _sockets[0]->socket.getFd() : -1);
+	}
+
+	int getPollFd()   // Readable when poll() has something to do (Linux; elsewhere the first socket)
+	{
+#ifdef __linux__
+		return _pollFd;
+#else
+		return getFd();
+#endif
+	}
+
+	void setReusePort(bool enable)
+	{
+		_reusePort = enable;
+	}
+};
+
+#endif
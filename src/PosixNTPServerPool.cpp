@@ -0,0 +1,322 @@
+#ifndef ARDUINO
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include "PosixNTPServerPool.h"
+
+PosixNTPServerPool::PosixNTPServerPool() : NTPServer()
+{
+  _workerCount  = 0;
+  _batchSize    = L_POSIX_UDP_MAX_BATCH;
+  _addressCount = 0;
+  _watchStop    = false;
+}
+
+PosixNTPServerPool::PosixNTPServerPool(const char *referenceId, const char stratum) : PosixNTPServerPool()
+{
+  setReferenceId(referenceId);
+  setStratum(stratum);
+}
+
+PosixNTPServerPool::~PosixNTPServerPool()
+{
+  end();
+}
+
+int PosixNTPServerPool::addListenAddress(IPAddress address)
+{
+  if (_addressCount >= L_NTP_MAX_LISTENERS)
+    return L_NTP_R_ERROR;
+
+  _addresses[_addressCount++] = address;
+
+  return L_NTP_R_SUCCESS;
+}
+
+int PosixNTPServerPool::begin(int portNum, int workerCount)
+{
+  int i, a;
+
+  end();
+
+  if (workerCount <= 0)
+    workerCount = std::thread::hardware_concurrency();
+
+  if (workerCount <= 0)
+    workerCount = 1;
+
+  if (workerCount > L_NTP_POOL_MAX_WORKERS)
+    workerCount = L_NTP_POOL_MAX_WORKERS;
+
+  // Bring up every socket before starting any thread, so that a failure to
+  // bind leaves nothing running
+  for (i = 0; i < workerCount; i++)
+  {
+    _workers[i] = new PosixNTPServer();
+    _workers[i]->setClockSource(this);
+    _workers[i]->setReusePort(true);
+
+    for (a = 0; a < _addressCount; a++)
+      _workers[i]->addListenAddress(_addresses[a]);
+
+#if L_NTP_THROTTLING
+    // Each worker tracks the clients the kernel steers to its socket
+    if (_clientTable != NULL)
+      _workers[i]->enableThrottling(_clientTableBuckets * L_NTP_THROTTLE_WAYS, _throttleIntervalMillis, _throttleBurst, _throttleKissOfDeath);
+#endif
+
+#if L_NTP_INTERLEAVE
+    if (_interleaveTable != NULL)
+      _workers[i]->enableInterleaved(_interleaveBuckets * L_NTP_INTERLEAVE_WAYS);
+#endif
+
+#if L_NTP_CAPTURE
+    if (_captureSlots > 0)
+      _workers[i]->enableCapture(_captureSlots, _captureSnapLength);
+#endif
+
+    _workerCount++;
+
+    if (_workers[i]->begin(portNum) != L_NTP_R_SUCCESS)
+    {
+      end();
+      return L_NTP_R_ERROR;
+    }
+  }
+
+  for (i = 0; i < _workerCount; i++)
+    _threads[i] = std::thread(&PosixNTPServerPool::_runWorker, this, i);
+
+  _watchStop   = false;
+  _watchThread = std::thread(&PosixNTPServerPool::_runWatch, this);
+
+  return L_NTP_R_SUCCESS;
+}
+
+void PosixNTPServerPool::end()
+{
+  int i;
+
+  if (_watchThread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(_watchMutex);
+      _watchStop = true;
+    }
+
+    _watchWake.notify_one();
+    _watchThread.join();
+  }
+
+  for (i = 0; i < _workerCount; i++)
+  {
+    _workers[i]->interrupt();
+
+    if (_threads[i].joinable())
+      _threads[i].join();
+
+    _workers[i]->end();
+    delete _workers[i];
+    _workers[i] = NULL;
+  }
+
+  _workerCount = 0;
+}
+
+void PosixNTPServerPool::_runWorker(int index)
+{
+  PosixNTPServer *worker = _workers[index];
+
+#ifdef __linux__
+  // Keep each worker on its own core so that its socket and buffers stay cache-hot
+  cpu_set_t cpus;
+  unsigned int ncpu = std::thread::hardware_concurrency();
+
+  if (ncpu > 0)
+  {
+    CPU_ZERO(&cpus);
+    CPU_SET(index % ncpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+#endif
+
+  // Until end() interrupts it
+  worker->run(_batchSize);
+}
+
+void PosixNTPServerPool::_runWatch()
+{
+  // Does for the pool what update() does for a single server: fail over once
+  // the selected source goes quiet. Wakes when it is due, not on a tick.
+
+  std::unique_lock<std::mutex> lock(_watchMutex);
+  int64_t due;
+
+  while (!_watchStop)
+  {
+    due = _failOver(micros64());
+
+    if (due < 0 || due > (int64_t)L_NTP_POOL_WATCH_MS * 1000)
+      due = (int64_t)L_NTP_POOL_WATCH_MS * 1000;
+
+    // Just past the timeout (and not in a loop while a writer holds the lock)
+    _watchWake.wait_for(lock, std::chrono::microseconds(due + 1000), [this] { return _watchStop; });
+  }
+}
+
+int PosixNTPServerPool::addUpstreamServer(IPAddress /* address */, uint16_t /* port */, int /* pollSeconds */)
+{
+  // No update() of our own to poll it, and no single socket for the replies
+  return -1;
+}
+
+int PosixNTPServerPool::enableBroadcast(IPAddress /* address */, int /* intervalSeconds */)
+{
+  // Nothing would send them: broadcasts go out from update()
+  return L_NTP_R_ERROR;
+}
+
+unsigned short PosixNTPServerPool::getSuccessfulRequests(bool resetCounter)
+{
+  unsigned short req = 0;
+  int i;
+
+  for (i = 0; i < _workerCount; i++)
+    req += _workers[i]->getSuccessfulRequests(resetCounter);
+
+  return req;
+}
+
+unsigned long PosixNTPServerPool::getInterleavedReplies()
+{
+  unsigned long replies = 0;
+  int i;
+
+  for (i = 0; i < _workerCount; i++)
+    replies += _workers[i]->getInterleavedReplies();
+
+  return replies;
+}
+
+unsigned long PosixNTPServerPool::getThrottledRequests(bool resetCounter)
+{
+  unsigned long req = 0;
+  int i;
+
+  for (i = 0; i < _workerCount; i++)
+    req += _workers[i]->getThrottledRequests(resetCounter);
+
+  return req;
+}
+
+unsigned short PosixNTPServerPool::getFailedRequests(bool resetCounter)
+{
+  unsigned short req = 0;
+  int i;
+
+  for (i = 0; i < _workerCount; i++)
+    req += _workers[i]->getFailedRequests(resetCounter);
+
+  return req;
+}
+
+uint64_t PosixNTPServerPool::getRequestCount(int outcome) const
+{
+  uint64_t req = 0;
+  int i;
+
+  for (i = 0; i < _workerCount; i++)
+    req += _workers[i]->getRequestCount(outcome);
+
+  return req;
+}
+
+void PosixNTPServerPool::getProcessingHistogram(uint32_t *buckets) const
+{
+  uint32_t worker[L_NTP_HIST_BUCKETS];
+  int i, b;
+
+  memset(buckets, 0, sizeof(worker));
+
+  for (i = 0; i < _workerCount; i++)
+  {
+    _workers[i]->getProcessingHistogram(worker);
+
+    for (b = 0; b < L_NTP_HIST_BUCKETS; b++)
+      buckets[b] += worker[b];
+  }
+}
+
+void PosixNTPServerPool::getUpdateIntervalHistogram(uint32_t *buckets) const
+{
+  uint32_t worker[L_NTP_HIST_BUCKETS];
+  int i, b;
+
+  memset(buckets, 0, sizeof(worker));
+
+  for (i = 0; i < _workerCount; i++)
+  {
+    _workers[i]->getUpdateIntervalHistogram(worker);
+
+    for (b = 0; b < L_NTP_HIST_BUCKETS; b++)
+      buckets[b] += worker[b];
+  }
+}
+
+void PosixNTPServerPool::resetStatistics()
+{
+  int i;
+
+  for (i = 0; i < _workerCount; i++)
+    _workers[i]->resetStatistics();
+}
+
+#if L_NTP_CAPTURE
+
+int PosixNTPServerPool::enableCapture(int packets, int snapLength)
+{
+  // Only noted here: every worker captures what its own socket receives
+  if (packets <= 0 || snapLength < 0)
+    return L_NTP_R_ERROR;
+
+  _captureSlots      = packets;
+  _captureSnapLength = (snapLength < L_NTP_MAX_RX_BUFF ? snapLength : L_NTP_MAX_RX_BUFF);
+
+  return L_NTP_R_SUCCESS;
+}
+
+void PosixNTPServerPool::disableCapture()
+{
+  _captureSlots = 0;
+}
+
+unsigned long PosixNTPServerPool::getCapturedPackets()
+{
+  unsigned long packets = 0;
+  int i;
+
+  for (i = 0; i < _workerCount; i++)
+    packets += _workers[i]->getCapturedPackets();
+
+  return packets;
+}
+
+int PosixNTPServerPool::writeCapture(Print &out, bool fileHeader)
+{
+  // One worker after the other, so the datagrams are in order per worker only
+  int written = 0, i;
+
+  if (fileHeader)
+    NTPServer::writeCapture(out, true);
+
+  for (i = 0; i < _workerCount; i++)
+    written += _workers[i]->writeCapture(out, false);
+
+  return written;
+}
+
+#endif
+
+#endif
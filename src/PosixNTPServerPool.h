@@ -0,0 +1,91 @@
+#pragma once
+
+/*
+ * PosixNTPServerPool.h
+ *
+ * Runs several PosixNTPServer workers, one per thread, that all listen on the
+ * same port through SO_REUSEPORT. The kernel spreads clients across the
+ * worker sockets, and every worker has its own socket and packet buffer.
+ *
+ * The pool itself owns the reference clock and the NTP configuration: set the
+ * reference time and the server parameters on the pool, and every worker
+ * serves them (read-only) through setClockSource(). Throttling and interleaved
+ * mode must also be enabled on the pool before begin(); every worker then keeps
+ * its own client tables for the clients that the kernel steers to its socket.
+ * Listen addresses added to the pool are opened by every worker, and packet
+ * capture enabled on the pool before begin() keeps a ring per worker, which
+ * writeCapture() writes out one after the other.
+ *
+ * Reference sources are registered with and updated on the pool too. The
+ * workers never see them, so failing over from a source that has gone quiet
+ * is up to a thread of the pool's own, which sleeps until the selected source
+ * is due (at most L_NTP_POOL_WATCH_MS). Upstream servers cannot be added
+ * (addUpstreamServer() returns -1): the pool runs no update() loop of its own
+ * to poll them from, and a reply could come in on any worker's socket.
+ * Broadcasts are refused for the same lack of an update() loop:
+ * enableBroadcast() returns L_NTP_R_ERROR.
+ */
+
+#ifndef ARDUINO
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "PosixNTPServer.h"
+
+#define L_NTP_POOL_MAX_WORKERS      64
+#define L_NTP_POOL_WATCH_MS       1000   /* Longest sleep of the source watch, picks up a newly selected source */
+
+class PosixNTPServerPool : public NTPServer
+{
+protected:
+  PosixNTPServer   *_workers[L_NTP_POOL_MAX_WORKERS];
+  std::thread       _threads[L_NTP_POOL_MAX_WORKERS];
+  int               _workerCount;
+  int               _batchSize;
+  IPAddress         _addresses[L_NTP_MAX_LISTENERS];
+  int               _addressCount;
+  std::thread             _watchThread;   // Fails over between the sources (_failOver)
+  std::mutex              _watchMutex;
+  std::condition_variable _watchWake;
+  bool                    _watchStop;
+
+  void _runWorker(int index);
+  void _runWatch();
+
+public:
+  PosixNTPServerPool();
+  PosixNTPServerPool(const char *referenceId, const char stratum);
+  virtual ~PosixNTPServerPool();
+
+  int addListenAddress(IPAddress address);   // Before begin(), see PosixNTPServer
+  int begin(int portNum, int workerCount);   // workerCount <= 0 starts one worker per CPU
+  int begin(int portNum) { return begin(portNum, 0); }
+  virtual void end();
+
+  void setBatchSize(int maxPackets) { _batchSize = maxPackets; }   // Datagrams drained per update() by each worker
+  int  getWorkerCount() { return _workerCount; }
+
+  virtual int addUpstreamServer(IPAddress address, uint16_t port = L_NTP_PORT, int pollSeconds = 64);   // Always -1, see above
+  virtual int enableBroadcast(IPAddress address, int intervalSeconds = 0);                              // Always L_NTP_R_ERROR
+
+  virtual unsigned short getSuccessfulRequests(bool resetCounter);
+  virtual unsigned short getFailedRequests(bool resetCounter);
+  virtual unsigned long getThrottledRequests(bool resetCounter);
+  virtual unsigned long getInterleavedReplies();
+
+  virtual uint64_t getRequestCount(int outcome) const;
+  virtual void getProcessingHistogram(uint32_t *buckets) const;
+  virtual void getUpdateIntervalHistogram(uint32_t *buckets) const;
+  virtual void resetStatistics();
+
+#if L_NTP_CAPTURE
+  virtual int  enableCapture(int packets, int snapLength = L_NTP_MAX_RX_BUFF);   // Before begin(), per worker
+  virtual void disableCapture();                                               // From the next begin() on
+  virtual unsigned long getCapturedPackets();
+  virtual int  writeCapture(Print &out, bool fileHeader = true);
+#endif
+};
+
+#endif
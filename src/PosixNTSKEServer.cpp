@@ -0,0 +1,392 @@
+#if !defined(ARDUINO) && defined(L_NTP_HAVE_OPENSSL)
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+#include "NTPServer.h"
+#include "PosixNTSKEServer.h"
+
+static int selectAlpn(SSL * /* ssl */, const unsigned char **out, unsigned char *outLen,
+                      const unsigned char *in, unsigned int inLen, void * /* arg */)
+{
+  static const unsigned char alpn[] = { sizeof(L_NTP_NTS_KE_ALPN) - 1, 'n', 't', 's', 'k', 'e', '/', '1' };
+
+  // Clients that do not speak NTS-KE are turned away during the handshake
+  if (SSL_select_next_proto((unsigned char **)out, outLen, alpn, sizeof(alpn), in, inLen) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
+
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static int64_t monotonicMillis()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool waitFor(SSL *ssl, int ret, int64_t deadline)
+{
+  // The sockets are non-blocking, so that a session cannot outlast its
+  // deadline however slowly the client feeds it: wait for what OpenSSL asks
+  // for, but no longer than what is left
+  struct pollfd pfd;
+  int64_t left = deadline - monotonicMillis();
+
+  pfd.fd = SSL_get_fd(ssl);
+
+  switch (SSL_get_error(ssl, ret))
+  {
+    case SSL_ERROR_WANT_READ:  pfd.events = POLLIN;  break;
+    case SSL_ERROR_WANT_WRITE: pfd.events = POLLOUT; break;
+    default:                   return false;
+  }
+
+  return (left > 0 && poll(&pfd, 1, (int)left) > 0);
+}
+
+static bool acceptBy(SSL *ssl, int64_t deadline)
+{
+  int ret;
+
+  while ((ret = SSL_accept(ssl)) != 1)
+  {
+    if (!waitFor(ssl, ret, deadline))
+      return false;
+  }
+
+  return true;
+}
+
+static bool readFully(SSL *ssl, uint8_t *buffer, int cb, int64_t deadline)
+{
+  int n;
+
+  while (cb > 0)
+  {
+    n = SSL_read(ssl, buffer, cb);
+
+    if (n <= 0)
+    {
+      if (!waitFor(ssl, n, deadline))
+        return false;
+
+      continue;
+    }
+
+    buffer += n;
+    cb     -= n;
+  }
+
+  return true;
+}
+
+static bool writeFully(SSL *ssl, const uint8_t *buffer, int cb, int64_t deadline)
+{
+  int n;
+
+  // Without SSL_MODE_ENABLE_PARTIAL_WRITE, a write completes or is retried whole
+  while ((n = SSL_write(ssl, buffer, cb)) != cb)
+  {
+    if (!waitFor(ssl, n, deadline))
+      return false;
+  }
+
+  return true;
+}
+
+static int putRecord(uint8_t *p, int type, const void *body, int cbBody)
+{
+  p[0] = (uint8_t)(type >> 8);
+  p[1] = (uint8_t)type;
+  p[2] = (uint8_t)(cbBody >> 8);
+  p[3] = (uint8_t)cbBody;
+
+  if (body != NULL)
+    memcpy(&p[4], body, cbBody);   // Else filled in by the caller
+
+  return 4 + cbBody;
+}
+
+PosixNTSKEServer::PosixNTSKEServer()
+{
+  _fd       = -1;
+  _ctx      = NULL;
+  _running  = false;
+  _ntpPort  = L_NTP_PORT;
+  _sessions = 0;
+  _failures = 0;
+}
+
+PosixNTSKEServer::~PosixNTSKEServer()
+{
+  end();
+}
+
+int PosixNTSKEServer::begin(int portNum, const char *certFile, const char *keyFile, const uint8_t *masterKey, int cbKey)
+{
+  struct sockaddr_in6 addr;
+  uint64_t seed;
+  int one = 1, zero = 0;
+
+  end();
+
+  if (masterKey == NULL || cbKey != L_NTP_NTS_MASTER_KEY || RAND_bytes((unsigned char *)&seed, sizeof(seed)) != 1)
+    return L_NTP_R_ERROR;
+
+  _cookies.setMasterKey(masterKey, seed);
+
+  _ctx = SSL_CTX_new(TLS_server_method());
+
+  if (_ctx == NULL ||
+      !SSL_CTX_set_min_proto_version(_ctx, TLS1_3_VERSION) ||
+      SSL_CTX_use_certificate_chain_file(_ctx, certFile) != 1 ||
+      SSL_CTX_use_PrivateKey_file(_ctx, keyFile, SSL_FILETYPE_PEM) != 1)
+  {
+    ERR_print_errors_fp(stderr);
+    end();
+    return L_NTP_R_ERROR;
+  }
+
+  SSL_CTX_set_alpn_select_cb(_ctx, selectAlpn, NULL);
+
+  // One dual-stack socket for IPv4 and IPv6 clients
+  _fd = socket(AF_INET6, SOCK_STREAM, 0);
+
+  if (_fd < 0)
+  {
+    end();
+    return L_NTP_R_ERROR;
+  }
+
+  setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr   = in6addr_any;
+  addr.sin6_port   = htons(portNum);
+
+  // Non-blocking: all threads wake for a connection, only one gets it
+  if (bind(_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(_fd, 16) < 0 ||
+      fcntl(_fd, F_SETFL, O_NONBLOCK) < 0)
+  {
+    end();
+    return L_NTP_R_ERROR;
+  }
+
+  _running = true;
+
+  for (int i = 0; i < L_NTP_NTS_KE_THREADS; i++)
+    _threads[i] = std::thread(&PosixNTSKEServer::_run, this);
+
+  return L_NTP_R_SUCCESS;
+}
+
+void PosixNTSKEServer::end()
+{
+  _running = false;
+
+  // Sessions in progress end by their deadline at the latest
+  for (int i = 0; i < L_NTP_NTS_KE_THREADS; i++)
+  {
+    if (_threads[i].joinable())
+      _threads[i].join();
+  }
+
+  if (_fd >= 0)
+  {
+    close(_fd);
+    _fd = -1;
+  }
+
+  if (_ctx != NULL)
+  {
+    SSL_CTX_free(_ctx);
+    _ctx = NULL;
+  }
+}
+
+void PosixNTSKEServer::_run()
+{
+  struct pollfd pfd;
+  int64_t deadline;
+  SSL *ssl;
+  int  fd;
+
+  pfd.fd     = _fd;
+  pfd.events = POLLIN;
+
+  while (_running)
+  {
+    if (poll(&pfd, 1, L_NTP_NTS_KE_POLL_MS) <= 0)
+      continue;
+
+    fd = accept(_fd, NULL, NULL);
+
+    if (fd < 0)
+      continue;
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    // The whole session, handshake included, has to fit in the timeout: a
+    // client that trickles bytes in is cut off rather than kept waiting on
+    deadline = monotonicMillis() + L_NTP_NTS_KE_TIMEOUT_MS;
+    ssl      = SSL_new(_ctx);
+
+    if (ssl != NULL && SSL_set_fd(ssl, fd) == 1 && acceptBy(ssl, deadline) && _serve(ssl, deadline))
+      _sessions++;
+    else
+      _failures++;
+
+    if (ssl != NULL)
+    {
+      SSL_shutdown(ssl);
+      SSL_free(ssl);
+    }
+
+    close(fd);
+  }
+}
+
+bool PosixNTSKEServer::_serve(SSL *ssl, int64_t deadline)
+{
+  // Reads the client's records up to End of Message, then answers in one write
+  // (RFC 8915, 4.1). Unknown non-critical records are skipped.
+
+  uint8_t  request[L_NTP_NTS_KE_MAX_REQUEST];
+  uint8_t  response[16 + L_NTP_NTS_MAX_COOKIES * (4 + L_NTP_NTS_COOKIE) + 32];
+  uint8_t  keys[2 * L_NTP_NTS_KEY];
+  uint8_t  context[5] = { 0, L_NTP_NTS_PROTO_NTPV4, 0, L_NTP_NTS_AEAD_SIV_CMAC_256, 0 };
+  uint8_t  body[2];
+  uint32_t period;
+  int cbRequest = 0, cbResponse = 0, type, cbBody, i;
+  int errorCode = -1;
+  bool end = false, nextProtocol = false, ntpv4 = false, siv = false;
+
+  while (!end && errorCode < 0)
+  {
+    uint8_t *record = &request[cbRequest];
+
+    if (cbRequest + 4 > (int)sizeof(request) || !readFully(ssl, record, 4, deadline))
+      return false;
+
+    type   = ((record[0] << 8) | record[1]);
+    cbBody = ((record[2] << 8) | record[3]);
+
+    if (cbRequest + 4 + cbBody > (int)sizeof(request) || !readFully(ssl, &record[4], cbBody, deadline))
+      return false;
+
+    cbRequest += 4 + cbBody;
+
+    switch (type & ~L_NTP_NTS_KE_CRITICAL)
+    {
+      case L_NTP_NTS_KE_END:
+        end = true;
+        break;
+
+      case L_NTP_NTS_KE_NEXT_PROTOCOL:
+        nextProtocol = true;
+
+        for (i = 0; i + 1 < cbBody; i += 2)
+          ntpv4 |= (((record[4 + i] << 8) | record[5 + i]) == L_NTP_NTS_PROTO_NTPV4);
+        break;
+
+      case L_NTP_NTS_KE_AEAD:
+        for (i = 0; i + 1 < cbBody; i += 2)
+          siv |= (((record[4 + i] << 8) | record[5 + i]) == L_NTP_NTS_AEAD_SIV_CMAC_256);
+        break;
+
+      case L_NTP_NTS_KE_ERROR:
+      case L_NTP_NTS_KE_WARNING:
+        return false;
+
+      case L_NTP_NTS_KE_SERVER:
+      case L_NTP_NTS_KE_PORT:
+        break;                          // Requests for another server: we only offer ourselves
+
+      default:
+        if (type & L_NTP_NTS_KE_CRITICAL)
+          errorCode = L_NTP_NTS_KE_ERR_UNRECOGNIZED;
+        break;
+    }
+  }
+
+  if (errorCode < 0 && !nextProtocol)
+    errorCode = L_NTP_NTS_KE_ERR_BAD_REQUEST;
+
+  if (errorCode >= 0)
+  {
+    body[0] = 0;
+    body[1] = (uint8_t)errorCode;
+    cbResponse += putRecord(&response[cbResponse], L_NTP_NTS_KE_CRITICAL | L_NTP_NTS_KE_ERROR, body, 2);
+    cbResponse += putRecord(&response[cbResponse], L_NTP_NTS_KE_CRITICAL | L_NTP_NTS_KE_END, NULL, 0);
+    writeFully(ssl, response, cbResponse, deadline);
+    return false;
+  }
+
+  // Empty protocol or algorithm lists tell the client we have nothing in common
+  body[0] = 0;
+  body[1] = L_NTP_NTS_PROTO_NTPV4;
+  cbResponse += putRecord(&response[cbResponse], L_NTP_NTS_KE_CRITICAL | L_NTP_NTS_KE_NEXT_PROTOCOL, body, ntpv4 ? 2 : 0);
+
+  if (ntpv4)
+  {
+    body[1] = L_NTP_NTS_AEAD_SIV_CMAC_256;
+    cbResponse += putRecord(&response[cbResponse], L_NTP_NTS_KE_CRITICAL | L_NTP_NTS_KE_AEAD, body, siv ? 2 : 0);
+  }
+
+  if (ntpv4 && siv)
+  {
+    // C2S and S2C keys, as the client derives them from the same session
+    if (SSL_export_keying_material(ssl, keys, L_NTP_NTS_KEY, L_NTP_NTS_KE_EXPORTER, sizeof(L_NTP_NTS_KE_EXPORTER) - 1,
+                                   context, sizeof(context), 1) != 1)
+      return false;
+
+    context[4] = 1;
+
+    if (SSL_export_keying_material(ssl, &keys[L_NTP_NTS_KEY], L_NTP_NTS_KEY, L_NTP_NTS_KE_EXPORTER, sizeof(L_NTP_NTS_KE_EXPORTER) - 1,
+                                   context, sizeof(context), 1) != 1)
+      return false;
+
+    period = NTPNtsCookies::currentPeriod();
+
+    {
+      std::lock_guard<std::mutex> lock(_cookieLock);
+
+      for (i = 0; i < L_NTP_NTS_MAX_COOKIES; i++)
+      {
+        uint8_t *record = &response[cbResponse];
+
+        cbResponse += putRecord(record, L_NTP_NTS_KE_NEW_COOKIE, NULL, L_NTP_NTS_COOKIE);
+        _cookies.seal(period, keys, &record[4]);
+      }
+    }
+
+    if (_ntpPort != L_NTP_PORT)
+    {
+      body[0] = (uint8_t)(_ntpPort >> 8);
+      body[1] = (uint8_t)_ntpPort;
+      cbResponse += putRecord(&response[cbResponse], L_NTP_NTS_KE_PORT, body, 2);
+    }
+
+    memset(keys, 0, sizeof(keys));
+  }
+
+  cbResponse += putRecord(&response[cbResponse], L_NTP_NTS_KE_CRITICAL | L_NTP_NTS_KE_END, NULL, 0);
+
+  return (writeFully(ssl, response, cbResponse, deadline) && ntpv4 && siv);
+}
+
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+
+/*
+ * PosixNTSKEServer.h
+ *
+ * NTS Key Establishment server (RFC 8915, section 4) on top of OpenSSL. Clients
+ * connect over TLS 1.3 (ALPN "ntske/1"), negotiate NTPv4 with
+ * AEAD_AES_SIV_CMAC_256, and leave with the C2S/S2C keys exported from the TLS
+ * session and a set of cookies that hold them. The cookies are sealed with a
+ * master key that the NTP server shares (NTPServer::enableNts), so the two need
+ * no other link: they may even run in separate processes.
+ *
+ * Up to L_NTP_NTS_KE_THREADS sessions are served at once, each on a thread of
+ * its own and each given L_NTP_NTS_KE_TIMEOUT_MS from accept to its last byte:
+ * a client that trickles its request in is dropped when that runs out, and
+ * holds up no one else meanwhile. Only built on the host, when OpenSSL is
+ * available (L_NTP_HAVE_OPENSSL, see extras/host/Makefile).
+ */
+
+#if !defined(ARDUINO) && defined(L_NTP_HAVE_OPENSSL)
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include <openssl/ssl.h>
+
+#include "NTPNts.h"
+
+#define L_NTP_NTS_KE_MAX_REQUEST   1024   /* Largest request accepted, bytes */
+#define L_NTP_NTS_KE_TIMEOUT_MS    2000   /* Per session, the whole of it */
+#define L_NTP_NTS_KE_THREADS          4   /* Sessions served at once */
+#define L_NTP_NTS_KE_POLL_MS        100   /* How often an idle listener checks for shutdown */
+
+class PosixNTSKEServer
+{
+protected:
+  int                        _fd;
+  SSL_CTX                   *_ctx;
+  std::thread                _threads[L_NTP_NTS_KE_THREADS];
+  std::atomic<bool>          _running;
+  NTPNtsCookies              _cookies;
+  std::mutex                 _cookieLock;   // Held while sealing, the nonce counter is shared
+  int                        _ntpPort;
+  std::atomic<unsigned long> _sessions,
+                             _failures;
+
+  void _run();
+  bool _serve(SSL *ssl, int64_t deadline);    // One key establishment, true if cookies were handed out
+
+public:
+  PosixNTSKEServer();
+  virtual ~PosixNTSKEServer();
+
+  // masterKey must be the one given to NTPServer::enableNts()
+  int  begin(int portNum, const char *certFile, const char *keyFile, const uint8_t *masterKey, int cbKey);
+  void end();
+
+  void setNtpPort(int portNum) { _ntpPort = portNum; }   // Advertised to clients if not 123
+
+  unsigned long getSessions() { return _sessions; }
+  unsigned long getFailures() { return _failures; }
+};
+
+#endif
@@ -0,0 +1,779 @@
+#ifndef ARDUINO
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PosixUDP.h"
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
+
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+#define L_POSIX_UDP_TX_TIMESTAMPS
+#endif
+
+PosixUDP::PosixUDP()
+{
+  _fd        = -1;
+  _rxCount   = 0;
+  _rxNext    = 0;
+  _rxCurrent = -1;
+  _rxPos     = 0;
+  _txCount   = 0;
+  _txPending = NULL;
+  _batching  = false;
+  _reusePort = false;
+  _pktInfo   = false;
+  _kernelTimestamps = false;
+  _txTimestampsWanted = false;
+  _txTimestamps  = false;
+  _txNextId      = 0;
+  _txLastId      = 0;
+  _txLastIdValid = false;
+}
+
+PosixUDP::~PosixUDP()
+{
+  stop();
+}
+
+uint8_t PosixUDP::begin(uint16_t port)
+{
+  return begin(IPAddress(), port);
+}
+
+uint8_t PosixUDP::begin(IPAddress localIP, uint16_t port)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  const uint8_t *raw = localIP.raw_address();
+  int one = 1, i;
+
+  stop();
+
+  _setAddress(&addr, &addrLen, localIP, port);
+
+  _fd = socket(addr.ss_family, SOCK_DGRAM, 0);
+
+  if (_fd < 0)
+    return 0;
+
+  setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  for (i = 0; i < localIP.rawLength() && raw[i] == 0; i++)
+    ;
+
+  _pktInfo = (i == localIP.rawLength());
+
+  if (localIP.isV6())
+  {
+    // IPv4 clients are left to a listener of their own
+    setsockopt(_fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+
+#ifdef IPV6_RECVPKTINFO
+    if (_pktInfo)
+      setsockopt(_fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one));
+#endif
+  }
+  else
+  {
+    // Needed to send to 255.255.255.255 or a subnet broadcast address in broadcast mode
+    setsockopt(_fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+
+#ifdef IP_PKTINFO
+    if (_pktInfo)
+      setsockopt(_fd, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one));
+#endif
+  }
+
+  // Lets several sockets (one per worker thread) share the port, with the
+  // kernel spreading clients across them
+  if (_reusePort && setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+  {
+    stop();
+    return 0;
+  }
+
+#ifdef SO_TIMESTAMPNS
+  // Have the kernel stamp every datagram on arrival
+  _kernelTimestamps = (setsockopt(_fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == 0);
+#endif
+
+#ifdef L_POSIX_UDP_TX_TIMESTAMPS
+  // And as it leaves, reported without the payload and numbered from 0
+  if (_txTimestampsWanted)
+  {
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    _txTimestamps = (setsockopt(_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0);
+  }
+#endif
+
+  if (bind(_fd, (struct sockaddr *)&addr, addrLen) < 0 ||
+      fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK) < 0)
+  {
+    stop();
+    return 0;
+  }
+
+  return 1;
+}
+
+void PosixUDP::stop()
+{
+  if (_fd >= 0)
+  {
+    close(_fd);
+    _fd = -1;
+  }
+
+  _rxCount   = 0;
+  _rxNext    = 0;
+  _rxCurrent = -1;
+  _rxPos     = 0;
+  _txCount   = 0;
+  _txPending = NULL;
+  _batching  = false;
+  _txTimestamps  = false;
+  _txNextId      = 0;
+  _txLastIdValid = false;
+}
+
+int PosixUDP::_setAddress(struct sockaddr_storage *addr, socklen_t *addrLen, IPAddress ip, uint16_t port)
+{
+  memset(addr, 0, sizeof(*addr));
+
+  if (ip.isV4())
+  {
+    struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+
+    sin->sin_family = AF_INET;
+    sin->sin_port   = htons(port);
+    memcpy(&sin->sin_addr, ip.raw_address(), 4);
+    *addrLen = sizeof(*sin);
+  }
+  else
+  {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port   = htons(port);
+    memcpy(&sin6->sin6_addr, ip.raw_address(), 16);
+    *addrLen = sizeof(*sin6);
+  }
+
+  return 1;
+}
+
+int PosixUDP::beginPacket(IPAddress ip, uint16_t port)
+{
+  // Outside of a batch there is only ever one outbound datagram. Inside a
+  // batch, replies are queued up until flushBatch() (or the queue fills up).
+
+  if (_batching)
+  {
+    if (_txCount >= L_POSIX_UDP_MAX_BATCH)
+    {
+      flushBatch();
+      _batching = true;
+    }
+
+    _txPending = &_tx[_txCount];
+  }
+  else
+  {
+    _txPending = &_tx[0];
+  }
+
+  _txPending->length     = 0;
+  _txPending->controlLen = 0;
+
+  // A reply leaves from the address the request was sent to
+  if (_pktInfo && _rxCurrent >= 0 && _rx[_rxCurrent].localFamily != 0 && remotePort() == port && remoteIP() == ip)
+    _setSource(_txPending, &_rx[_rxCurrent]);
+
+  return _setAddress(&_txPending->addr, &_txPending->addrLen, ip, port);
+}
+
+int PosixUDP::beginPacket(const char *host, uint16_t port)
+{
+  IPAddress ip;
+
+  if (!ip.fromString(host))
+    return 0;
+
+  return beginPacket(ip, port);
+}
+
+int PosixUDP::endPacket()
+{
+  ssize_t tx;
+  S_POSIX_UDP_DATAGRAM *d = _txPending;
+  struct msghdr msg;
+  struct iovec  iov;
+
+  _txPending     = NULL;
+  _txLastIdValid = false;
+
+  if (_fd < 0 || d == NULL)
+    return 0;
+
+  if (_batching)
+  {
+    // Goes out with the batch, after the datagrams queued before it
+    _txLastId      = _txNextId + _txCount;
+    _txLastIdValid = true;
+    _txCount++;
+    return 1;
+  }
+
+  _prepareSend(d, &msg, &iov);
+  tx = sendmsg(_fd, &msg, MSG_DONTWAIT);
+
+  if (tx < 0)
+    return 0;
+
+  _txLastId      = _txNextId++;
+  _txLastIdValid = true;
+
+  return 1;
+}
+
+size_t PosixUDP::write(uint8_t b)
+{
+  return write(&b, 1);
+}
+
+size_t PosixUDP::write(const uint8_t *buffer, size_t size)
+{
+  S_POSIX_UDP_DATAGRAM *d = _txPending;
+
+  if (d == NULL)
+    return 0;
+
+  if (size > sizeof(d->data) - d->length)
+    size = sizeof(d->data) - d->length;
+
+  memcpy(&d->data[d->length], buffer, size);
+  d->length += size;
+
+  return size;
+}
+
+int PosixUDP::parsePacket()
+{
+  // Discards whatever is left of the current datagram and moves on to the next one.
+  // Returns the full size of the datagram, even if it had to be truncated.
+
+  ssize_t rx;
+
+  _rxCurrent = -1;
+  _rxPos     = 0;
+
+  if (_rxNext < _rxCount)
+  {
+    // Hand out the next datagram from the last receiveBatch()
+    _rxCurrent = _rxNext++;
+    return _rx[_rxCurrent].size;
+  }
+
+  if (_fd < 0 || _batching)
+    return 0;   // Batch has been drained, leave the rest for the next one
+
+  struct msghdr msg;
+  struct iovec  iov;
+
+  _prepareReceive(0, &msg, &iov);
+
+  rx = recvmsg(_fd, &msg, MSG_DONTWAIT | MSG_TRUNC);
+
+  if (rx <= 0)
+  {
+    _rxCount = 0;
+    _rxNext  = 0;
+    return 0;
+  }
+
+  _completeReceive(0, &msg, (int)rx, micros64(), _realtimeNs());
+
+  _rxCount   = 1;
+  _rxNext    = 1;
+  _rxCurrent = 0;
+
+  return _rx[0].size;
+}
+
+int PosixUDP::available()
+{
+  if (_rxCurrent < 0)
+    return 0;
+
+  return _rx[_rxCurrent].length - _rxPos;
+}
+
+int PosixUDP::read()
+{
+  if (available() <= 0)
+    return -1;
+
+  return _rx[_rxCurrent].data[_rxPos++];
+}
+
+int PosixUDP::read(unsigned char *buffer, size_t len)
+{
+  if (len > (size_t)available())
+    len = available();
+
+  if (len > 0)
+  {
+    memcpy(buffer, &_rx[_rxCurrent].data[_rxPos], len);
+    _rxPos += len;
+  }
+
+  return (int)len;
+}
+
+int PosixUDP::read(char *buffer, size_t len)
+{
+  return read((unsigned char *)buffer, len);
+}
+
+int PosixUDP::peek()
+{
+  if (available() <= 0)
+    return -1;
+
+  return _rx[_rxCurrent].data[_rxPos];
+}
+
+void PosixUDP::flush()
+{
+  if (_rxCurrent >= 0)
+    _rxPos = _rx[_rxCurrent].length;
+}
+
+IPAddress PosixUDP::remoteIP()
+{
+  IPAddress ip;
+  const struct sockaddr_storage *addr;
+
+  if (_rxCurrent < 0)
+    return ip;
+
+  addr = &_rx[_rxCurrent].addr;
+
+  if (addr->ss_family == AF_INET)
+  {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    memcpy(ip.raw_address(), &sin->sin_addr, 4);
+  }
+  else if (addr->ss_family == AF_INET6)
+  {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+    ip.setV6((const uint8_t *)&sin6->sin6_addr);
+  }
+
+  return ip;
+}
+
+uint16_t PosixUDP::remotePort()
+{
+  const struct sockaddr_storage *addr;
+
+  if (_rxCurrent < 0)
+    return 0;
+
+  addr = &_rx[_rxCurrent].addr;
+
+  if (addr->ss_family == AF_INET)
+    return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+  else if (addr->ss_family == AF_INET6)
+    return ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+
+  return 0;
+}
+
+void PosixUDP::_prepareReceive(int slot, struct msghdr *msg, struct iovec *iov)
+{
+  S_POSIX_UDP_DATAGRAM *d = &_rx[slot];
+
+  iov->iov_base = d->data;
+  iov->iov_len  = sizeof(d->data);
+
+  memset(msg, 0, sizeof(*msg));
+  msg->msg_name       = &d->addr;
+  msg->msg_namelen    = sizeof(d->addr);
+  msg->msg_iov        = iov;
+  msg->msg_iovlen     = 1;
+  msg->msg_control    = d->control;
+  msg->msg_controllen = sizeof(d->control);
+}
+
+void PosixUDP::_completeReceive(int slot, const struct msghdr *msg, int cbReceived, uint64_t now, int64_t nowRealNs)
+{
+  // Fills in the bookkeeping for a datagram. If the kernel stamped it on
+  // arrival (SO_TIMESTAMPNS), we also note how long it sat in the socket
+  // queue before we got to it.
+
+  S_POSIX_UDP_DATAGRAM *d = &_rx[slot];
+
+  d->addrLen    = msg->msg_namelen;
+  d->size       = cbReceived;
+  d->length     = (cbReceived > (int)sizeof(d->data) ? (int)sizeof(d->data) : cbReceived);
+  d->receivedAt = now;
+  d->queuedNs   = 0;
+  d->localFamily = 0;
+
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR((struct msghdr *)msg, cmsg))
+  {
+#ifdef SO_TIMESTAMPNS
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+      struct timespec ts;
+      int64_t queued;
+
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      queued = nowRealNs - ((int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+
+      // Ignore anything implausible (i.e. the system clock was stepped in between)
+      if (queued > 0 && queued < 1000000000LL)
+        d->queuedNs = (uint32_t)queued;
+    }
+#endif
+
+#ifdef IP_PKTINFO
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+    {
+      struct in_pktinfo info;
+
+      // ipi_spec_dst rather than ipi_addr: a request sent to a broadcast
+      // address is answered from our own address
+      memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+      memcpy(d->localAddr, &info.ipi_spec_dst, 4);
+      d->localFamily  = AF_INET;
+      d->localIfIndex = 0;
+    }
+#endif
+
+#ifdef IPV6_RECVPKTINFO
+    if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO)
+    {
+      struct in6_pktinfo info;
+
+      memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+
+      // Multicast is no source address: left to the kernel
+      if (info.ipi6_addr.s6_addr[0] != 0xFF)
+      {
+        memcpy(d->localAddr, &info.ipi6_addr, 16);
+        d->localFamily  = AF_INET6;
+        d->localIfIndex = info.ipi6_ifindex;
+      }
+    }
+#endif
+  }
+}
+
+void PosixUDP::_prepareSend(S_POSIX_UDP_DATAGRAM *d, struct msghdr *msg, struct iovec *iov)
+{
+  iov->iov_base = d->data;
+  iov->iov_len  = d->length;
+
+  memset(msg, 0, sizeof(*msg));
+  msg->msg_name    = &d->addr;
+  msg->msg_namelen = d->addrLen;
+  msg->msg_iov     = iov;
+  msg->msg_iovlen  = 1;
+
+  if (d->controlLen > 0)
+  {
+    msg->msg_control    = d->control;
+    msg->msg_controllen = d->controlLen;
+  }
+}
+
+void PosixUDP::_setSource(S_POSIX_UDP_DATAGRAM *d, const S_POSIX_UDP_DATAGRAM *request)
+{
+  // Pins the source address (and for IPv6 the interface) of a reply to the
+  // local address the request came in on
+
+  struct msghdr   msg;
+  struct cmsghdr *cmsg;
+
+  memset(d->control, 0, sizeof(d->control));
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_control    = d->control;
+  msg.msg_controllen = sizeof(d->control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+
+#ifdef IP_PKTINFO
+  if (request->localFamily == AF_INET)
+  {
+    struct in_pktinfo info;
+
+    memset(&info, 0, sizeof(info));
+    memcpy(&info.ipi_spec_dst, request->localAddr, 4);
+
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type  = IP_PKTINFO;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(info));
+    memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+    d->controlLen = CMSG_SPACE(sizeof(info));
+  }
+#endif
+
+#ifdef IPV6_RECVPKTINFO
+  if (request->localFamily == AF_INET6)
+  {
+    struct in6_pktinfo info;
+
+    memset(&info, 0, sizeof(info));
+    memcpy(&info.ipi6_addr, request->localAddr, 16);
+    info.ipi6_ifindex = request->localIfIndex;
+
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type  = IPV6_PKTINFO;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(info));
+    memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+    d->controlLen = CMSG_SPACE(sizeof(info));
+  }
+#endif
+}
+
+int64_t PosixUDP::_realtimeNs()
+{
+  struct timespec ts;
+
+  if (!_kernelTimestamps && !_txTimestamps)
+    return 0;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+uint32_t PosixUDP::receiveQueuedNs()
+{
+  if (_rxCurrent < 0)
+    return 0;
+
+  return _rx[_rxCurrent].queuedNs;
+}
+
+uint64_t PosixUDP::receivedAt()
+{
+  if (_rxCurrent < 0)
+    return micros64();
+
+  return _rx[_rxCurrent].receivedAt;
+}
+
+int PosixUDP::receiveBatch(int maxPackets)
+{
+  // Pull in as many queued datagrams as we can (up to maxPackets) in one go.
+  // Until flushBatch() is called, parsePacket() only hands out these datagrams
+  // and endPacket() only queues replies.
+
+  int n = 0;
+
+  _rxCount   = 0;
+  _rxNext    = 0;
+  _rxCurrent = -1;
+  _rxPos     = 0;
+  _txCount   = 0;
+  _batching  = true;
+
+  if (_fd < 0 || maxPackets <= 0)
+    return 0;
+
+  if (maxPackets > L_POSIX_UDP_MAX_BATCH)
+    maxPackets = L_POSIX_UDP_MAX_BATCH;
+
+#ifdef __linux__
+  struct mmsghdr msgs[L_POSIX_UDP_MAX_BATCH];
+  struct iovec   iov[L_POSIX_UDP_MAX_BATCH];
+  uint64_t       now;
+  int64_t        nowRealNs;
+  int            i;
+
+  for (i = 0; i < maxPackets; i++)
+  {
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    _prepareReceive(i, &msgs[i].msg_hdr, &iov[i]);
+  }
+
+  n = recvmmsg(_fd, msgs, maxPackets, MSG_DONTWAIT | MSG_TRUNC, NULL);
+  now = micros64();
+  nowRealNs = _realtimeNs();
+
+  if (n < 0)
+    n = 0;
+
+  for (i = 0; i < n; i++)
+    _completeReceive(i, &msgs[i].msg_hdr, (int)msgs[i].msg_len, now, nowRealNs);
+#else
+  for (n = 0; n < maxPackets; n++)
+  {
+    struct msghdr msg;
+    struct iovec  iov;
+    ssize_t       rx;
+
+    _prepareReceive(n, &msg, &iov);
+
+    rx = recvmsg(_fd, &msg, MSG_DONTWAIT | MSG_TRUNC);
+
+    if (rx <= 0)
+      break;
+
+    _completeReceive(n, &msg, (int)rx, micros64(), _realtimeNs());
+  }
+#endif
+
+  _rxCount = n;
+
+  return n;
+}
+
+int PosixUDP::flushBatch()
+{
+  // Sends every reply queued since receiveBatch() and closes the batch
+
+  int i, sent = 0;
+
+  _batching  = false;
+  _txPending = NULL;
+
+  if (_fd < 0)
+  {
+    _txCount = 0;
+    return 0;
+  }
+
+#ifdef __linux__
+  struct mmsghdr msgs[L_POSIX_UDP_MAX_BATCH];
+  struct iovec   iov[L_POSIX_UDP_MAX_BATCH];
+
+  for (i = 0; i < _txCount; i++)
+  {
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    _prepareSend(&_tx[i], &msgs[i].msg_hdr, &iov[i]);
+  }
+
+  while (sent < _txCount)
+  {
+    int n = sendmmsg(_fd, &msgs[sent], _txCount - sent, MSG_DONTWAIT);
+
+    if (n <= 0)
+      break;
+
+    sent += n;
+  }
+#else
+  for (i = 0; i < _txCount; i++)
+  {
+    struct msghdr msg;
+    struct iovec  iov;
+
+    _prepareSend(&_tx[i], &msg, &iov);
+
+    if (sendmsg(_fd, &msg, MSG_DONTWAIT) >= 0)
+      sent++;
+  }
+#endif
+
+  _txNextId += sent;
+  _txCount   = 0;
+
+  return sent;
+}
+
+bool PosixUDP::lastTxId(uint32_t *id)
+{
+  *id = _txLastId;
+  return _txLastIdValid;
+}
+
+int PosixUDP::readTxTimestamps(S_POSIX_UDP_TX_TIMESTAMP *out, int max)
+{
+  // Drains up to max transmit timestamps from the error queue. This also has to
+  // be done when nobody wants them: they are charged to the receive buffer.
+
+  int n = 0;
+
+#ifdef L_POSIX_UDP_TX_TIMESTAMPS
+  struct mmsghdr msgs[L_POSIX_UDP_MAX_BATCH];
+  uint64_t       control[L_POSIX_UDP_MAX_BATCH][16];
+  uint64_t       now;
+  int64_t        nowRealNs;
+  int            i, count, received;
+
+  if (_fd < 0 || !_txTimestamps)
+    return 0;
+
+  count = (max < L_POSIX_UDP_MAX_BATCH ? max : L_POSIX_UDP_MAX_BATCH);
+
+  for (i = 0; i < count; i++)
+  {
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_control    = control[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+  }
+
+  received  = recvmmsg(_fd, msgs, count, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+  now       = micros64();
+  nowRealNs = _realtimeNs();
+
+  for (i = 0; i < received; i++)
+  {
+    struct cmsghdr *cmsg;
+    int64_t sentNs = 0, age;
+    bool    haveId = false;
+
+    for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+      {
+        struct timespec ts[3];
+
+        memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+        sentNs = (int64_t)ts[0].tv_sec * 1000000000LL + ts[0].tv_nsec;
+      }
+      else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+               (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+      {
+        struct sock_extended_err err;
+
+        memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+
+        if (err.ee_errno == ENOMSG && err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+        {
+          out[n].id = err.ee_data;
+          haveId    = true;
+        }
+      }
+    }
+
+    age = nowRealNs - sentNs;
+
+    // As on receive, anything implausible means the system clock was stepped
+    if (haveId && sentNs != 0 && age >= 0 && age < 1000000000LL)
+    {
+      out[n].readAt = now;
+      out[n].ageNs  = (uint32_t)age;
+      n++;
+    }
+  }
+#endif
+
+  return n;
+}
+
+#endif
@@ -0,0 +1,136 @@
+#pragma once
+
+/*
+ * PosixUDP.h
+ *
+ * Implements the Arduino UDP interface on top of a non-blocking POSIX
+ * datagram socket (recvmsg/sendmsg). This allows the NTPServer core to be
+ * run as a host daemon. Only available when building outside of Arduino.
+ *
+ * On Linux, datagrams can also be moved in batches: receiveBatch() pulls up to
+ * L_POSIX_UDP_MAX_BATCH datagrams with a single recvmmsg() which are then
+ * handed out one at a time by parsePacket(), and replies written while a
+ * batch is open are queued and sent with a single sendmmsg() by flushBatch().
+ *
+ * A socket bound to a wildcard address (0.0.0.0 or ::) notes the local address
+ * every datagram was sent to (IP_PKTINFO/IPV6_PKTINFO), and a reply to it is
+ * sent from that address, so that clients of a multi-homed host see the answer
+ * come from the address they asked. IPv6 sockets are IPv6 only.
+ *
+ * Where supported (SO_TIMESTAMPNS), the kernel stamps every datagram on
+ * arrival, so that the receive time is not skewed by time spent queued. On
+ * Linux it can also stamp every datagram as it leaves (SO_TIMESTAMPING, see
+ * setTxTimestamps()). Those stamps come back later on the socket's error
+ * queue, tagged with the running count of datagrams sent (lastTxId()), and are
+ * picked up with readTxTimestamps().
+ */
+
+#ifndef ARDUINO
+
+#include "NTPHostCompat.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define L_POSIX_UDP_MAX_DATAGRAM   1500   /* Largest datagram buffered by parsePacket() */
+#define L_POSIX_UDP_MAX_BATCH        32   /* Max datagrams moved per recvmmsg/sendmmsg */
+
+typedef struct s_posix_udp_datagram
+{
+  unsigned char           data[L_POSIX_UDP_MAX_DATAGRAM];
+  int                     length;       // Bytes held in data
+  int                     size;         // Size of the datagram on the wire (may exceed length)
+  struct sockaddr_storage addr;         // Source (rx) or destination (tx)
+  socklen_t               addrLen;
+  uint64_t                receivedAt;   // micros64() when the datagram was read from the socket
+  uint32_t                queuedNs;     // Time spent in the socket queue before that, per kernel timestamp (0 = unknown)
+  uint64_t                control[24];  // Ancillary data: kernel timestamps and local address (rx), source address (tx)
+  socklen_t               controlLen;   // Tx: bytes of control in use
+  int                     localFamily;  // Rx: family of the address the datagram was sent to, 0 = unknown
+  uint8_t                 localAddr[16];
+  unsigned int            localIfIndex; // Rx: interface it came in on (IPv6)
+} S_POSIX_UDP_DATAGRAM;
+
+typedef struct s_posix_udp_tx_timestamp
+{
+  uint32_t                id;           // lastTxId() of the datagram
+  uint64_t                readAt;       // micros64() when the timestamp was read
+  uint32_t                ageNs;        // How long before that the datagram was sent
+} S_POSIX_UDP_TX_TIMESTAMP;
+
+class PosixUDP : public UDP
+{
+protected:
+  int _fd;
+
+  /* Inbound datagrams. _rxCurrent indexes the datagram being read, if any */
+  S_POSIX_UDP_DATAGRAM    _rx[L_POSIX_UDP_MAX_BATCH];
+  int                     _rxCount;
+  int                     _rxNext;
+  int                     _rxCurrent;
+  int                     _rxPos;
+
+  /* Outbound datagrams. Only more than one is queued while a batch is open */
+  S_POSIX_UDP_DATAGRAM    _tx[L_POSIX_UDP_MAX_BATCH];
+  int                     _txCount;
+  S_POSIX_UDP_DATAGRAM   *_txPending;   // Datagram being assembled between beginPacket/endPacket
+
+  bool                    _batching;
+  bool                    _reusePort;
+  bool                    _pktInfo;     // Bound to a wildcard address, replies need their source set
+  bool                    _kernelTimestamps;
+  bool                    _txTimestampsWanted;
+  bool                    _txTimestamps;
+  uint32_t                _txNextId;    // Id the kernel gives the next datagram sent
+  uint32_t                _txLastId;
+  bool                    _txLastIdValid;
+
+  int _setAddress(struct sockaddr_storage *addr, socklen_t *addrLen, IPAddress ip, uint16_t port);
+  void _prepareReceive(int slot, struct msghdr *msg, struct iovec *iov);
+  void _completeReceive(int slot, const struct msghdr *msg, int cbReceived, uint64_t now, int64_t nowRealNs);
+  void _prepareSend(S_POSIX_UDP_DATAGRAM *d, struct msghdr *msg, struct iovec *iov);
+  void _setSource(S_POSIX_UDP_DATAGRAM *d, const S_POSIX_UDP_DATAGRAM *request);
+  int64_t _realtimeNs();
+
+public:
+  PosixUDP();
+  virtual ~PosixUDP();
+
+  virtual uint8_t begin(uint16_t port);                      // 0.0.0.0
+  virtual uint8_t begin(IPAddress localIP, uint16_t port);   // IPv4 or IPv6, wildcard or one interface's address
+  virtual void stop();
+
+  virtual int beginPacket(IPAddress ip, uint16_t port);
+  virtual int beginPacket(const char *host, uint16_t port);
+  virtual int endPacket();
+  virtual size_t write(uint8_t b);
+  virtual size_t write(const uint8_t *buffer, size_t size);
+
+  virtual int parsePacket();
+  virtual int available();
+  virtual int read();
+  virtual int read(unsigned char *buffer, size_t len);
+  virtual int read(char *buffer, size_t len);
+  virtual int peek();
+  virtual void flush();
+
+  virtual IPAddress remoteIP();
+  virtual uint16_t remotePort();
+
+  int receiveBatch(int maxPackets);     // Queues up to maxPackets datagrams, returns # queued
+  int flushBatch();                     // Sends all replies queued since receiveBatch()
+
+  void setReusePort(bool enable) { _reusePort = enable; }   // SO_REUSEPORT, must be set before begin()
+  void setTxTimestamps(bool enable) { _txTimestampsWanted = enable; }   // Must be set before begin()
+  bool hasTxTimestamps() { return _txTimestamps; }
+
+  bool lastTxId(uint32_t *id);          // Id of the datagram of the last endPacket(), false if it was not sent
+  uint32_t nextTxId() { return _txNextId; }
+  int  readTxTimestamps(S_POSIX_UDP_TX_TIMESTAMP *out, int max);   // Returns # read, 0 if none are waiting
+
+  uint64_t receivedAt();                // micros64() at which the current datagram was received
+  uint32_t receiveQueuedNs();           // How long it was queued in the kernel before that (0 if unknown)
+  int getFd() { return _fd; }
+};
+
+#endif
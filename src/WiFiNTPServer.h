@@ -21,8 +21,10 @@ class WiFiNTPServer : public NTPServer
 	
 	void begin(int portNum)
 	{
-		_udp = new WiFiUDP();
-		_udp->begin(portNum);
+		WiFiUDP *udp = new WiFiUDP();
+
+		udp->begin(portNum);
+		NTPServer::begin(*udp);
 	}
 	
 	void begin()